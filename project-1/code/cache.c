@@ -0,0 +1,344 @@
+/**
+ * @file cache.c
+ * @brief Content hash and result cache for the maximum submatrix sum problem.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static unsigned long long Rotl(unsigned long long x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long long Read64(const unsigned char *p)
+{
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned long long Round(unsigned long long acc, unsigned long long input)
+{
+    acc += input * PRIME64_2;
+    acc = Rotl(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static unsigned long long MergeRound(unsigned long long acc, unsigned long long v)
+{
+    acc ^= Round(0, v);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/**
+ * @brief Content hash of a matrix.
+ *
+ * This is the xxHash64 algorithm over the elements, seeded with the
+ * dimensions. The main loop keeps four independent accumulators and consumes
+ * 32 bytes per step, so the four lanes run in parallel in the pipeline and
+ * the hash is bound by memory bandwidth rather than by the multiply latency.
+ */
+unsigned long long HashMatrix(const Matrix *m)
+{
+    const unsigned char *p = (const unsigned char *)m->data;
+    size_t length = sizeof(int) * (size_t)m->rows * m->cols;
+    const unsigned char *end = p + length;
+    unsigned long long seed = ((unsigned long long)(unsigned)m->rows << 32) | (unsigned)m->cols;
+    unsigned long long h;
+
+    if (length >= 32)
+    {
+        unsigned long long v1 = seed + PRIME64_1 + PRIME64_2;
+        unsigned long long v2 = seed + PRIME64_2;
+        unsigned long long v3 = seed;
+        unsigned long long v4 = seed - PRIME64_1;
+        const unsigned char *limit = end - 32;
+        do
+        {
+            v1 = Round(v1, Read64(p));
+            v2 = Round(v2, Read64(p + 8));
+            v3 = Round(v3, Read64(p + 16));
+            v4 = Round(v4, Read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+        h = MergeRound(h, v1);
+        h = MergeRound(h, v2);
+        h = MergeRound(h, v3);
+        h = MergeRound(h, v4);
+    }
+    else
+        h = seed + PRIME64_5;
+    h += length;
+
+    // The tail is made of whole ints, so at most one 4-byte word is left after
+    // the 8-byte words.
+    while (p + 8 <= end)
+    {
+        h ^= Round(0, Read64(p));
+        h = Rotl(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end)
+    {
+        unsigned int v;
+        memcpy(&v, p, sizeof(v));
+        h ^= (unsigned long long)v * PRIME64_1;
+        h = Rotl(h, 23) * PRIME64_2 + PRIME64_3;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * @brief Create a result cache
+ *
+ * @param capacity Maximum number of results kept in memory.
+ * @param directory Directory of the on-disk cache, created if needed. NULL
+ * means in-memory only.
+ * @return ResultCache* Pointer to the cache.
+ */
+ResultCache *CreateResultCache(int capacity, const char *directory)
+{
+    ResultCache *cache = (ResultCache *)malloc(sizeof(ResultCache));
+    cache->capacity = capacity > 0 ? capacity : 1;
+    cache->size = 0;
+    cache->num_buckets = 2 * cache->capacity;
+    cache->buckets = (CacheEntry **)calloc(cache->num_buckets, sizeof(CacheEntry *));
+    cache->head = cache->tail = NULL;
+    cache->directory = NULL;
+    if (directory != NULL)
+    {
+        cache->directory = (char *)malloc(strlen(directory) + 1);
+        strcpy(cache->directory, directory);
+        mkdir(directory, 0755);
+    }
+    cache->memory_hits = 0;
+    cache->disk_hits = 0;
+    cache->misses = 0;
+    return cache;
+}
+
+static int SameKey(const CacheKey *a, const CacheKey *b)
+{
+    return a->hash == b->hash && a->rows == b->rows && a->cols == b->cols &&
+           a->algorithm == b->algorithm;
+}
+
+static CacheEntry **Bucket(ResultCache *cache, const CacheKey *key)
+{
+    return &cache->buckets[(key->hash ^ (unsigned)key->algorithm) % cache->num_buckets];
+}
+
+static void Unlink(ResultCache *cache, CacheEntry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        cache->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        cache->tail = e->prev;
+}
+
+static void PushFront(ResultCache *cache, CacheEntry *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head)
+        cache->head->prev = e;
+    cache->head = e;
+    if (!cache->tail)
+        cache->tail = e;
+}
+
+static CacheEntry *Lookup(ResultCache *cache, const CacheKey *key)
+{
+    for (CacheEntry *e = *Bucket(cache, key); e != NULL; e = e->bucket_next)
+    {
+        if (SameKey(&e->key, key))
+        {
+            // Mark as most recently used.
+            Unlink(cache, e);
+            PushFront(cache, e);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Put a copy of the result into the in-memory cache, evicting the least
+ * recently used entry if the cache is full.
+ */
+static void Insert(ResultCache *cache, const CacheKey *key, Matrix *result)
+{
+    if (cache->size == cache->capacity)
+    {
+        CacheEntry *victim = cache->tail;
+        Unlink(cache, victim);
+        CacheEntry **link = Bucket(cache, &victim->key);
+        while (*link != victim)
+            link = &(*link)->bucket_next;
+        *link = victim->bucket_next;
+        FreeMatrix(victim->result);
+        free(victim);
+        cache->size--;
+    }
+    CacheEntry *e = (CacheEntry *)malloc(sizeof(CacheEntry));
+    e->key = *key;
+    e->result = CopyMatrix(result);
+    CacheEntry **bucket = Bucket(cache, key);
+    e->bucket_next = *bucket;
+    *bucket = e;
+    PushFront(cache, e);
+    cache->size++;
+}
+
+static void CachePath(const ResultCache *cache, const CacheKey *key, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx_%d_%d_%d.txt", cache->directory, key->hash,
+             key->rows, key->cols, key->algorithm);
+}
+
+/**
+ * @brief Load a result from the on-disk cache.
+ *
+ * @return Matrix* The result, NULL if it is not cached or the file is broken.
+ */
+static Matrix *LoadResult(const ResultCache *cache, const CacheKey *key)
+{
+    char path[4096];
+    CachePath(cache, key, path, sizeof(path));
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return NULL;
+    int rows, cols;
+    if (fscanf(fp, "%d %d", &rows, &cols) != 2 || rows <= 0 || cols <= 0 ||
+        rows > key->rows || cols > key->cols)
+    {
+        fclose(fp);
+        return NULL;
+    }
+    Matrix *result = CreateMatrix(rows, cols);
+    for (int i = 0; i < rows * cols; i++)
+    {
+        if (fscanf(fp, "%d", &result->data[i]) != 1)
+        {
+            fclose(fp);
+            FreeMatrix(result);
+            return NULL;
+        }
+    }
+    fclose(fp);
+    return result;
+}
+
+/**
+ * @brief Store a result in the on-disk cache.
+ *
+ * The file is written under a temporary name and renamed, so a concurrent
+ * reader never sees a partial result.
+ */
+static void StoreResult(const ResultCache *cache, const CacheKey *key, Matrix *result)
+{
+    char path[4096];
+    char temp[4096 + 32];
+    CachePath(cache, key, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)getpid());
+    FILE *fp = fopen(temp, "w");
+    if (fp == NULL)
+        return;
+    fprintf(fp, "%d %d\n", result->rows, result->cols);
+    PrintMatrix(result, fp);
+    if (fclose(fp) != 0 || rename(temp, path) != 0)
+        remove(temp);
+}
+
+/**
+ * @brief Maximum submatrix sum through the result cache.
+ *
+ * The matrix is hashed and looked up in memory first, then on disk. Only when
+ * both miss, solve() is called and its result is stored in both places.
+ *
+ * Like the algorithms in the mss module, this function always returns a new
+ * matrix which must be freed by the caller.
+ *
+ * @param cache Result cache.
+ * @param m Pointer to the matrix.
+ * @param algorithm Algorithm number, part of the key.
+ * @param solve The algorithm.
+ * @return Matrix* Pointer to the result matrix.
+ */
+Matrix *CachedMaxSubmatrix(ResultCache *cache, Matrix *m, int algorithm, Matrix *(*solve)(Matrix *))
+{
+    CacheKey key = {HashMatrix(m), m->rows, m->cols, algorithm};
+    CacheEntry *e = Lookup(cache, &key);
+    if (e != NULL)
+    {
+        cache->memory_hits++;
+        return CopyMatrix(e->result);
+    }
+
+    Matrix *result = NULL;
+    if (cache->directory != NULL)
+        result = LoadResult(cache, &key);
+    if (result != NULL)
+        cache->disk_hits++;
+    else
+    {
+        cache->misses++;
+        result = solve(m);
+        if (cache->directory != NULL)
+            StoreResult(cache, &key, result);
+    }
+    Insert(cache, &key, result);
+    return result;
+}
+
+/**
+ * @brief Print the hit and miss counters of the cache.
+ */
+void PrintCacheStats(const ResultCache *cache, FILE *fp)
+{
+    fprintf(fp, "cache: memory_hits=%ld disk_hits=%ld misses=%ld\n",
+            cache->memory_hits, cache->disk_hits, cache->misses);
+}
+
+/**
+ * @brief Free the result cache.
+ *
+ * The on-disk cache is kept.
+ */
+void FreeResultCache(ResultCache *cache)
+{
+    if (cache == NULL)
+        return;
+    CacheEntry *e = cache->head;
+    while (e != NULL)
+    {
+        CacheEntry *next = e->next;
+        FreeMatrix(e->result);
+        free(e);
+        e = next;
+    }
+    free(cache->buckets);
+    free(cache->directory);
+    free(cache);
+}
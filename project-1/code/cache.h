@@ -0,0 +1,69 @@
+/**
+ * @file cache.h
+ * @brief Result cache for repeated maximum submatrix queries.
+ *
+ * Results are keyed by a content hash of the input matrix, its dimensions and
+ * the algorithm, so solving a matrix which was already solved only costs one
+ * hash pass over its elements.
+ */
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "mss.h"
+
+unsigned long long HashMatrix(const Matrix *m);
+
+/**
+ * @brief Key of a cached result.
+ */
+struct CacheKey
+{
+    unsigned long long hash;
+    int rows;
+    int cols;
+    int algorithm;
+};
+typedef struct CacheKey CacheKey;
+
+/**
+ * @brief Entry of the in-memory cache.
+ *
+ * Entries are chained in their hash bucket and in a doubly linked list from
+ * the most recently used one to the least recently used one.
+ */
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry
+{
+    CacheKey key;
+    Matrix *result;
+    CacheEntry *bucket_next;
+    CacheEntry *prev, *next;
+};
+
+/**
+ * @brief Result cache.
+ *
+ * The in-memory part is an LRU cache of at most capacity results. If
+ * directory is not NULL, results are also stored there, one file per key in
+ * the data file format, and survive the process.
+ */
+struct ResultCache
+{
+    int capacity;
+    int size;
+    int num_buckets;
+    CacheEntry **buckets;
+    CacheEntry *head, *tail;
+    char *directory;
+    long memory_hits;
+    long disk_hits;
+    long misses;
+};
+typedef struct ResultCache ResultCache;
+
+ResultCache *CreateResultCache(int capacity, const char *directory);
+Matrix *CachedMaxSubmatrix(ResultCache *cache, Matrix *m, int algorithm, Matrix *(*solve)(Matrix *));
+void PrintCacheStats(const ResultCache *cache, FILE *fp);
+void FreeResultCache(ResultCache *cache);
+
+#endif
@@ -7,18 +7,36 @@
  *
  * @section usage Usage
  *
- * ./mss <datafile> <algorithm> [iteration]
+ * ./mss <datafile> <algorithm> [iteration] [options]
  *
  * - datafile: The name of the data file.
  *
  * - algorithm: The algorithm to be tested. 1 means the N6 version, 2 means the
- *   N4 version, 3 means my version.
+ *   N4 version, 3 means my version, 4 means my version without the fixed-size
+ *   kernels (always the generic path), 5 and 6 mean the tiled N4 version and
+ *   the tiled version of mine.
  *
  * - iteration: The number of iterations to run the algorithm. If not specified,
  *   the program will run the algorithm at least once until the total time is
  *   more than 5 second.
  *
- * This program will print the result matrix to the standard output.
+ * - options: Allocation options of the input matrix, see CreateMatrixEx().
+ *   - --huge=thp|explicit: back the matrix with transparent or explicit huge
+ *     pages.
+ *   - --numa=interleave|first-touch: interleave the pages over all NUMA nodes,
+ *     or let each of the threads touch its own block of rows first.
+ *   - --threads=N: number of first-touch threads, one per CPU by default.
+ *
+ * - --cache[=directory]: Look the result up in a result cache keyed by a
+ *   content hash of the matrix before solving it. Without a directory the
+ *   cache is in memory only, so only the repeated iterations hit it. With a
+ *   directory, results are also stored there and reused by later runs. The
+ *   hit and miss counters are printed at the end.
+ *
+ * This program will print the result matrix to the standard output. When an
+ * allocation option is given, it also prints the applied options, the data TLB
+ * misses during the run, the pages of the matrix on each NUMA node and the
+ * size of the huge pages backing it.
  *
  * @mainpage Maximum Submatrix Sum Project
  *
@@ -56,18 +74,101 @@
 #include <string.h>
 #include <stdlib.h>
 #include "mss.h"
+#include "cache.h"
+
+/**
+ * @brief Parse one allocation option.
+ *
+ * @return int 0 on success, -1 if the option is invalid.
+ */
+static int ParseOption(const char *option, MatrixAllocOptions *options)
+{
+    if (strcmp(option, "--huge=thp") == 0)
+        options->huge_page = HUGE_PAGE_TRANSPARENT;
+    else if (strcmp(option, "--huge=explicit") == 0)
+        options->huge_page = HUGE_PAGE_EXPLICIT;
+    else if (strcmp(option, "--numa=interleave") == 0)
+        options->numa = NUMA_INTERLEAVE;
+    else if (strcmp(option, "--numa=first-touch") == 0)
+        options->numa = NUMA_FIRST_TOUCH;
+    else if (strncmp(option, "--threads=", 10) == 0)
+        options->threads = atoi(option + 10);
+    else
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief Print the placement of the matrix and the TLB misses of the run.
+ */
+static void PrintMemoryStats(Matrix *mat, long long tlb_misses)
+{
+    printf("allocation: huge=%s numa=%s\n", HugePageName(mat->alloc.huge_page),
+           NumaPolicyName(mat->alloc.numa));
+    if (tlb_misses >= 0)
+        printf("dtlb_read_misses: %lld\n", tlb_misses);
+    else
+        printf("dtlb_read_misses: n/a\n");
+    long pages[MAX_NUMA_NODES];
+    if (ReadNumaPages(mat->data, pages) > 0)
+    {
+        printf("numa_pages:");
+        for (int node = 0; node < MAX_NUMA_NODES; node++)
+            if (pages[node] > 0)
+                printf(" N%d=%ld", node, pages[node]);
+        printf("\n");
+    }
+    else
+        printf("numa_pages: n/a\n");
+    long huge_kb = ReadHugePagesKb(mat->data);
+    if (huge_kb >= 0)
+        printf("huge_pages_kb: %ld\n", huge_kb);
+    else
+        printf("huge_pages_kb: n/a\n");
+}
 
 int main(int argc, char *argv[])
 {
+    // Split the allocation options from the other arguments.
+    MatrixAllocOptions options = {HUGE_PAGE_NONE, NUMA_DEFAULT, 0};
+    int use_options = 0;
+    int use_cache = 0;
+    char *cache_directory = NULL;
+    char *args[3];
+    int num_args = 0;
+    for (int k = 1; k < argc; k++)
+    {
+        if (strcmp(argv[k], "--cache") == 0)
+            use_cache = 1;
+        else if (strncmp(argv[k], "--cache=", 8) == 0)
+        {
+            use_cache = 1;
+            cache_directory = argv[k] + 8;
+        }
+        else if (strncmp(argv[k], "--", 2) == 0)
+        {
+            if (ParseOption(argv[k], &options) != 0)
+            {
+                printf("Error: invalid option %s.\n", argv[k]);
+                return 0;
+            }
+            use_options = 1;
+        }
+        else if (num_args < 3)
+            args[num_args++] = argv[k];
+        else
+            num_args = 4;
+    }
+
     // Check the number of arguments.
-    if (argc != 4 && argc != 3)
+    if (num_args != 3 && num_args != 2)
     {
-        printf("Usage: ./mss <datafile> <algorithm> [iteration]\n");
+        printf("Usage: ./mss <datafile> <algorithm> [iteration] [options]\n");
         return 0;
     }
 
     // Read the matrix from the file.
-    char *filename = argv[1];
+    char *filename = args[0];
     FILE *fp = fopen(filename, "r");
     if (fp == NULL)
     {
@@ -82,71 +183,96 @@ int main(int argc, char *argv[])
         printf("Error: invalid data file.\n");
         return 0;
     }
-    Matrix *mat = CreateMatrix(n, m);
-    ReadMatrix(mat, fp);
+    Matrix *mat = use_options ? CreateMatrixEx(n, m, &options) : CreateMatrix(n, m);
+    MatrixStats *stats = CreateMatrixStats(n, m);
+    ReadMatrix(mat, fp, stats);
     fclose(fp);
 
     // Check if there is no positive element in the matrix.
-    for(int i = 0; i < n * m; i++)
+    if (stats->positive_count == 0)
     {
-        if(mat->data[i] > 0)
-            break;
-        if(i == n * m - 1)
-        {
-            printf("Error: no positive element in the matrix.\n");
-            return 0;
-        }
+        printf("Error: no positive element in the matrix.\n");
+        return 0;
     }
+    // The algorithms accumulate sums in int.
+    if (!SumFitsInInt(stats))
+        printf("Warning: submatrix sums may overflow int.\n");
+    FreeMatrixStats(stats);
     
     // Run the algorithm and calculate the time.
-    int algorithm = atoi(argv[2]);
+    int algorithm = atoi(args[1]);
     int iteration = 0;
-    if (argc == 4)
-        iteration = atoi(argv[3]);
+    if (num_args == 3)
+        iteration = atoi(args[2]);
     int ticks = 0;
     double total_time = 0;
     double duration = 0;
     Matrix *result = NULL;
+    Matrix *(*solve)(Matrix *) = NULL;
+    // Use different algorithm according to the argument.
+    switch (algorithm)
+    {
+    case 1:
+        solve = MaxSubmatrixN6;
+        break;
+    case 2:
+        solve = MaxSubmatrixN4;
+        break;
+    case 3:
+        solve = MaxSubmatrix;
+        break;
+    case 4:
+        solve = MaxSubmatrixGeneric;
+        break;
+    case 5:
+        solve = MaxSubmatrixN4Tiled;
+        break;
+    case 6:
+        solve = MaxSubmatrixTiled;
+        break;
+    default:
+        printf("Error: invalid algorithm.\n");
+        return 0;
+    }
+    ResultCache *cache = use_cache ? CreateResultCache(16, cache_directory) : NULL;
     clock_t start, end;
     int i = 0;
+    int tlb_counter = use_options ? OpenTlbCounter() : -1;
+    // Time the loop as a whole: a small matrix is solved in less than one
+    // clock tick, so per-iteration measurements would mostly read zero.
+    start = clock();
     // Run the algorithm at least once
     do
     {
-        start = clock();
-        // Use different algorithm according to the argument.
-        switch (algorithm)
-        {
-        case 1:
-            result = MaxSubmatrixN6(mat);
-            break;
-        case 2:
-            result = MaxSubmatrixN4(mat);
-            break;
-        case 3:
-            result = MaxSubmatrix(mat);
-            break;
-        default:
-            printf("Error: invalid algorithm.\n");
-            return 0;
-        }
+        // Only the result of the last iteration is printed.
+        FreeMatrix(result);
+        if (cache != NULL)
+            result = CachedMaxSubmatrix(cache, mat, algorithm, solve);
+        else
+            result = solve(mat);
         end = clock();
         // Calculate the time.
-        ticks += end - start;
-        total_time += (double)(end - start) / CLOCKS_PER_SEC;
-        duration += (double)(end - start) / CLOCKS_PER_SEC;
+        total_time = (double)(end - start) / CLOCKS_PER_SEC;
         i++;
         // End the loop if the total time is more than 5 second. Or if the
         // iteration is specified, end the loop if the iteration is reached.
-    }while((argc == 3 && total_time < 5) || i < iteration);
-    FreeMatrix(mat);
-    duration /= i;
+    }while((num_args == 2 && total_time < 5) || i < iteration);
+    long long tlb_misses = ReadTlbCounter(tlb_counter);
+    ticks = end - start;
+    duration = total_time / i;
 
     // Print the result matrix to the standard output.
-    printf("datafile: %s\n", argv[1]);
+    printf("datafile: %s\n", filename);
     printf("algorithm: %d\n", algorithm);
     printf("MaxSubmatrix: \n");
     PrintMatrix(result, stdout);
     FreeMatrix(result);
+    if (use_options)
+        PrintMemoryStats(mat, tlb_misses);
+    if (cache != NULL)
+        PrintCacheStats(cache, stdout);
+    FreeResultCache(cache);
+    FreeMatrix(mat);
 
     // Test if the report file already exists. Or else create a new one and
     // write the header.
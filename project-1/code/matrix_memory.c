@@ -0,0 +1,427 @@
+/**
+ * @file matrix_memory.c
+ * @brief Huge page and NUMA aware allocation, and memory statistics.
+ *
+ * Everything in this file is Linux specific. The allocation always succeeds
+ * with normal pages when huge pages or NUMA policies are not available.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include "matrix_memory.h"
+
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+/**
+ * @brief Map anonymous memory aligned to the huge page size.
+ *
+ * A huge page can only back an aligned range, so the mapping is made larger
+ * than needed and the unaligned head and tail are unmapped.
+ */
+static void *MapAligned(size_t length)
+{
+    char *p = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return MAP_FAILED;
+    char *aligned = (char *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > p)
+        munmap(p, aligned - p);
+    if (p + HUGE_PAGE_SIZE > aligned)
+        munmap(aligned + length, p + HUGE_PAGE_SIZE - aligned);
+    return aligned;
+}
+
+/**
+ * @brief Read a list of ranges from sysfs, e.g. "0-1" or "0,2-3".
+ *
+ * @param path File holding the list.
+ * @param set set[i] is set to 1 for each i in the list below max.
+ * @param max Size of set.
+ * @return int Number of elements of the list below max, -1 if the file can't
+ * be read.
+ */
+static int ReadRangeList(const char *path, unsigned char *set, int max)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    int count = 0;
+    int first, last;
+    while (fscanf(fp, "%d", &first) == 1)
+    {
+        last = first;
+        int c = fgetc(fp);
+        if (c == '-')
+        {
+            if (fscanf(fp, "%d", &last) != 1)
+                break;
+            c = fgetc(fp);
+        }
+        for (int i = first; i <= last && i < max; i++)
+            if (i >= 0 && !set[i])
+            {
+                set[i] = 1;
+                count++;
+            }
+        if (c != ',')
+            break;
+    }
+    fclose(fp);
+    return count;
+}
+
+/**
+ * @brief Interleave the pages of a mapping over all online NUMA nodes.
+ *
+ * @return int 0 on success, -1 if the policy can't be applied.
+ */
+static int Interleave(void *addr, size_t length)
+{
+    unsigned char online[8 * sizeof(unsigned long)] = {0};
+    if (ReadRangeList("/sys/devices/system/node/online", online, (int)sizeof(online)) <= 0)
+        return -1;
+    unsigned long mask = 0;
+    for (int node = 0; node < (int)sizeof(online); node++)
+        if (online[node])
+            mask |= 1UL << node;
+    // The kernel reads maxnode - 1 bits of the mask.
+    if (syscall(SYS_mbind, addr, length, MPOL_INTERLEAVE, &mask, 8 * sizeof(mask) + 1, 0) != 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief CPUs to run the threads working on each block of rows on.
+ *
+ * The CPUs this process may run on are listed node after node, and thread t
+ * of threads gets the one at t * CPUs / threads, so consecutive blocks of
+ * rows go to CPUs of the same node and every node gets its share of the
+ * blocks. Without NUMA information the CPUs are taken in their own order.
+ *
+ * FirstTouch() pins the thread touching block t to cpus[t]; a parallel solver
+ * partitioning the rows the same way should pin its threads with this
+ * function too, so that each of them reads memory of its own node.
+ *
+ * @param threads Number of blocks of rows.
+ * @param cpus CPU of each block.
+ * @return int 0 on success, -1 if the CPUs can't be read.
+ */
+int RowBlockCpus(int threads, int *cpus)
+{
+    cpu_set_t allowed;
+    if (threads < 1 || sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return -1;
+    int *order = (int *)malloc(sizeof(int) * CPU_SETSIZE);
+    unsigned char *listed = (unsigned char *)calloc(CPU_SETSIZE, 1);
+    if (order == NULL || listed == NULL)
+    {
+        free(order);
+        free(listed);
+        return -1;
+    }
+    int count = 0;
+    for (int node = 0; node < MAX_NUMA_NODES; node++)
+    {
+        char path[64];
+        unsigned char cpus_of_node[CPU_SETSIZE] = {0};
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+        if (ReadRangeList(path, cpus_of_node, CPU_SETSIZE) <= 0)
+            continue;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (cpus_of_node[cpu] && !listed[cpu] && CPU_ISSET(cpu, &allowed))
+            {
+                listed[cpu] = 1;
+                order[count++] = cpu;
+            }
+    }
+    // CPUs of no node, or no NUMA information at all.
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (!listed[cpu] && CPU_ISSET(cpu, &allowed))
+            order[count++] = cpu;
+    for (int t = 0; t < threads && count > 0; t++)
+        cpus[t] = order[(long)t * count / threads];
+    free(order);
+    free(listed);
+    return count > 0 ? 0 : -1;
+}
+
+/**
+ * @brief A block of rows to be touched first by one thread.
+ */
+struct TouchTask
+{
+    char *begin;
+    size_t bytes;
+};
+typedef struct TouchTask TouchTask;
+
+static void *Touch(void *arg)
+{
+    TouchTask *task = (TouchTask *)arg;
+    memset(task->begin, 0, task->bytes);
+    return NULL;
+}
+
+/**
+ * @brief Place the pages of each block of rows on the node of its thread.
+ *
+ * The rows are split into contiguous blocks, one per thread, and each thread
+ * writes its block first. Thread t is pinned to the CPU given by
+ * RowBlockCpus(), so block t lands on the node of that CPU whatever the
+ * scheduler does. A block whose thread can't be created is touched by the
+ * calling thread.
+ */
+static void FirstTouch(char *data, size_t bytes, int rows, int threads)
+{
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > rows)
+        threads = rows;
+    if (threads < 1)
+        threads = 1;
+    size_t row_bytes = bytes / rows;
+    pthread_t *ids = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    TouchTask *tasks = (TouchTask *)malloc(sizeof(TouchTask) * threads);
+    int *started = (int *)malloc(sizeof(int) * threads);
+    int *cpus = (int *)malloc(sizeof(int) * threads);
+    int pinned = cpus != NULL && RowBlockCpus(threads, cpus) == 0;
+    for (int t = 0; t < threads; t++)
+    {
+        size_t first = (size_t)rows * t / threads;
+        size_t last = (size_t)rows * (t + 1) / threads;
+        tasks[t].begin = data + first * row_bytes;
+        tasks[t].bytes = (last - first) * row_bytes;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (pinned)
+        {
+            cpu_set_t cpu;
+            CPU_ZERO(&cpu);
+            CPU_SET(cpus[t], &cpu);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+        }
+        started[t] = pthread_create(&ids[t], &attr, Touch, &tasks[t]) == 0;
+        pthread_attr_destroy(&attr);
+        if (!started[t])
+            Touch(&tasks[t]);
+    }
+    for (int t = 0; t < threads; t++)
+        if (started[t])
+            pthread_join(ids[t], NULL);
+    free(cpus);
+    free(started);
+    free(tasks);
+    free(ids);
+}
+
+/**
+ * @brief Map memory for the elements of a matrix.
+ *
+ * The options are updated to the policies actually applied, so the caller can
+ * tell whether a fallback happened.
+ *
+ * @param bytes Size of the elements.
+ * @param rows Rows of the matrix, used to partition first-touch placement.
+ * @param options Requested options, overwritten with the applied ones.
+ * @param mapped Length of the mapping, to be passed to UnmapElements().
+ * @return void* Pointer to the elements, NULL if even normal pages failed.
+ */
+void *MapElements(size_t bytes, int rows, MatrixAllocOptions *options, size_t *mapped)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t align = options->huge_page == HUGE_PAGE_NONE ? page : HUGE_PAGE_SIZE;
+    size_t length = (bytes + align - 1) / align * align;
+    void *data = MAP_FAILED;
+
+    if (options->huge_page == HUGE_PAGE_EXPLICIT)
+    {
+        data = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        // No reserved huge page left, try transparent huge pages.
+        if (data == MAP_FAILED)
+            options->huge_page = HUGE_PAGE_TRANSPARENT;
+    }
+    if (options->huge_page == HUGE_PAGE_TRANSPARENT)
+    {
+        data = MapAligned(length);
+        if (data != MAP_FAILED && madvise(data, length, MADV_HUGEPAGE) != 0)
+            options->huge_page = HUGE_PAGE_NONE;
+    }
+    if (data == MAP_FAILED)
+    {
+        options->huge_page = HUGE_PAGE_NONE;
+        data = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+            return NULL;
+    }
+
+    // Policies must be set before the pages are touched.
+    if (options->numa == NUMA_INTERLEAVE && Interleave(data, length) != 0)
+        options->numa = NUMA_DEFAULT;
+    if (options->numa == NUMA_FIRST_TOUCH)
+        FirstTouch((char *)data, bytes, rows, options->threads);
+
+    *mapped = length;
+    return data;
+}
+
+/**
+ * @brief Unmap memory returned by MapElements().
+ */
+void UnmapElements(void *data, size_t mapped)
+{
+    munmap(data, mapped);
+}
+
+const char *HugePageName(enum HugePage huge_page)
+{
+    switch (huge_page)
+    {
+    case HUGE_PAGE_TRANSPARENT:
+        return "transparent";
+    case HUGE_PAGE_EXPLICIT:
+        return "explicit";
+    default:
+        return "none";
+    }
+}
+
+const char *NumaPolicyName(enum NumaPolicy numa)
+{
+    switch (numa)
+    {
+    case NUMA_INTERLEAVE:
+        return "interleave";
+    case NUMA_FIRST_TOUCH:
+        return "first-touch";
+    default:
+        return "default";
+    }
+}
+
+/**
+ * @brief Count the pages of the mapping containing addr on each NUMA node.
+ *
+ * /proc/self/numa_maps lists the mappings sorted by their start address, so
+ * the mapping containing addr is the last one starting before it.
+ *
+ * @param addr Address inside the mapping.
+ * @param pages Number of pages on each node.
+ * @return int Number of nodes with pages, -1 if not available.
+ */
+int ReadNumaPages(const void *addr, long pages[MAX_NUMA_NODES])
+{
+    FILE *fp = fopen("/proc/self/numa_maps", "r");
+    if (fp == NULL)
+        return -1;
+    char line[4096];
+    char found[4096] = "";
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (strtoull(line, NULL, 16) > (uintptr_t)addr)
+            break;
+        strcpy(found, line);
+    }
+    fclose(fp);
+    if (found[0] == '\0')
+        return -1;
+
+    int nodes = 0;
+    memset(pages, 0, sizeof(long) * MAX_NUMA_NODES);
+    for (char *token = strtok(found, " \n"); token != NULL; token = strtok(NULL, " \n"))
+    {
+        int node;
+        long count;
+        if (sscanf(token, "N%d=%ld", &node, &count) == 2 && node >= 0 && node < MAX_NUMA_NODES)
+        {
+            pages[node] = count;
+            nodes++;
+        }
+    }
+    return nodes;
+}
+
+/**
+ * @brief Size in KiB of the huge pages backing the mapping containing addr.
+ *
+ * Both transparent (AnonHugePages) and explicit (Private_Hugetlb) huge pages
+ * are counted.
+ *
+ * @return long Size in KiB, -1 if not available.
+ */
+long ReadHugePagesKb(const void *addr)
+{
+    FILE *fp = fopen("/proc/self/smaps", "r");
+    if (fp == NULL)
+        return -1;
+    char line[4096];
+    int inside = 0;
+    long total = -1;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        unsigned long long start, end;
+        long kb;
+        if (sscanf(line, "%llx-%llx ", &start, &end) == 2)
+        {
+            if (inside)
+                break;
+            inside = start <= (uintptr_t)addr && (uintptr_t)addr < end;
+            if (inside)
+                total = 0;
+        }
+        else if (inside && (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1 ||
+                            sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1))
+        {
+            total += kb;
+        }
+    }
+    fclose(fp);
+    return total;
+}
+
+/**
+ * @brief Start counting data TLB read misses of this thread in user space.
+ *
+ * @return int File descriptor of the counter, -1 if perf events are not
+ * available (e.g. not permitted by kernel.perf_event_paranoid).
+ */
+int OpenTlbCounter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * @brief Read and close a counter opened by OpenTlbCounter().
+ *
+ * @return long long Number of misses, -1 if not available.
+ */
+long long ReadTlbCounter(int fd)
+{
+    if (fd < 0)
+        return -1;
+    long long count = -1;
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        count = -1;
+    close(fd);
+    return count;
+}
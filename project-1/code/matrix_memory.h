@@ -0,0 +1,87 @@
+/**
+ * @file matrix_memory.h
+ * @brief Placement of large matrices in memory.
+ *
+ * This file contains the allocation options for the elements of a matrix
+ * (huge pages and NUMA placement) and the functions to report how the memory
+ * was actually placed.
+ */
+#ifndef _MATRIX_MEMORY_H_
+#define _MATRIX_MEMORY_H_
+
+#include <stddef.h>
+
+/**
+ * @brief Huge page policy for the matrix elements.
+ *
+ * - HUGE_PAGE_NONE: normal pages.
+ * - HUGE_PAGE_TRANSPARENT: the memory is aligned to the huge page size and
+ *   advised with MADV_HUGEPAGE, the kernel may back it with transparent huge
+ *   pages.
+ * - HUGE_PAGE_EXPLICIT: the memory is mapped with MAP_HUGETLB from the pool of
+ *   reserved huge pages. If the pool is empty, transparent huge pages are used
+ *   instead.
+ */
+enum HugePage
+{
+    HUGE_PAGE_NONE,
+    HUGE_PAGE_TRANSPARENT,
+    HUGE_PAGE_EXPLICIT
+};
+
+/**
+ * @brief NUMA placement policy for the matrix elements.
+ *
+ * - NUMA_DEFAULT: pages land on the node of the thread touching them first,
+ *   which is the thread reading the matrix.
+ * - NUMA_INTERLEAVE: pages are interleaved over all online nodes.
+ * - NUMA_FIRST_TOUCH: the rows are split into as many contiguous blocks as
+ *   threads, and each block is touched first by its own thread, pinned to the
+ *   CPU given by RowBlockCpus(), like a parallel solver partitioning the matrix
+ *   by rows and pinning its threads the same way would do.
+ */
+enum NumaPolicy
+{
+    NUMA_DEFAULT,
+    NUMA_INTERLEAVE,
+    NUMA_FIRST_TOUCH
+};
+
+/**
+ * @brief Allocation options of a matrix.
+ *
+ * When an option can't be honored on this machine, the allocation falls back
+ * to the next weaker one, and the options stored in the matrix tell what was
+ * actually used.
+ */
+struct MatrixAllocOptions
+{
+    enum HugePage huge_page;
+    enum NumaPolicy numa;
+    int threads; /* number of first-touch threads, 0 means one per CPU */
+};
+typedef struct MatrixAllocOptions MatrixAllocOptions;
+
+void *MapElements(size_t bytes, int rows, MatrixAllocOptions *options, size_t *mapped);
+void UnmapElements(void *data, size_t mapped);
+const char *HugePageName(enum HugePage huge_page);
+const char *NumaPolicyName(enum NumaPolicy numa);
+int RowBlockCpus(int threads, int *cpus);
+
+/**
+ * @defgroup memstat Memory statistics
+ * @brief Report the placement of a mapping and the TLB misses of the process.
+ *
+ * All the statistics are read from the Linux kernel. Functions return -1 when
+ * the statistic is not available.
+ *
+ * @{
+ */
+#define MAX_NUMA_NODES 64
+int ReadNumaPages(const void *addr, long pages[MAX_NUMA_NODES]);
+long ReadHugePagesKb(const void *addr);
+int OpenTlbCounter(void);
+long long ReadTlbCounter(int fd);
+/** @} */ // end of memstat
+
+#endif
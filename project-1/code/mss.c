@@ -1,308 +1,734 @@
-/**
- * @file mss.c
- * @brief This file contains function implementations for the problem.
- */
-
-#include <stdio.h>
-#include <stdlib.h>
-#include "mss.h"
-
-/**
- * @brief Create a Matrix object
- *
- * This function uses malloc to allocate memory for the matrix structure and the
- * matrix elements. So you need not to allocate memory for the matrix before
- * calling this function.
- *
- * Because there is pointer in the matrix structure, you need to use
- * FreeMatrix() function to free the memory allocated for the matrix.
- */
-Matrix *CreateMatrix(const int rows, const int cols)
-{
-    Matrix *m = (Matrix *)malloc(sizeof(Matrix));
-    m->rows = rows;
-    m->cols = cols;
-    m->data = (int *)malloc(sizeof(int) * rows * cols);
-    // m->sum = 0;
-    return m;
-}
-
-/**
- * @brief Copy a Matrix object
- *
- * This function creates a new matrix and copies the elements from the original
- * matrix to the new matrix.
- */
-Matrix *CopyMatrix(Matrix *m)
-{
-    Matrix *copy = CreateMatrix(m->rows, m->cols);
-    for (int i = 0; i < m->rows; i++)
-    {
-        for (int j = 0; j < m->cols; j++)
-        {
-            copy->data[i * copy->cols + j] = m->data[i * m->cols + j];
-        }
-    }
-    // copy->sum = m->sum;
-    return copy;
-}
-
-/**
- * @brief Read Matrix Elements from File
- *
- * This function reads matrix elements from the file following row-major order.
- *
- * Rows and cols should be read from the file before calling this function.
- * Numbers of rows and cols of the matrix should already exist in the matrix
- * structure. This function only reads the matrix elements.
- */
-void ReadMatrix(Matrix *m, FILE *fp)
-{
-    if (m->rows <= 0 || m->cols <= 0)
-    {
-        printf("Error: rows or cols of the matrix is not set.\n");
-        return;
-    }
-
-    for (int i = 0; i < m->rows; i++)
-    {
-        for (int j = 0; j < m->cols; j++)
-        {
-            int return_value = fscanf(fp, "%d", &m->data[i * m->cols + j]);
-            if (return_value == EOF)
-            {
-                printf("Error: not enough elements in the file.\n");
-                return;
-            }
-            else if (return_value == 0)
-            {
-                printf("Error: invalid element.\n");
-                return;
-            }
-        }
-    }
-}
-
-/**
- * @brief Print Matrix to File
- *
- * This function prints matrix elements to the file following row-major order.
- */
-void PrintMatrix(Matrix *m, FILE *fp)
-{
-    for (int i = 0; i < m->rows; i++)
-    {
-        for (int j = 0; j < m->cols; j++)
-        {
-            fprintf(fp, "%-8d ", m->data[i * m->cols + j]);
-        }
-        fprintf(fp, "\n");
-    }
-}
-
-/**
- * @brief Free the memory allocated for the matrix.
- *
- * This function frees the memory allocated for the matrix structure and the
- * matrix elements.
- *
- * There is pointer in the matrix structure, so you need to use this function to
- * free the memory allocated for the matrix.
- *
- * Matrix pointer should be set to NULL if not been initialized or was freed.
- *
- * This function will check if the pointer is NULL and prevent double free, so
- * you need not to check it before calling this function.
- */
-void FreeMatrix(Matrix *m)
-{
-    // Always remember to check if the pointer is NULL.
-    if (m != NULL)
-    {
-        // Double free will cause error.
-        if (m->data != NULL)
-        {
-            free(m->data);
-            m->data = NULL;
-        }
-        free(m);
-        m = NULL;
-    }
-}
-
-/**
- * @brief The naive version of the maximum submatrix sum algorithm.
- *
- * This algorithm simply enumerates all possible submatrices and finds the one
- * with the maximum sum. The variable i, j, k, l means the submatrix is from row
- * i to row k and from column j to column l. For each combination of i, j, k, l,
- * it traverses all elements in the submatrix and calculates the sum. If the sum
- * is larger than the maximum sum, it updates the maximum sum and the maximum
- * submatrix. After traversing all possible submatrices, it returns the maximum
- * submatrix.
- */
-Matrix *MaxSubmatrixN6(Matrix *m)
-{
-    int max_sum = 0;
-    int max_i = 0;
-    int max_j = 0;
-    int max_k = 0;
-    int max_l = 0;
-    // Enumerate all possible submatrices.
-    for (int i = 0; i < m->rows; i++)
-    {
-        for (int j = 0; j < m->cols; j++)
-        {
-            for (int k = i; k < m->rows; k++)
-            {
-                for (int l = j; l < m->cols; l++)
-                {
-                    // Calculate the sum of the submatrix.
-                    int sum = 0;
-                    for (int x = i; x <= k; x++)
-                    {
-                        for (int y = j; y <= l; y++)
-                        {
-                            sum += m->data[x * m->cols + y];
-                        }
-                    }
-                    // Update the maximum sum and the maximum submatrix.
-                    if (sum > max_sum)
-                    {
-                        max_sum = sum;
-                        max_i = i;
-                        max_j = j;
-                        max_k = k;
-                        max_l = l;
-                    }
-                }
-            }
-        }
-    }
-    // Create the maximum submatrix.
-    Matrix *result = CreateMatrix(max_k - max_i + 1, max_l - max_j + 1);
-    for (int i = max_i; i <= max_k; i++)
-        for (int j = max_j; j <= max_l; j++)
-            result->data[(i - max_i) * result->cols + (j - max_j)] = m->data[i * m->cols + j];
-    return result;
-}
-
-/**
- * @brief This function implements the N4 version of the maximum submatrix sum
- * algorithm.
- *
- * Compared to the N6 version, this algorithm reduces the time complexity from
- * O(n^6) to O(n^4). It sums each row of the submatrix and stores the sum in an
- * array. Then it uses Kadane's algorithm to find the maximum subarray sum of
- * the array.
- */
-Matrix *MaxSubmatrixN4(Matrix *m)
-{
-    int max_sum = 0;
-    int max_left = 0;
-    int max_right = 0;
-    int max_top = 0;
-    int max_bottom = 0;
-    int *row_sums = (int *)malloc(sizeof(int) * m->rows);
-    // The left and right bound of the submatrix.
-    // Time complexity: O(n^2).
-    for (int left = 0; left < m->cols; left++)
-    {
-        // When the left bound changes, reset the row sums.
-        for (int i = 0; i < m->rows; i++)
-            row_sums[i] = 0;
-        for (int right = left; right < m->cols; right++)
-        {
-            // Append the new column to the sum.
-            // Time complexity: O(n).
-            for (int i = 0; i < m->rows; i++)
-                row_sums[i] += m->data[i * m->cols + right];
-            // Naive method to find the maximum sum of the array.
-            // Time complexity: O(n^2)
-            int sum = 0;
-            for (int i = 0; i < m->rows; i++)
-            {
-                sum = 0;
-                for (int j = i; j < m->rows; j++)
-                {
-                    sum += row_sums[j];
-                    if (sum > max_sum)
-                    {
-                        max_sum = sum;
-                        max_left = left;
-                        max_right = right;
-                        max_top = i;
-                        max_bottom = j;
-                    }
-                }
-            }
-        }
-    }
-    free(row_sums);
-    // Create the maximum submatrix.
-    Matrix *result = CreateMatrix(max_bottom - max_top + 1, max_right - max_left + 1);
-    for (int i = max_top; i <= max_bottom; i++)
-        for (int j = max_left; j <= max_right; j++)
-            result->data[(i - max_top) * result->cols + (j - max_left)] = m->data[i * m->cols + j];
-    return result;
-}
-
-/**
- * @brief This function implements my version of the maximum submatrix sum
- * algorithm.
- *
- * It substitutes the N4 version of finding the maximum subarray sum with
- * Kadane's algorithm. This reduces the time complexity from O(n^4) to O(n^3).
- */
-Matrix *MaxSubmatrix(Matrix *m)
-{
-    int max_sum = 0;
-    int max_left = 0;
-    int max_right = 0;
-    int max_top = 0;
-    int max_bottom = 0;
-    int *row_sums = (int *)malloc(sizeof(int) * m->rows);
-    // The left and right bound of the submatrix.
-    // Time complexity: O(n^2).
-    for (int left = 0; left < m->cols; left++)
-    {
-        // When the left bound changes, reset the row sums.
-        for (int i = 0; i < m->rows; i++)
-            row_sums[i] = 0;
-        for (int right = left; right < m->cols; right++)
-        {
-            // Append the new column to the sum.
-            // Time complexity: O(n).
-            for (int i = 0; i < m->rows; i++)
-                row_sums[i] += m->data[i * m->cols + right];
-            // Kadane's algorithm to find the maximum sum of the array.
-            // Time complexity: O(n)
-            int sum = 0;
-            int top = 0;
-            for(int i = 0; i < m->rows; i++)
-            {
-                sum += row_sums[i];
-                if(sum < 0)
-                {
-                    sum = 0;
-                    top = i + 1;
-                }
-                else if(sum > max_sum)
-                {
-                    max_sum = sum;
-                    max_left = left;
-                    max_right = right;
-                    max_top = top;
-                    max_bottom = i;
-                }
-            }
-        }
-    }
-    free(row_sums);
-    // Create the maximum submatrix.
-    Matrix *result = CreateMatrix(max_bottom - max_top + 1, max_right - max_left + 1);
-    for (int i = max_top; i <= max_bottom; i++)
-        for (int j = max_left; j <= max_right; j++)
-            result->data[(i - max_top) * result->cols + (j - max_left)] = m->data[i * m->cols + j];
-    return result;
-}
+/**
+ * @file mss.c
+ * @brief This file contains function implementations for the problem.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "mss.h"
+
+/**
+ * @brief Create a Matrix object
+ *
+ * This function uses malloc to allocate memory for the matrix structure and the
+ * matrix elements. So you need not to allocate memory for the matrix before
+ * calling this function.
+ *
+ * Because there is pointer in the matrix structure, you need to use
+ * FreeMatrix() function to free the memory allocated for the matrix.
+ */
+Matrix *CreateMatrix(const int rows, const int cols)
+{
+    Matrix *m = (Matrix *)malloc(sizeof(Matrix));
+    m->rows = rows;
+    m->cols = cols;
+    m->data = (int *)malloc(sizeof(int) * rows * cols);
+    m->mapped = 0;
+    m->alloc = (MatrixAllocOptions){HUGE_PAGE_NONE, NUMA_DEFAULT, 0};
+    // m->sum = 0;
+    return m;
+}
+
+/**
+ * @brief Create a Matrix object with huge page and NUMA options
+ *
+ * Large matrices suffer from TLB misses during the column sweep, and on a NUMA
+ * machine all their pages land on the node of the thread reading them. This
+ * function maps the elements with MapElements() according to the options. If
+ * mapping fails, it falls back to CreateMatrix().
+ *
+ * The options actually applied are stored in m->alloc. The matrix is freed by
+ * FreeMatrix() as usual.
+ */
+Matrix *CreateMatrixEx(const int rows, const int cols, const MatrixAllocOptions *options)
+{
+    Matrix *m = (Matrix *)malloc(sizeof(Matrix));
+    m->rows = rows;
+    m->cols = cols;
+    m->alloc = *options;
+    m->data = (int *)MapElements(sizeof(int) * (size_t)rows * cols, rows, &m->alloc, &m->mapped);
+    if (m->data == NULL)
+    {
+        free(m);
+        return CreateMatrix(rows, cols);
+    }
+    return m;
+}
+
+/**
+ * @brief Copy a Matrix object
+ *
+ * This function creates a new matrix and copies the elements from the original
+ * matrix to the new matrix.
+ */
+Matrix *CopyMatrix(Matrix *m)
+{
+    Matrix *copy = CreateMatrix(m->rows, m->cols);
+    for (int i = 0; i < m->rows; i++)
+    {
+        for (int j = 0; j < m->cols; j++)
+        {
+            copy->data[i * copy->cols + j] = m->data[i * m->cols + j];
+        }
+    }
+    // copy->sum = m->sum;
+    return copy;
+}
+
+/**
+ * @brief Create a MatrixStats object
+ *
+ * All the counters and per-row and per-column arrays start at zero, min and
+ * max at the extreme values of int. Use FreeMatrixStats() to free it.
+ */
+MatrixStats *CreateMatrixStats(const int rows, const int cols)
+{
+    MatrixStats *s = (MatrixStats *)malloc(sizeof(MatrixStats));
+    s->min = INT_MAX;
+    s->max = INT_MIN;
+    s->positive_count = 0;
+    s->total = 0;
+    s->positive_total = 0;
+    s->negative_total = 0;
+    s->col_positive = (long long *)calloc(cols, sizeof(long long));
+    s->col_totals = (long long *)calloc(cols, sizeof(long long));
+    s->row_totals = (long long *)calloc(rows, sizeof(long long));
+    return s;
+}
+
+/**
+ * @brief Check whether int is wide enough for every submatrix sum
+ *
+ * Every partial sum computed by the algorithms is the sum of some submatrix,
+ * which lies between the sum of all negative elements and the sum of all
+ * positive elements.
+ */
+int SumFitsInInt(const MatrixStats *s)
+{
+    return s->positive_total <= INT_MAX && s->negative_total >= INT_MIN;
+}
+
+/**
+ * @brief Free the memory allocated for the statistics.
+ *
+ * This function will check if the pointer is NULL.
+ */
+void FreeMatrixStats(MatrixStats *s)
+{
+    if (s != NULL)
+    {
+        free(s->col_positive);
+        free(s->col_totals);
+        free(s->row_totals);
+        free(s);
+    }
+}
+
+/**
+ * @brief Read Matrix Elements from File
+ *
+ * This function reads matrix elements from the file following row-major order.
+ *
+ * Rows and cols should be read from the file before calling this function.
+ * Numbers of rows and cols of the matrix should already exist in the matrix
+ * structure. This function only reads the matrix elements.
+ *
+ * If stats is not NULL, the statistics are updated while each element is
+ * read. stats should be created by CreateMatrixStats() with the same size as
+ * the matrix.
+ */
+void ReadMatrix(Matrix *m, FILE *fp, MatrixStats *stats)
+{
+    if (m->rows <= 0 || m->cols <= 0)
+    {
+        printf("Error: rows or cols of the matrix is not set.\n");
+        return;
+    }
+
+    for (int i = 0; i < m->rows; i++)
+    {
+        for (int j = 0; j < m->cols; j++)
+        {
+            int return_value = fscanf(fp, "%d", &m->data[i * m->cols + j]);
+            if (return_value == EOF)
+            {
+                printf("Error: not enough elements in the file.\n");
+                return;
+            }
+            else if (return_value == 0)
+            {
+                printf("Error: invalid element.\n");
+                return;
+            }
+            if (stats != NULL)
+            {
+                int value = m->data[i * m->cols + j];
+                if (value < stats->min)
+                    stats->min = value;
+                if (value > stats->max)
+                    stats->max = value;
+                if (value > 0)
+                {
+                    stats->positive_count++;
+                    stats->positive_total += value;
+                    stats->col_positive[j] += value;
+                }
+                else
+                    stats->negative_total += value;
+                stats->total += value;
+                stats->col_totals[j] += value;
+                stats->row_totals[i] += value;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Print Matrix to File
+ *
+ * This function prints matrix elements to the file following row-major order.
+ */
+void PrintMatrix(Matrix *m, FILE *fp)
+{
+    for (int i = 0; i < m->rows; i++)
+    {
+        for (int j = 0; j < m->cols; j++)
+        {
+            fprintf(fp, "%-8d ", m->data[i * m->cols + j]);
+        }
+        fprintf(fp, "\n");
+    }
+}
+
+/**
+ * @brief Free the memory allocated for the matrix.
+ *
+ * This function frees the memory allocated for the matrix structure and the
+ * matrix elements.
+ *
+ * There is pointer in the matrix structure, so you need to use this function to
+ * free the memory allocated for the matrix.
+ *
+ * Matrix pointer should be set to NULL if not been initialized or was freed.
+ *
+ * This function will check if the pointer is NULL and prevent double free, so
+ * you need not to check it before calling this function.
+ */
+void FreeMatrix(Matrix *m)
+{
+    // Always remember to check if the pointer is NULL.
+    if (m != NULL)
+    {
+        // Double free will cause error.
+        if (m->data != NULL)
+        {
+            if (m->mapped != 0)
+                UnmapElements(m->data, m->mapped);
+            else
+                free(m->data);
+            m->data = NULL;
+        }
+        free(m);
+        m = NULL;
+    }
+}
+
+/**
+ * @brief Copy the submatrix from row top to row bottom and from column left to
+ * column right into a new matrix.
+ *
+ * All the algorithms below end with this step, so it is shared here.
+ */
+static Matrix *ExtractSubmatrix(Matrix *m, int top, int left, int bottom, int right)
+{
+    Matrix *result = CreateMatrix(bottom - top + 1, right - left + 1);
+    for (int i = top; i <= bottom; i++)
+        for (int j = left; j <= right; j++)
+            result->data[(i - top) * result->cols + (j - left)] = m->data[i * m->cols + j];
+    return result;
+}
+
+/**
+ * @brief The naive version of the maximum submatrix sum algorithm.
+ *
+ * This algorithm simply enumerates all possible submatrices and finds the one
+ * with the maximum sum. The variable i, j, k, l means the submatrix is from row
+ * i to row k and from column j to column l. For each combination of i, j, k, l,
+ * it traverses all elements in the submatrix and calculates the sum. If the sum
+ * is larger than the maximum sum, it updates the maximum sum and the maximum
+ * submatrix. After traversing all possible submatrices, it returns the maximum
+ * submatrix.
+ */
+Matrix *MaxSubmatrixN6(Matrix *m)
+{
+    int max_sum = 0;
+    int max_i = 0;
+    int max_j = 0;
+    int max_k = 0;
+    int max_l = 0;
+    // Enumerate all possible submatrices.
+    for (int i = 0; i < m->rows; i++)
+    {
+        for (int j = 0; j < m->cols; j++)
+        {
+            for (int k = i; k < m->rows; k++)
+            {
+                for (int l = j; l < m->cols; l++)
+                {
+                    // Calculate the sum of the submatrix.
+                    int sum = 0;
+                    for (int x = i; x <= k; x++)
+                    {
+                        for (int y = j; y <= l; y++)
+                        {
+                            sum += m->data[x * m->cols + y];
+                        }
+                    }
+                    // Update the maximum sum and the maximum submatrix.
+                    if (sum > max_sum)
+                    {
+                        max_sum = sum;
+                        max_i = i;
+                        max_j = j;
+                        max_k = k;
+                        max_l = l;
+                    }
+                }
+            }
+        }
+    }
+    return ExtractSubmatrix(m, max_i, max_j, max_k, max_l);
+}
+
+/**
+ * @brief This function implements the N4 version of the maximum submatrix sum
+ * algorithm.
+ *
+ * Compared to the N6 version, this algorithm reduces the time complexity from
+ * O(n^6) to O(n^4). It sums each row of the submatrix and stores the sum in an
+ * array. Then it uses Kadane's algorithm to find the maximum subarray sum of
+ * the array.
+ */
+Matrix *MaxSubmatrixN4(Matrix *m)
+{
+    int max_sum = 0;
+    int max_left = 0;
+    int max_right = 0;
+    int max_top = 0;
+    int max_bottom = 0;
+    int *row_sums = (int *)malloc(sizeof(int) * m->rows);
+    // The left and right bound of the submatrix.
+    // Time complexity: O(n^2).
+    for (int left = 0; left < m->cols; left++)
+    {
+        // When the left bound changes, reset the row sums.
+        for (int i = 0; i < m->rows; i++)
+            row_sums[i] = 0;
+        for (int right = left; right < m->cols; right++)
+        {
+            // Append the new column to the sum.
+            // Time complexity: O(n).
+            for (int i = 0; i < m->rows; i++)
+                row_sums[i] += m->data[i * m->cols + right];
+            // Naive method to find the maximum sum of the array.
+            // Time complexity: O(n^2)
+            int sum = 0;
+            for (int i = 0; i < m->rows; i++)
+            {
+                sum = 0;
+                for (int j = i; j < m->rows; j++)
+                {
+                    sum += row_sums[j];
+                    if (sum > max_sum)
+                    {
+                        max_sum = sum;
+                        max_left = left;
+                        max_right = right;
+                        max_top = i;
+                        max_bottom = j;
+                    }
+                }
+            }
+        }
+    }
+    free(row_sums);
+    return ExtractSubmatrix(m, max_top, max_left, max_bottom, max_right);
+}
+
+/**
+ * @brief This function implements my version of the maximum submatrix sum
+ * algorithm for matrices of any size.
+ *
+ * It substitutes the N4 version of finding the maximum subarray sum with
+ * Kadane's algorithm. This reduces the time complexity from O(n^4) to O(n^3).
+ */
+Matrix *MaxSubmatrixGeneric(Matrix *m)
+{
+    int max_sum = 0;
+    int max_left = 0;
+    int max_right = 0;
+    int max_top = 0;
+    int max_bottom = 0;
+    int *row_sums = (int *)malloc(sizeof(int) * m->rows);
+    // The left and right bound of the submatrix.
+    // Time complexity: O(n^2).
+    for (int left = 0; left < m->cols; left++)
+    {
+        // When the left bound changes, reset the row sums.
+        for (int i = 0; i < m->rows; i++)
+            row_sums[i] = 0;
+        for (int right = left; right < m->cols; right++)
+        {
+            // Append the new column to the sum.
+            // Time complexity: O(n).
+            for (int i = 0; i < m->rows; i++)
+                row_sums[i] += m->data[i * m->cols + right];
+            // Kadane's algorithm to find the maximum sum of the array.
+            // Time complexity: O(n)
+            int sum = 0;
+            int top = 0;
+            for(int i = 0; i < m->rows; i++)
+            {
+                sum += row_sums[i];
+                if(sum < 0)
+                {
+                    sum = 0;
+                    top = i + 1;
+                }
+                else if(sum > max_sum)
+                {
+                    max_sum = sum;
+                    max_left = left;
+                    max_right = right;
+                    max_top = top;
+                    max_bottom = i;
+                }
+            }
+        }
+    }
+    free(row_sums);
+    return ExtractSubmatrix(m, max_top, max_left, max_bottom, max_right);
+}
+
+/**
+ * @brief Generate a fully unrolled O(n^3) kernel for N x N matrices.
+ *
+ * For small tiles the loop overhead and the malloc() of row_sums dominate the
+ * generic version. When N is a compile-time constant, row_sums can live on the
+ * stack (and mostly in registers), every loop bound is known and the compiler
+ * can unroll the inner loops completely. The traversal order and the update
+ * rule are exactly the same as MaxSubmatrixGeneric(), so both return the same
+ * submatrix.
+ */
+#define MSS_PRAGMA(x) _Pragma(#x)
+#define MSS_FIXED_KERNEL(N)                                                    \
+    static Matrix *MaxSubmatrix##N(Matrix *m)                                  \
+    {                                                                          \
+        const int *data = m->data;                                             \
+        int max_sum = 0;                                                       \
+        int max_left = 0;                                                      \
+        int max_right = 0;                                                     \
+        int max_top = 0;                                                       \
+        int max_bottom = 0;                                                    \
+        int row_sums[N];                                                       \
+        for (int left = 0; left < N; left++)                                   \
+        {                                                                      \
+            MSS_PRAGMA(GCC unroll N)                                           \
+            for (int i = 0; i < N; i++)                                        \
+                row_sums[i] = 0;                                               \
+            for (int right = left; right < N; right++)                         \
+            {                                                                  \
+                MSS_PRAGMA(GCC unroll N)                                       \
+                for (int i = 0; i < N; i++)                                    \
+                    row_sums[i] += data[i * N + right];                        \
+                int sum = 0;                                                   \
+                int top = 0;                                                   \
+                MSS_PRAGMA(GCC unroll N)                                       \
+                for (int i = 0; i < N; i++)                                    \
+                {                                                              \
+                    sum += row_sums[i];                                        \
+                    if (sum < 0)                                               \
+                    {                                                          \
+                        sum = 0;                                               \
+                        top = i + 1;                                           \
+                    }                                                          \
+                    else if (sum > max_sum)                                    \
+                    {                                                          \
+                        max_sum = sum;                                         \
+                        max_left = left;                                       \
+                        max_right = right;                                     \
+                        max_top = top;                                         \
+                        max_bottom = i;                                        \
+                    }                                                          \
+                }                                                              \
+            }                                                                  \
+        }                                                                      \
+        return ExtractSubmatrix(m, max_top, max_left, max_bottom, max_right);  \
+    }
+
+MSS_FIXED_SIZES(MSS_FIXED_KERNEL)
+
+/**
+ * @brief Maximum submatrix sum with automatic kernel selection.
+ *
+ * Square matrices whose rank is listed in MSS_FIXED_SIZES are dispatched to the
+ * corresponding unrolled kernel, everything else goes to MaxSubmatrixGeneric().
+ */
+Matrix *MaxSubmatrix(Matrix *m)
+{
+#define MSS_FIXED_CASE(N) \
+    case N:               \
+        return MaxSubmatrix##N(m);
+    if (m->rows == m->cols)
+    {
+        switch (m->rows)
+        {
+            MSS_FIXED_SIZES(MSS_FIXED_CASE)
+        default:
+            break;
+        }
+    }
+#undef MSS_FIXED_CASE
+    return MaxSubmatrixGeneric(m);
+}
+
+/**
+ * @brief Size in bytes of the cache the tiled algorithms should fit in.
+ *
+ * The size of the level 2 data (or unified) cache is read from sysfs the first
+ * time this function is called and remembered afterwards. If it can't be read,
+ * 256 KiB is assumed.
+ */
+static long CacheSize(void)
+{
+    static long cache_size = 0;
+    if (cache_size > 0)
+        return cache_size;
+    cache_size = 256 * 1024;
+    for (int index = 0; index < 8; index++)
+    {
+        char path[64];
+        char type[32];
+        int level = 0;
+        long size = 0;
+        char unit = 0;
+        sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL)
+            break;
+        int return_value = fscanf(fp, "%d", &level);
+        fclose(fp);
+        if (return_value != 1 || level != 2)
+            continue;
+        sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+        fp = fopen(path, "r");
+        if (fp == NULL)
+            continue;
+        return_value = fscanf(fp, "%31s", type);
+        fclose(fp);
+        if (return_value != 1 || strcmp(type, "Instruction") == 0)
+            continue;
+        sprintf(path, "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+        fp = fopen(path, "r");
+        if (fp == NULL)
+            continue;
+        return_value = fscanf(fp, "%ld%c", &size, &unit);
+        fclose(fp);
+        if (return_value < 1 || size <= 0)
+            continue;
+        if (unit == 'K')
+            size *= 1024;
+        else if (unit == 'M')
+            size *= 1024 * 1024;
+        cache_size = size;
+        break;
+    }
+    return cache_size;
+}
+
+/**
+ * @brief Number of left bounds the tiled algorithms process together.
+ *
+ * One row_sums vector of the given number of rows is kept for every left bound
+ * in the tile, and all of them should stay in half of the cache returned by
+ * CacheSize() while the right bound moves.
+ */
+int MssTileWidth(int rows)
+{
+    long width = CacheSize() / 2 / ((long)rows * sizeof(int));
+    if (width < 1)
+        width = 1;
+    if (width > MSS_MAX_TILE_WIDTH)
+        width = MSS_MAX_TILE_WIDTH;
+    return (int)width;
+}
+
+/**
+ * @brief The best submatrix found so far by a tiled algorithm.
+ */
+struct Candidate
+{
+    int sum;
+    int left;
+    int right;
+    int top;
+    int bottom;
+};
+typedef struct Candidate Candidate;
+
+/**
+ * @brief Keep the better one of the best candidate and a new candidate.
+ *
+ * The tiled algorithms visit the (left, right) pairs in another order than the
+ * untiled ones, which only keep the first pair reaching the maximum sum. To
+ * return the same submatrix, a candidate with the same sum wins if its pair
+ * comes earlier in the untiled order.
+ */
+static void UpdateCandidate(Candidate *best, const Candidate *c)
+{
+    if (c->sum > best->sum ||
+        (c->sum == best->sum && best->sum > 0 &&
+         (c->left < best->left || (c->left == best->left && c->right < best->right))))
+        *best = *c;
+}
+
+/**
+ * @brief Allocate a buffer of a tiled algorithm, or exit.
+ */
+static int *TileBuffer(size_t count)
+{
+    int *buffer = (int *)malloc(sizeof(int) * count);
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Error: cannot allocate %zu bytes for the tiled algorithm.\n",
+                sizeof(int) * count);
+        exit(EXIT_FAILURE);
+    }
+    return buffer;
+}
+
+/**
+ * @brief Gather one column of the matrix into a contiguous strip.
+ *
+ * The matrix is read in place with a stride of one row, so no copy of the
+ * whole matrix is made: the tiled algorithms only need one column of extra
+ * memory, which matters for matrices as large as the memory. The strip is
+ * read once per tile and then added to all the row_sums vectors of the tile
+ * from the cache.
+ */
+static void ReadColumn(const Matrix *m, int j, int *column)
+{
+    const int *element = m->data + j;
+    for (int i = 0; i < m->rows; i++, element += m->cols)
+        column[i] = *element;
+}
+
+/**
+ * @brief Tiled version of the N4 algorithm.
+ *
+ * The untiled version streams the whole matrix once for every left bound, so
+ * it becomes memory bound as soon as the matrix doesn't fit in the cache. Here
+ * MssTileWidth() left bounds are processed together: each column is read once
+ * per tile (see ReadColumn()) and added to all the row_sums vectors of the
+ * tile, which are small enough to stay in the cache. The result is the same
+ * as MaxSubmatrixN4().
+ */
+Matrix *MaxSubmatrixN4Tiled(Matrix *m)
+{
+    Candidate best = {0, 0, 0, 0, 0};
+    int width = MssTileWidth(m->rows);
+    int *column = TileBuffer((size_t)m->rows);
+    int *row_sums = TileBuffer((size_t)width * m->rows);
+    for (int left0 = 0; left0 < m->cols; left0 += width)
+    {
+        int tile = m->cols - left0 < width ? m->cols - left0 : width;
+        memset(row_sums, 0, sizeof(int) * tile * m->rows);
+        for (int right = left0; right < m->cols; right++)
+        {
+            ReadColumn(m, right, column);
+            // Left bounds greater than right are not valid yet.
+            int active = right - left0 + 1 < tile ? right - left0 + 1 : tile;
+            for (int t = 0; t < active; t++)
+            {
+                int *sums = row_sums + (size_t)t * m->rows;
+                for (int i = 0; i < m->rows; i++)
+                    sums[i] += column[i];
+                // Find the first maximum of this pair like MaxSubmatrixN4().
+                Candidate c = {0, left0 + t, right, 0, 0};
+                for (int i = 0; i < m->rows; i++)
+                {
+                    int sum = 0;
+                    for (int j = i; j < m->rows; j++)
+                    {
+                        sum += sums[j];
+                        if (sum > c.sum)
+                        {
+                            c.sum = sum;
+                            c.top = i;
+                            c.bottom = j;
+                        }
+                    }
+                }
+                UpdateCandidate(&best, &c);
+            }
+        }
+    }
+    free(row_sums);
+    free(column);
+    return ExtractSubmatrix(m, best.top, best.left, best.bottom, best.right);
+}
+
+/**
+ * @brief Tiled version of my algorithm.
+ *
+ * The traversal is the same as MaxSubmatrixN4Tiled(), with Kadane's algorithm
+ * for each (left, right) pair. The result is the same as MaxSubmatrix().
+ */
+Matrix *MaxSubmatrixTiled(Matrix *m)
+{
+    Candidate best = {0, 0, 0, 0, 0};
+    int width = MssTileWidth(m->rows);
+    int *column = TileBuffer((size_t)m->rows);
+    int *row_sums = TileBuffer((size_t)width * m->rows);
+    for (int left0 = 0; left0 < m->cols; left0 += width)
+    {
+        int tile = m->cols - left0 < width ? m->cols - left0 : width;
+        memset(row_sums, 0, sizeof(int) * tile * m->rows);
+        for (int right = left0; right < m->cols; right++)
+        {
+            ReadColumn(m, right, column);
+            // Left bounds greater than right are not valid yet.
+            int active = right - left0 + 1 < tile ? right - left0 + 1 : tile;
+            for (int t = 0; t < active; t++)
+            {
+                int *sums = row_sums + (size_t)t * m->rows;
+                // Append the column and run Kadane's algorithm in one pass.
+                Candidate c = {0, left0 + t, right, 0, 0};
+                int sum = 0;
+                int top = 0;
+                for (int i = 0; i < m->rows; i++)
+                {
+                    sums[i] += column[i];
+                    sum += sums[i];
+                    if (sum < 0)
+                    {
+                        sum = 0;
+                        top = i + 1;
+                    }
+                    else if (sum > c.sum)
+                    {
+                        c.sum = sum;
+                        c.top = top;
+                        c.bottom = i;
+                    }
+                }
+                UpdateCandidate(&best, &c);
+            }
+        }
+    }
+    free(row_sums);
+    free(column);
+    return ExtractSubmatrix(m, best.top, best.left, best.bottom, best.right);
+}
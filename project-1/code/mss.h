@@ -7,6 +7,9 @@
 #ifndef _MSS_H_
 #define _MSS_H_
 
+#include <stdio.h>
+#include "matrix_memory.h"
+
 /**
  * @brief Matrix structure
  *
@@ -16,12 +19,18 @@
  * Though the problem in PTA only requires the input matrix to be a square
  * matrix, I still use a general matrix structure to make the program more
  * flexible. The result matrix is also a general matrix.
+ *
+ * Elements of a matrix created by CreateMatrixEx() are mapped directly with
+ * mmap(). In this case mapped is the length of the mapping, otherwise it is 0.
+ * alloc records the allocation options which were actually applied.
  */
 struct Matrix
 {
     int rows;
     int cols;
     int *data;
+    size_t mapped;
+    MatrixAllocOptions alloc;
 };
 typedef struct Matrix Matrix;
 
@@ -34,6 +43,16 @@ typedef struct Matrix Matrix;
  */
 Matrix* CreateMatrix(const int rows, const int cols);
 
+/**
+ * @brief Create a Matrix object with huge page and NUMA options
+ *
+ * @param rows Rows of the matrix.
+ * @param cols Columns of the matrix.
+ * @param options Allocation options.
+ * @return Matrix* Pointer to the matrix.
+ */
+Matrix* CreateMatrixEx(const int rows, const int cols, const MatrixAllocOptions *options);
+
 /**
  * @brief Copy a Matrix object
  *
@@ -42,13 +61,64 @@ Matrix* CreateMatrix(const int rows, const int cols);
  */
 Matrix* CopyMatrix(Matrix *m);
 
+/**
+ * @brief Ingest statistics of a matrix
+ *
+ * These statistics are collected by ReadMatrix() while the elements are read,
+ * so that validation, overflow checks and pruning bounds don't need another
+ * pass over the matrix.
+ *
+ * positive_total and negative_total bound the sum of any submatrix from above
+ * and below. col_positive[j] is the sum of the positive elements of column j,
+ * so the sum of col_positive over a range of columns bounds the sum of any
+ * submatrix within these columns.
+ */
+struct MatrixStats
+{
+    int min;
+    int max;
+    long positive_count;
+    long long total;
+    long long positive_total;
+    long long negative_total;
+    long long *col_positive;
+    long long *col_totals;
+    long long *row_totals;
+};
+typedef struct MatrixStats MatrixStats;
+
+/**
+ * @brief Create a MatrixStats object for a matrix of the given size
+ *
+ * @param rows Rows of the matrix.
+ * @param cols Columns of the matrix.
+ * @return MatrixStats* Pointer to the statistics.
+ */
+MatrixStats* CreateMatrixStats(const int rows, const int cols);
+
+/**
+ * @brief Check whether int is wide enough for every submatrix sum
+ *
+ * @param s Pointer to the statistics.
+ * @return int 1 if no partial sum of the algorithms can overflow an int.
+ */
+int SumFitsInInt(const MatrixStats *s);
+
+/**
+ * @brief Free the memory allocated for the statistics.
+ *
+ * @param s Pointer to the statistics.
+ */
+void FreeMatrixStats(MatrixStats *s);
+
 /**
  * @brief Read Matrix Elements from File
  * 
  * @param m Pointer to the matrix.
  * @param fp Pointer to the file to be read.
+ * @param stats Pointer to the statistics to be collected, or NULL.
  */
-void ReadMatrix(Matrix *m, FILE *fp);
+void ReadMatrix(Matrix *m, FILE *fp, MatrixStats *stats);
 
 /**
  * @brief Print Matrix to File
@@ -83,8 +153,35 @@ void FreeMatrix(Matrix *m);
  */ 
 Matrix* MaxSubmatrixN6(Matrix *m);
 Matrix* MaxSubmatrixN4(Matrix *m);
+Matrix* MaxSubmatrixGeneric(Matrix *m);
 Matrix* MaxSubmatrix(Matrix *m);
 /** @} */ // end of mss
 
+/**
+ * @brief Matrix ranks with a specialized kernel.
+ *
+ * MaxSubmatrix() dispatches square matrices of these ranks to a fully unrolled
+ * kernel generated at compile time. MaxSubmatrixGeneric() always takes the
+ * generic path, which is useful to benchmark the two against each other.
+ */
+#define MSS_FIXED_SIZES(X) X(8) X(16) X(32)
+
+/**
+ * @defgroup mss_tiled Tiled Maximum Submatrix Sum
+ * @brief Cache-friendly versions of the N4 and N3 algorithms.
+ *
+ * These functions process a tile of left bounds together, so that every
+ * column of the matrix is read once per tile instead of once per left bound.
+ * The tile width is chosen from the cache size of the machine. They return
+ * the same submatrix as their untiled counterparts.
+ *
+ * @{
+ */
+#define MSS_MAX_TILE_WIDTH 64
+int MssTileWidth(int rows);
+Matrix* MaxSubmatrixN4Tiled(Matrix *m);
+Matrix* MaxSubmatrixTiled(Matrix *m);
+/** @} */ // end of mss_tiled
+
 #endif
 
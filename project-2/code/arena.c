@@ -0,0 +1,157 @@
+#include "arena.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @brief Node arena in use by the current thread.
+ */
+static _Thread_local NodeArena *activeArena = NULL;
+
+/**
+ * @brief Create a Node Arena object
+ *
+ * The arena will be dynamically allocated, so it must be freed by
+ * freeNodeArena after use.
+ *
+ * @return NodeArena* created arena
+ */
+NodeArena *createNodeArena(void)
+{
+    NodeArena *ret = (NodeArena *)malloc(sizeof(NodeArena));
+    if (!ret)
+    {
+        fprintf(stderr, "[createNodeArena] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    ret->blocks = NULL;
+    ret->numNodes = 0;
+    return ret;
+}
+
+/**
+ * @brief Use the arena for the node functions of the current thread
+ *
+ * @param arena arena to be used, NULL to go back to individually allocated
+ * nodes
+ * @return NodeArena* the arena used before
+ */
+NodeArena *useNodeArena(NodeArena *arena)
+{
+    NodeArena *prev = activeArena;
+    activeArena = arena;
+    return prev;
+}
+
+/**
+ * @brief Get the arena in use by the current thread
+ *
+ * @return NodeArena* arena in use, NULL if none
+ */
+NodeArena *currentNodeArena(void)
+{
+    return activeArena;
+}
+
+/**
+ * @brief Allocate a node from the arena
+ *
+ * @param arena arena to allocate from
+ * @param t token of the node
+ * @param a left child
+ * @param b right child
+ * @return Node* allocated node
+ */
+Node *arenaNode(NodeArena *arena, Token t, Node *a, Node *b)
+{
+    ArenaBlock *block = arena->blocks;
+    if (!block || block->used == block->size)
+    {
+        /* blocks double in size, so there are few of them */
+        int size = block ? block->size * 2 : 4096;
+        block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + sizeof(Node) * size);
+        if (!block)
+        {
+            fprintf(stderr, "[arenaNode] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        block->next = arena->blocks;
+        block->used = 0;
+        block->size = size;
+        arena->blocks = block;
+    }
+    Node *ret = &block->nodes[block->used++];
+    ret->token = t;
+    ret->a = a;
+    ret->b = b;
+    ret->hash = structuralHash(t, a, b);
+    arena->numNodes++;
+    METRICS_CREATED(1, sizeof(Node));
+    return ret;
+}
+
+/**
+ * @brief Check if the node belongs to the arena
+ *
+ * @param arena node arena
+ * @param n node to be checked
+ * @return int 1 if n is a node of the arena, 0 if not
+ */
+int inNodeArena(const NodeArena *arena, const Node *n)
+{
+    for (const ArenaBlock *block = arena->blocks; block; block = block->next)
+    {
+        if (n >= block->nodes && n < block->nodes + block->used)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Free all the nodes of the arena
+ *
+ * The largest block is kept, so an arena reset after each expression or
+ * phase soon stops calling malloc at all.
+ *
+ * @param arena arena to be reset
+ */
+void resetNodeArena(NodeArena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    if (!block)
+        return;
+    METRICS_FREED(arena->numNodes, arena->numNodes * sizeof(Node));
+    ArenaBlock *next = block->next;
+    while (next)
+    {
+        ArenaBlock *temp = next->next;
+        free(next);
+        next = temp;
+    }
+    block->next = NULL;
+    block->used = 0;
+    arena->numNodes = 0;
+}
+
+/**
+ * @brief Free the node arena
+ *
+ * All the nodes of the arena are freed at once. If the arena is in use by
+ * the current thread, it is not any more.
+ *
+ * @param arena arena to be freed
+ */
+void freeNodeArena(NodeArena *arena)
+{
+    if (activeArena == arena)
+        activeArena = NULL;
+    METRICS_FREED(arena->numNodes, arena->numNodes * sizeof(Node));
+    ArenaBlock *block = arena->blocks;
+    while (block)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
@@ -0,0 +1,64 @@
+/**
+ * @file arena.h
+ * @brief Arena allocator for expression nodes.
+ *
+ * Without an arena, every node is allocated by malloc and freeTree walks the
+ * tree to free them one by one. Nodes of an arena are carved from large
+ * blocks instead, and all of them are freed at once with the arena, so trees
+ * which live and die together (a parse, a derivative) cost one pointer bump
+ * per node and nothing to free.
+ */
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include "expression.h"
+
+/**
+ * @brief Block of nodes of an arena.
+ */
+typedef struct arena_block ArenaBlock;
+struct arena_block
+{
+    ArenaBlock *next;
+    int used, size;
+    Node nodes[];
+};
+
+/**
+ * @brief Node arena type.
+ *
+ * Blocks are chained from the newest one, which is also the largest one.
+ */
+typedef struct node_arena NodeArena;
+struct node_arena
+{
+    ArenaBlock *blocks;
+    long numNodes;
+};
+
+/**
+ * @defgroup arena Node arena functions
+ *
+ * While an arena is in use by the current thread (see useNodeArena) and no
+ * node store is (see dag.h), the node functions in expression.h work on it:
+ *
+ * - createNode allocates the node from the arena, so copyTree, autoGrad,
+ *   constantOptimizer and the parsers build their trees in the arena;
+ * - freeTree does nothing for trees of the arena.
+ *
+ * Trees of other arenas may be read, e.g. copied or differentiated into the
+ * arena in use, but must not be passed to freeTree. Trees built this way must
+ * not be used after their arena is reset or freed.
+ *
+ * @{
+ */
+NodeArena *createNodeArena(void);
+NodeArena *useNodeArena(NodeArena *arena);
+NodeArena *currentNodeArena(void);
+Node *arenaNode(NodeArena *arena, Token t, Node *a, Node *b);
+int inNodeArena(const NodeArena *arena, const Node *n);
+void resetNodeArena(NodeArena *arena);
+void freeNodeArena(NodeArena *arena);
+/** @} */
+
+#endif
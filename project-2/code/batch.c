@@ -0,0 +1,246 @@
+#include "batch.h"
+#include "expression.h"
+#include "arena.h"
+#include "input.h"
+#include "metrics.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief State shared by the threads of a batch
+ *
+ * Expression i is read by the thread that claims it, and its output is put
+ * in ring[i % BATCH_WINDOW] until the writer takes it. A thread may only
+ * claim expression i once expression i - BATCH_WINDOW has been written, so
+ * the slot is free.
+ */
+typedef struct batch Batch;
+struct batch
+{
+    Input *in;
+    long next;    /* lines read */
+    long written; /* lines written */
+    int eof;
+    char *ring[BATCH_WINDOW];
+    size_t ringSize[BATCH_WINDOW];
+    pthread_mutex_t lock;
+    pthread_cond_t ready; /* an output was put in the ring, or eof */
+    pthread_cond_t room;  /* an output was written */
+};
+
+/**
+ * @brief Differentiate one expression
+ *
+ * Same steps and output as main with --arena. A blank line or a syntax error
+ * gives a one line message with the line number instead.
+ *
+ * @param line expression without whitespace
+ * @param len length of the expression
+ * @param number line number, from 1
+ * @param v variable list, empty
+ * @param treeArena arena of the expression, reset by the caller
+ * @param diffArena arena of the derivatives
+ * @param fp output file
+ */
+static void differentiate(char *line, int len, long number, VariableList *v,
+                          NodeArena *treeArena, NodeArena *diffArena, FILE *fp)
+{
+    if (!len)
+    {
+        fprintf(fp, "[warning] line %ld: Empty expression\n\n", number);
+        return;
+    }
+    String s = {line, len, 0};
+    char error[128];
+    useNodeArena(treeArena);
+    METRICS_PHASE(PHASE_PARSE);
+    Node *tree = tryParser(&s, v, error, sizeof(error));
+    if (!tree)
+    {
+        fprintf(fp, "[error] line %ld: %s\n\n", number, error);
+        useNodeArena(NULL);
+        return;
+    }
+    METRICS_PHASE(PHASE_OPTIMIZE);
+    Node *optTree = constantOptimizer(tree);
+    useNodeArena(diffArena);
+    for (int i = 0; i <= v->top; i++)
+    {
+        METRICS_PHASE(PHASE_GRAD);
+        Node *diffTree = autoGrad(optTree, v->dictOrder[i]);
+        METRICS_PHASE(PHASE_OPTIMIZE);
+        Node *optDiffTree = constantOptimizer(diffTree);
+        METRICS_PHASE(PHASE_PRINT);
+        fprintf(fp, "%s: ", v->s[v->dictOrder[i]]);
+        fprintTree(fp, optDiffTree, v);
+        fputc('\n', fp);
+        METRICS_PHASE(PHASE_FREE);
+        resetNodeArena(diffArena);
+    }
+    METRICS_PHASE(PHASE_PRINT);
+    if (v->top == -1)
+    {
+        fprintf(fp, "[warning] No variable in original expression: ");
+        fprintTree(fp, optTree, v);
+        fputc('\n', fp);
+    }
+    fputc('\n', fp);
+    useNodeArena(NULL);
+}
+
+/**
+ * @brief Worker thread: claim, differentiate and hand over expressions
+ *
+ * @param arg batch
+ * @return void* NULL
+ */
+static void *runWorker(void *arg)
+{
+    Batch *b = (Batch *)arg;
+    NodeArena *treeArena = createNodeArena();
+    NodeArena *diffArena = createNodeArena();
+    VariableList *v = createVariableList();
+    char *line = NULL;
+    int capacity = 0;
+    for (;;)
+    {
+        /* claim the next line, blank lines included so the output matches the input */
+        pthread_mutex_lock(&b->lock);
+        while (!b->eof && b->next - b->written >= BATCH_WINDOW)
+            pthread_cond_wait(&b->room, &b->lock);
+        METRICS_START();
+        METRICS_PHASE(PHASE_READ);
+        String s = {NULL, 0, 0};
+        if (b->eof || !nextExpression(b->in, &s))
+        {
+            b->eof = 1;
+            pthread_cond_broadcast(&b->ready);
+            pthread_cond_broadcast(&b->room);
+            pthread_mutex_unlock(&b->lock);
+            break;
+        }
+        /* the view may be overwritten by the next read */
+        if (s.length >= capacity)
+        {
+            capacity = s.length + 1;
+            line = (char *)realloc(line, capacity);
+            if (!line)
+            {
+                fprintf(stderr, "[runBatch] malloc failed.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(line, s.s, s.length + 1);
+        int len = s.length;
+        long i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+
+        char *buffer;
+        size_t size;
+        FILE *fp = open_memstream(&buffer, &size);
+        if (!fp)
+        {
+            fprintf(stderr, "[runBatch] open_memstream failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        differentiate(line, len, i + 1, v, treeArena, diffArena, fp);
+        fclose(fp);
+        METRICS_PHASE(PHASE_FREE);
+        clearVariableList(v);
+        resetNodeArena(treeArena);
+        METRICS_PRINT(stderr, i);
+
+        pthread_mutex_lock(&b->lock);
+        b->ring[i % BATCH_WINDOW] = buffer;
+        b->ringSize[i % BATCH_WINDOW] = size;
+        pthread_cond_broadcast(&b->ready);
+        pthread_mutex_unlock(&b->lock);
+    }
+    free(line);
+    freeVariableList(v);
+    freeNodeArena(treeArena);
+    freeNodeArena(diffArena);
+    return NULL;
+}
+
+static double seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Differentiate all the expressions of a file
+ *
+ * The calling thread writes the results in input order while the workers
+ * run. The throughput is printed to stderr at the end.
+ *
+ * @param in input, one expression per line
+ * @param out output
+ * @param threads number of worker threads, 0 for one per CPU
+ * @return long number of input lines
+ */
+long runBatch(FILE *in, FILE *out, int threads)
+{
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    double start = seconds();
+    Batch *b = (Batch *)calloc(1, sizeof(Batch));
+    pthread_t *workers = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    if (!b || !workers)
+    {
+        fprintf(stderr, "[runBatch] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    b->in = openInput(in);
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->ready, NULL);
+    pthread_cond_init(&b->room, NULL);
+    for (int i = 0; i < threads; i++)
+        if (pthread_create(&workers[i], NULL, runWorker, b))
+        {
+            fprintf(stderr, "[runBatch] pthread_create failed.\n");
+            exit(EXIT_FAILURE);
+        }
+
+    /* write the results in order */
+    long i = 0;
+    pthread_mutex_lock(&b->lock);
+    for (;;)
+    {
+        while (!(i < b->next && b->ring[i % BATCH_WINDOW]) && !(b->eof && i >= b->next))
+            pthread_cond_wait(&b->ready, &b->lock);
+        if (i >= b->next)
+            break;
+        char *buffer = b->ring[i % BATCH_WINDOW];
+        size_t size = b->ringSize[i % BATCH_WINDOW];
+        b->ring[i % BATCH_WINDOW] = NULL;
+        b->written = ++i;
+        pthread_cond_broadcast(&b->room);
+        pthread_mutex_unlock(&b->lock);
+        fwrite(buffer, 1, size, out);
+        free(buffer);
+        pthread_mutex_lock(&b->lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    for (int k = 0; k < threads; k++)
+        pthread_join(workers[k], NULL);
+    fflush(out);
+    double elapsed = seconds() - start;
+    fprintf(stderr, "[runBatch] %ld expressions in %.3f s, %.0f expressions/s, %d threads\n",
+            i, elapsed, elapsed > 0 ? i / elapsed : 0.0, threads);
+    closeInput(b->in);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->ready);
+    pthread_cond_destroy(&b->room);
+    free(workers);
+    free(b);
+    return i;
+}
@@ -0,0 +1,37 @@
+/**
+ * @file batch.h
+ * @brief Batch processing of many expressions.
+ *
+ * Starting the program once per expression costs more than differentiating
+ * a typical expression. In batch mode, one process reads newline-separated
+ * expressions and differentiates them on a pool of threads. Each thread has
+ * its own node arenas and variable list, so the threads share nothing but
+ * the input and the output. The results are written in input order through
+ * a reordering buffer, which also bounds how far the threads may run ahead
+ * of the output.
+ */
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <stdio.h>
+
+/**
+ * @brief Number of results the threads may run ahead of the output.
+ */
+#define BATCH_WINDOW 1024
+
+/**
+ * @defgroup batch Batch functions
+ *
+ * The output of each expression is the output of the program for that
+ * expression alone, followed by an empty line. A blank line gives
+ * "[warning] line N: Empty expression" and a line with a syntax error gives
+ * "[error] line N: " and the message, each followed by an empty line, and the
+ * batch goes on. So the output has one block per input line.
+ *
+ * @{
+ */
+long runBatch(FILE *in, FILE *out, int threads);
+/** @} */
+
+#endif
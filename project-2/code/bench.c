@@ -0,0 +1,985 @@
+/**
+ * @file bench.c
+ * @brief Parser and evaluation benchmarks.
+ *
+ * Usage: ./bench [parse] [max tokens] [seed] [generator options]
+ *        ./bench eval [points] [seed] [threads] [generator options]
+ *        ./bench deep [max leaves] [seed] [generator options]
+ *        ./bench suite [max leaves] [seed] [generator options]
+ *        ./bench generate [leaves] [seed] [generator options]
+ *
+ * Generator options: --shape chain|balanced|random|nested, --vars N,
+ * --depth N, --functions P and --constants P (percent), see generate.h. All
+ * the expressions come from the generator, so the same seed and options give
+ * the same expressions on every platform.
+ *
+ * parse generates expressions of growing length and times exprParser
+ * and linearParser on the same token streams. The two trees are also compared
+ * node by node, so the benchmark fails if the parsers disagree. linearParser
+ * is timed again with its nodes in an arena, which is reset instead of
+ * freeing the tree.
+ *
+ * eval generates an expression of 16 leaves and evaluates it with all its
+ * derivatives at random points, once by walking the trees and once with the
+ * compiled bytecode, point by point and in batches of columns on one and on
+ * several threads, as native code, and from the tree with dual numbers, and
+ * reports evaluations per second. The results are compared, so the benchmark
+ * fails if they disagree.
+ *
+ * deep generates expressions of growing size in five shapes: a chain (as
+ * deep as the number of terms), a nested chain (as deep, and the parser
+ * nests as deep), a balanced tree (depth log2 of the leaves), and the
+ * quotient f/f and log(f, f) of two equal chains. It times each phase of the
+ * program on them, with the nodes allocated by malloc and in an arena like
+ * ./expr --malloc and --arena: parsing, optimizing, differentiating and
+ * optimizing the derivative, collecting and canonicalizing the parsed tree,
+ * compiling it and the derivative to bytecode, converting the parsed tree to
+ * a compact tree and back, printing and freeing. The round trip must give
+ * the same tree, as told by compareTree. The
+ * two sides of f/f are separate trees there, so optimizing and collecting
+ * compare them node by node. Deep trees must not overflow the call stack.
+ *
+ * suite generates expressions of 256, 1024, ... leaves in each shape (or the
+ * one given) and times each phase of the program on them in a node store:
+ * tokenizing, parsing, differentiating for every variable, optimizing the
+ * derivatives and printing them. For each phase, it reports the size of its
+ * input and output, the input processed per second and the growth. The
+ * sizes are characters, tokens, or distinct nodes of the trees.
+ *
+ * generate prints one generated expression, for use as a test input.
+ */
+#include "expression.h"
+#include "arena.h"
+#include "compact.h"
+#include "dag.h"
+#include "dual.h"
+#include "generate.h"
+#include "native.h"
+#include "vm.h"
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief Check if two trees are identical, operand order included
+ *
+ * @param a tree a
+ * @param b tree b
+ * @return int 1 if identical, 0 if not
+ */
+static int identical(const Node *a, const Node *b)
+{
+    while (a && b)
+    {
+        if (a->token.type != b->token.type || a->token.value != b->token.value)
+            return 0;
+        if (!identical(a->b, b->b))
+            return 0;
+        a = a->a;
+        b = b->a;
+    }
+    return a == b;
+}
+
+/**
+ * @brief Count the nodes of a tree, without recursion
+ *
+ * @param n root of the tree
+ * @return int number of nodes
+ */
+static int countTree(const Node *n)
+{
+    int count = 0, size = 64, num = 0;
+    const Node **nodes = (const Node **)malloc(sizeof(Node *) * size);
+    if (!nodes)
+    {
+        fprintf(stderr, "[countTree] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (n)
+        nodes[num++] = n;
+    while (num)
+    {
+        const Node *m = nodes[--num];
+        count++;
+        if (num + 2 > size)
+        {
+            size *= 2;
+            nodes = (const Node **)realloc(nodes, sizeof(Node *) * size);
+            if (!nodes)
+            {
+                fprintf(stderr, "[countTree] malloc failed.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (m->a)
+            nodes[num++] = m->a;
+        if (m->b)
+            nodes[num++] = m->b;
+    }
+    free(nodes);
+    return count;
+}
+
+static double seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Time the parsers on expressions of growing length
+ *
+ * @param o generator options, for the seed, the shape and the mix
+ * @param maxTokens length of the longest expression
+ * @return int 0 on success, 1 if the parsers disagree
+ */
+static int parseBench(GeneratorOptions o, int maxTokens)
+{
+    printf("%10s %14s %14s %8s %14s\n", "tokens", "exprParser s", "linearParser s", "speedup", "arena s");
+    NodeArena *arena = createNodeArena();
+    for (o.leaves = 16;; o.leaves *= 2)
+    {
+        int length;
+        char *expr = generateExpression(&o, &length);
+        String s = {expr, length, 0};
+        VariableList *v = createVariableList();
+        int num;
+        Token *tokens = tokenize(&s, v, &num);
+        if (num > maxTokens)
+        {
+            free(tokens);
+            freeVariableList(v);
+            free(expr);
+            break;
+        }
+
+        /* repeat small inputs so every measurement takes a while */
+        int reps = 1 + 65536 / num;
+        double start = seconds();
+        Node *old = NULL;
+        for (int i = 0; i < reps; i++)
+        {
+            if (old)
+                freeTree(old);
+            old = exprParser(tokens, 0, num - 1);
+        }
+        double bracket = (seconds() - start) / reps;
+        start = seconds();
+        Node *linear = NULL;
+        for (int i = 0; i < reps; i++)
+        {
+            if (linear)
+                freeTree(linear);
+            linear = linearParser(tokens, num);
+        }
+        double climb = (seconds() - start) / reps;
+        useNodeArena(arena);
+        start = seconds();
+        for (int i = 0; i < reps; i++)
+        {
+            resetNodeArena(arena);
+            linearParser(tokens, num);
+        }
+        double pooled = (seconds() - start) / reps;
+        resetNodeArena(arena);
+        useNodeArena(NULL);
+
+        if (!identical(old, linear))
+        {
+            fprintf(stderr, "Parsers disagree on: %s\n", expr);
+            return 1;
+        }
+        printf("%10d %14.6f %14.6f %7.1fx %14.6f\n", num, bracket, climb, bracket / climb, pooled);
+
+        freeTree(old);
+        freeTree(linear);
+        free(tokens);
+        freeVariableList(v);
+        free(expr);
+    }
+    freeNodeArena(arena);
+    return 0;
+}
+
+/**
+ * @brief Generate an expression of a shape for deepBench
+ *
+ * @param o generator options, for the seed and the mix
+ * @param shape 0 for a chain, 1 for a nested chain, 2 for a balanced tree,
+ * 3 for the quotient of two equal chains, 4 for their log
+ * @param leaves number of leaves
+ * @param length length of the expression
+ * @return char* expression, to be freed by the caller
+ */
+static char *generateDeep(GeneratorOptions o, int shape, int leaves, int *length)
+{
+    static const GeneratorShape shapes[] = {SHAPE_CHAIN, SHAPE_NESTED, SHAPE_BALANCED};
+    o.leaves = shape < 3 ? leaves : leaves / 2;
+    o.shape = shape < 3 ? shapes[shape] : SHAPE_CHAIN;
+    int n;
+    char *f = generateExpression(&o, &n);
+    if (shape < 3)
+    {
+        *length = n;
+        return f;
+    }
+    char *expr = (char *)malloc(2 * (size_t)n + 8);
+    if (!expr)
+    {
+        fprintf(stderr, "[deepBench] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    *length = sprintf(expr, shape == 3 ? "(%s)/(%s)" : "log(%s,%s)", f, f);
+    free(f);
+    return expr;
+}
+
+/**
+ * @brief Depth of a tree, without recursion
+ *
+ * @param n root of the tree
+ * @return int depth, 1 for a single node
+ */
+static int treeDepth(const Node *n)
+{
+    int depth = 0, size = 64, num = 0;
+    const Node **nodes = (const Node **)malloc(sizeof(Node *) * size);
+    int *depths = (int *)malloc(sizeof(int) * size);
+    if (!nodes || !depths)
+    {
+        fprintf(stderr, "[treeDepth] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    nodes[num] = n;
+    depths[num++] = 1;
+    while (num)
+    {
+        num--;
+        const Node *m = nodes[num];
+        int d = depths[num];
+        if (d > depth)
+            depth = d;
+        if (num + 2 > size)
+        {
+            size *= 2;
+            nodes = (const Node **)realloc(nodes, sizeof(Node *) * size);
+            depths = (int *)realloc(depths, sizeof(int) * size);
+            if (!nodes || !depths)
+            {
+                fprintf(stderr, "[treeDepth] malloc failed.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (m->a)
+        {
+            nodes[num] = m->a;
+            depths[num++] = d + 1;
+        }
+        if (m->b)
+        {
+            nodes[num] = m->b;
+            depths[num++] = d + 1;
+        }
+    }
+    free(nodes);
+    free(depths);
+    return depth;
+}
+
+/**
+ * @brief Time the phases of the program on deep and balanced trees
+ *
+ * @param o generator options, for the seed and the mix
+ * @param maxLeaves number of leaves of the largest expression
+ * @return int 0 on success
+ */
+static int deepBench(GeneratorOptions o, int maxLeaves)
+{
+    static const char *shapes[] = {"chain", "nested", "balanced", "quotient", "log"};
+    FILE *null = fopen("/dev/null", "w");
+    if (!null)
+    {
+        fprintf(stderr, "[deepBench] can't open /dev/null.\n");
+        return 1;
+    }
+    NodeArena *arena = createNodeArena();
+    printf("%-9s %-6s %8s %8s %10s %10s %10s %10s %10s %10s %10s %10s\n", "shape", "nodes",
+           "leaves", "depth", "parse s", "optimize s", "grad s", "collect s", "compile s",
+           "compact s", "print s", "free s");
+    for (int shape = 0; shape < 5; shape++)
+        for (int leaves = 1024; leaves <= maxLeaves; leaves *= 4)
+            for (int inArena = 0; inArena < 2; inArena++)
+            {
+                int length;
+                char *expr = generateDeep(o, shape, leaves, &length);
+                String s = {expr, length, 0};
+                VariableList *v = createVariableList();
+                useNodeArena(inArena ? arena : NULL);
+
+                double start = seconds();
+                Node *tree = parser(&s, v);
+                double parse = seconds() - start;
+                start = seconds();
+                Node *optTree = constantOptimizer(tree);
+                double optimize = seconds() - start;
+                start = seconds();
+                Node *diffTree = autoGrad(optTree, 0);
+                Node *optDiffTree = constantOptimizer(diffTree);
+                double grad = seconds() - start;
+                start = seconds();
+                Node *collected = collectOptimizer(tree);
+                Node *canonical = canonicalTree(tree);
+                double collect = seconds() - start;
+                start = seconds();
+                Program *p = createProgram(v->top + 1);
+                compileTree(p, tree);
+                compileTree(p, optDiffTree);
+                double compile = seconds() - start;
+                start = seconds();
+                CompactTree *t = createCompactTree(0);
+                Node *expanded = expandTree(t, compactTree(t, tree));
+                double compact = seconds() - start;
+                if (!compareTree(expanded, tree))
+                {
+                    fprintf(stderr, "[deepBench] %s: compact round trip differs.\n",
+                            shapes[shape]);
+                    return 1;
+                }
+                freeCompactTree(t);
+                start = seconds();
+                fprintTree(null, optTree, v);
+                fprintTree(null, optDiffTree, v);
+                double print = seconds() - start;
+                int depth = treeDepth(tree);
+                start = seconds();
+                freeTree(tree);
+                freeTree(optTree);
+                freeTree(diffTree);
+                freeTree(optDiffTree);
+                freeTree(collected);
+                freeTree(canonical);
+                freeTree(expanded);
+                resetNodeArena(arena);
+                double release = seconds() - start;
+
+                printf("%-9s %-6s %8d %8d %10.6f %10.6f %10.6f %10.6f %10.6f %10.6f %10.6f "
+                       "%10.6f\n",
+                       shapes[shape], inArena ? "arena" : "malloc", leaves, depth, parse,
+                       optimize, grad, collect, compile, compact, print, release);
+                useNodeArena(NULL);
+                freeProgram(p);
+                freeVariableList(v);
+                free(expr);
+            }
+    freeNodeArena(arena);
+    fclose(null);
+    return 0;
+}
+
+/**
+ * @brief Count the distinct nodes reachable from some roots, without
+ * recursion
+ *
+ * @param roots roots, may be NULL
+ * @param num number of roots
+ * @return long number of distinct nodes
+ */
+static long countDistinct(Node *const *roots, int num)
+{
+    long count = 0;
+    size_t buckets = 1024, size = 64, top = 0;
+    const Node **set = (const Node **)calloc(buckets, sizeof(Node *));
+    const Node **stack = (const Node **)malloc(sizeof(Node *) * size);
+    if (!set || !stack)
+    {
+        fprintf(stderr, "[countDistinct] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num || top;)
+    {
+        const Node *n = top ? stack[--top] : roots[i++];
+        if (!n)
+            continue;
+        size_t h = ((uintptr_t)n >> 4) * 0x9e3779b97f4a7c15ULL % buckets;
+        while (set[h] && set[h] != n)
+            h = (h + 1) % buckets;
+        if (set[h])
+            continue;
+        set[h] = n;
+        if (++count * 2 > (long)buckets)
+        {
+            /* rehash into twice the buckets */
+            const Node **old = set;
+            set = (const Node **)calloc(buckets * 2, sizeof(Node *));
+            if (!set)
+            {
+                fprintf(stderr, "[countDistinct] malloc failed.\n");
+                exit(EXIT_FAILURE);
+            }
+            for (size_t j = 0; j < buckets; j++)
+                if (old[j])
+                {
+                    size_t k = ((uintptr_t)old[j] >> 4) * 0x9e3779b97f4a7c15ULL % (buckets * 2);
+                    while (set[k])
+                        k = (k + 1) % (buckets * 2);
+                    set[k] = old[j];
+                }
+            free(old);
+            buckets *= 2;
+        }
+        if (top + 2 > size)
+        {
+            size *= 2;
+            stack = (const Node **)realloc(stack, sizeof(Node *) * size);
+            if (!stack)
+            {
+                fprintf(stderr, "[countDistinct] malloc failed.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        stack[top++] = n->a;
+        stack[top++] = n->b;
+    }
+    free(set);
+    free(stack);
+    return count;
+}
+
+/**
+ * @brief Print one phase of suiteBench
+ */
+static void printPhase(const char *shape, int leaves, const char *phase, double time, long in,
+                       long out)
+{
+    printf("%-8s %8d %-9s %10.6f %10ld %10ld %12.0f %8.3f\n", shape, leaves, phase, time, in, out,
+           time > 0 ? in / time : 0.0, in ? (double)out / in : 0.0);
+}
+
+/**
+ * @brief Time the phases of the program on generated expressions of growing
+ * size
+ *
+ * @param o generator options, for the seed and the mix
+ * @param shape shape to be run, -1 for all
+ * @param maxLeaves number of leaves of the largest expression
+ * @return int 0 on success
+ */
+static int suiteBench(GeneratorOptions o, int shape, int maxLeaves)
+{
+    printf("%-8s %8s %-9s %10s %10s %10s %12s %8s\n", "shape", "leaves", "phase", "seconds",
+           "in", "out", "in/s", "out/in");
+    for (int sh = 0; sh < NUM_SHAPES; sh++)
+    {
+        if (shape >= 0 && sh != shape)
+            continue;
+        for (int leaves = 256; leaves <= maxLeaves; leaves *= 4)
+        {
+            o.shape = (GeneratorShape)sh;
+            o.leaves = leaves;
+            int length;
+            char *expr = generateExpression(&o, &length);
+            String s = {expr, length, 0};
+            VariableList *v = createVariableList();
+            NodeStore *store = createNodeStore();
+            useNodeStore(store);
+
+            double start = seconds();
+            int num;
+            Token *tokens = tokenize(&s, v, &num);
+            double tokenizeTime = seconds() - start;
+            start = seconds();
+            Node *tree = linearParser(tokens, num);
+            double parseTime = seconds() - start;
+            free(tokens);
+
+            int numVars = v->top + 1;
+            Node **grads = (Node **)malloc(sizeof(Node *) * (numVars + 1));
+            Node **optGrads = (Node **)malloc(sizeof(Node *) * (numVars + 1));
+            if (!grads || !optGrads)
+            {
+                fprintf(stderr, "[suiteBench] malloc failed.\n");
+                exit(EXIT_FAILURE);
+            }
+            start = seconds();
+            for (int i = 0; i < numVars; i++)
+                grads[i] = autoGrad(tree, i);
+            double gradTime = seconds() - start;
+            start = seconds();
+            for (int i = 0; i < numVars; i++)
+                optGrads[i] = constantOptimizer(grads[i]);
+            double optimizeTime = seconds() - start;
+            PrintBuffer b;
+            long chars = 0;
+            initPrintBuffer(&b, NULL, 0, NULL, 0);
+            start = seconds();
+            for (int i = 0; i < numVars; i++)
+            {
+                b.length = 0;
+                renderTree(&b, optGrads[i], v, 0);
+                chars += b.length;
+            }
+            double printTime = seconds() - start;
+            freePrintBuffer(&b);
+
+            long treeNodes = countDistinct(&tree, 1);
+            long gradNodes = countDistinct(grads, numVars);
+            long optNodes = countDistinct(optGrads, numVars);
+            const char *name = shapeNames[sh];
+            printPhase(name, leaves, "tokenize", tokenizeTime, length, num);
+            printPhase(name, leaves, "parse", parseTime, num, treeNodes);
+            printPhase(name, leaves, "grad", gradTime, treeNodes, gradNodes);
+            printPhase(name, leaves, "optimize", optimizeTime, gradNodes, optNodes);
+            printPhase(name, leaves, "print", printTime, optNodes, chars);
+
+            free(grads);
+            free(optGrads);
+            useNodeStore(NULL);
+            freeNodeStore(store);
+            freeVariableList(v);
+            free(expr);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Stacks of evalTree, kept from one walk to the next
+ */
+typedef struct eval_stack EvalStack;
+struct eval_stack
+{
+    const Node **nodes;
+    int *states; /* 0: operand a next, 1: operand b next, 2: both done */
+    double *values;
+    int size;
+};
+
+/**
+ * @brief Apply the token of a node to the values of its operands
+ *
+ * @param n node
+ * @param a value of operand a, 0 if none
+ * @param b value of operand b, 0 if none
+ * @param vars value of each variable
+ * @return double value of the node
+ */
+static double applyNode(const Node *n, double a, double b, const double *vars)
+{
+    switch (n->token.type)
+    {
+    case digit:
+        return n->token.value;
+    case variable:
+        return vars[n->token.value];
+    case operator:
+        switch (n->token.value)
+        {
+        case '+':
+            return a + b;
+        case '-':
+            return a - b;
+        case '*':
+            return a * b;
+        case '/':
+            return a / b;
+        default:
+            return pow(a, b);
+        }
+    case fun1:
+        switch (n->token.value)
+        {
+        case 0:
+            return log(a);
+        case 1:
+            return cos(a);
+        case 2:
+            return sin(a);
+        case 3:
+            return tan(a);
+        default:
+            return exp(a);
+        }
+    case fun2:
+        return n->token.value == 0 ? log(b) / log(a) : pow(a, b);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Evaluate the tree by walking it, without recursion
+ *
+ * @param e stacks, grown as needed
+ * @param n root of the tree
+ * @param vars value of each variable
+ * @return double value of the tree
+ */
+static double evalTree(EvalStack *e, const Node *n, const double *vars)
+{
+    int top = 0, values = 0;
+    e->nodes[top] = n;
+    e->states[top++] = 0;
+    while (top)
+    {
+        const Node *m = e->nodes[top - 1];
+        int state = e->states[top - 1]++;
+        const Node *next = state == 0 ? m->a : state == 1 ? m->b : NULL;
+        if (state < 2)
+        {
+            if (!next)
+                continue;
+            if (top == e->size)
+            {
+                /* values holds at most one more entry than nodes */
+                e->size *= 2;
+                e->nodes = (const Node **)realloc(e->nodes, sizeof(Node *) * e->size);
+                e->states = (int *)realloc(e->states, sizeof(int) * e->size);
+                e->values = (double *)realloc(e->values, sizeof(double) * (e->size + 1));
+                if (!e->nodes || !e->states || !e->values)
+                {
+                    fprintf(stderr, "[evalTree] malloc failed.\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            e->nodes[top] = next;
+            e->states[top++] = 0;
+            continue;
+        }
+        double b = m->b ? e->values[--values] : 0;
+        double a = m->a ? e->values[--values] : 0;
+        e->values[values++] = applyNode(m, a, b, vars);
+        top--;
+    }
+    return e->values[0];
+}
+
+/**
+ * @brief Check if two results agree
+ *
+ * @param x result
+ * @param y result
+ * @return int 1 if equal up to rounding or both not a number
+ */
+static int agree(double x, double y)
+{
+    if (isnan(x) || isnan(y))
+        return isnan(x) && isnan(y);
+    if (isinf(x) || isinf(y))
+        return x == y;
+    return fabs(x - y) <= 1e-9 * (1 + fabs(x) + fabs(y));
+}
+
+/**
+ * @brief Time the evaluation of an expression and its derivatives
+ *
+ * @param o generator options, for the seed, the shape and the mix
+ * @param points number of points to evaluate at
+ * @param threads number of threads for the batch, 0 for one per CPU
+ * @return int 0 on success, 1 if the results disagree
+ */
+static int evalBench(GeneratorOptions o, int points, int threads)
+{
+    o.leaves = 16;
+    int length;
+    char *expr = generateExpression(&o, &length);
+    String s = {expr, length, 0};
+    VariableList *v = createVariableList();
+    Node *tree = parser(&s, v);
+    int numVars = v->top + 1;
+
+    /* the trees another tool would parse from the output */
+    Node **trees = (Node **)malloc(sizeof(Node *) * (numVars + 1));
+    double *vars = (double *)malloc(sizeof(double) * (numVars + 1) * points);
+    double *treeOut = (double *)malloc(sizeof(double) * (numVars + 1));
+    double *vmOut = (double *)malloc(sizeof(double) * (numVars + 1));
+    if (!trees || !vars || !treeOut || !vmOut)
+    {
+        fprintf(stderr, "[evalBench] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    trees[0] = constantOptimizer(tree);
+    int treeNodes = 0;
+    for (int i = 0; i < numVars; i++)
+    {
+        Node *diffTree = autoGrad(trees[0], i);
+        trees[i + 1] = constantOptimizer(diffTree);
+        freeTree(diffTree);
+    }
+    /* points from 0.5 to 2, by xorshift64* from the seed */
+    unsigned long long state = o.seed * 0x9e3779b97f4a7c15ULL | 1;
+    for (int i = 0; i < (numVars + 1) * points; i++)
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        vars[i] = 0.5 + 1.5 * ((state * 0x2545f4914f6cdd1dULL) >> 11) * 0x1p-53;
+    }
+
+    Program *p = createProgram(numVars);
+    for (int i = 0; i <= numVars; i++)
+    {
+        compileTree(p, trees[i]);
+        treeNodes += countTree(trees[i]);
+    }
+    double *regs = (double *)malloc(sizeof(double) * p->num);
+    if (!regs)
+    {
+        fprintf(stderr, "[evalBench] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("expression: %s\n", expr);
+    printf("%d variables, %d tree nodes, %d instructions\n", numVars, treeNodes, p->num);
+
+    EvalStack e = {(const Node **)malloc(sizeof(Node *) * 64), (int *)malloc(sizeof(int) * 64),
+                   (double *)malloc(sizeof(double) * 65), 64};
+    if (!e.nodes || !e.states || !e.values)
+    {
+        fprintf(stderr, "[evalBench] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    double sum = 0;
+    double start = seconds();
+    for (int k = 0; k < points; k++)
+    {
+        for (int i = 0; i <= numVars; i++)
+            sum += evalTree(&e, trees[i], vars + k * numVars);
+    }
+    double walk = seconds() - start;
+    start = seconds();
+    for (int k = 0; k < points; k++)
+    {
+        runProgram(p, vars + k * numVars, regs, vmOut);
+        sum += vmOut[0];
+    }
+    double vm = seconds() - start;
+
+    /* the same points as columns */
+    double **columns = (double **)malloc(sizeof(double *) * (numVars + 1));
+    double **outputs = (double **)malloc(sizeof(double *) * (numVars + 1));
+    if (!columns || !outputs)
+    {
+        fprintf(stderr, "[evalBench] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i <= numVars; i++)
+    {
+        columns[i] = (double *)malloc(sizeof(double) * points);
+        outputs[i] = (double *)malloc(sizeof(double) * points);
+        if (!columns[i] || !outputs[i])
+        {
+            fprintf(stderr, "[evalBench] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < points && i < numVars; k++)
+            columns[i][k] = vars[k * numVars + i];
+    }
+    start = seconds();
+    runProgramBatch(p, (const double *const *)columns, outputs, points, 1);
+    double batch = seconds() - start;
+    start = seconds();
+    runProgramBatch(p, (const double *const *)columns, outputs, points, threads);
+    double parallel = seconds() - start;
+
+    printf("%14s %14s %14s %14s\n", "tree evals/s", "vm evals/s", "batch evals/s", "threads evals/s");
+    printf("%14.0f %14.0f %14.0f %14.0f\n", points / walk, points / vm, points / batch, points / parallel);
+
+    /* value and gradient from the expression tree, in one walk or one per variable */
+    DualEvaluator *dual = createDualEvaluator(numVars);
+    double *dualOut = (double *)malloc(sizeof(double) * (numVars + 1));
+    Node **gradTrees = (Node **)malloc(sizeof(Node *) * (numVars + 1));
+    if (!dualOut || !gradTrees)
+    {
+        fprintf(stderr, "[evalBench] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    start = seconds();
+    for (int k = 0; k < points; k++)
+        sum += dualGradient(dual, trees[0], vars + k * numVars, dualOut + 1);
+    double vector = seconds() - start;
+    start = seconds();
+    for (int k = 0; k < points; k++)
+    {
+        for (int i = 0; i < numVars; i++)
+            sum += dualDerivative(dual, trees[0], vars + k * numVars, i, dualOut + 1 + i);
+    }
+    double scalar = seconds() - start;
+    printf("dual: %.0f gradient evals/s, %.0f with one walk per variable\n", points / vector,
+           points / scalar);
+    /* constantOptimizer folds in integers, which wrap, so compare with autoGrad alone */
+    gradTrees[0] = trees[0];
+    for (int i = 0; i < numVars; i++)
+        gradTrees[i + 1] = autoGrad(trees[0], i);
+
+    start = seconds();
+    NativeCode *native = compileNative(p, NULL);
+    double compile = seconds() - start;
+    double *nativeOut = (double *)malloc(sizeof(double) * (numVars + 1));
+    if (!nativeOut)
+    {
+        fprintf(stderr, "[evalBench] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (native)
+    {
+        start = seconds();
+        for (int k = 0; k < points; k++)
+        {
+            native->function(vars + k * numVars, nativeOut);
+            sum += nativeOut[0];
+        }
+        double direct = seconds() - start;
+        printf("native: %.3f s to %s %016llx, %.0f evals/s\n", compile,
+               native->cached ? "load cached" : "compile", native->hash, points / direct);
+    }
+
+    int ret = 0;
+    for (int k = 0; k < points && !ret; k += 1 + points / 1000)
+    {
+        runProgram(p, vars + k * numVars, regs, vmOut);
+        dualOut[0] = dualGradient(dual, trees[0], vars + k * numVars, dualOut + 1);
+        for (int i = 0; i <= numVars && !ret; i++)
+        {
+            double expected = evalTree(&e, gradTrees[i], vars + k * numVars);
+            /*
+             * the formulas are grouped differently, so they round and overflow
+             * differently: with the huge powers of the folded constants, the
+             * results may only agree to a few digits, where a wrong rule would
+             * not agree at all
+             */
+            double scale = 1 + fabs(expected) + fabs(dualOut[i]) + fabs(dualOut[0]);
+            if (isfinite(expected) && isfinite(dualOut[i]) &&
+                fabs(expected - dualOut[i]) > 1e-3 * scale)
+            {
+                fprintf(stderr, "Dual numbers disagree for output %d: %g %g\n", i, expected,
+                        dualOut[i]);
+                ret = 1;
+            }
+        }
+        for (int i = 0; i <= numVars; i++)
+        {
+            treeOut[i] = evalTree(&e, trees[i], vars + k * numVars);
+            if (native)
+                native->function(vars + k * numVars, nativeOut);
+            if (!agree(treeOut[i], vmOut[i]) || !agree(vmOut[i], outputs[i][k]) ||
+                (native && !agree(vmOut[i], nativeOut[i])))
+            {
+                fprintf(stderr, "Results disagree for output %d: %g %g %g\n", i,
+                        treeOut[i], vmOut[i], outputs[i][k]);
+                ret = 1;
+            }
+        }
+    }
+    /* keep the loops from being optimized away */
+    if (sum == 0.123456789)
+        putchar('\n');
+
+    for (int i = 0; i <= numVars; i++)
+    {
+        freeTree(trees[i]);
+        free(columns[i]);
+        free(outputs[i]);
+    }
+    free(columns);
+    free(outputs);
+    free(nativeOut);
+    for (int i = 1; i <= numVars; i++)
+        freeTree(gradTrees[i]);
+    free(gradTrees);
+    free(dualOut);
+    freeDualEvaluator(dual);
+    if (native)
+        freeNativeCode(native);
+    freeTree(tree);
+    freeProgram(p);
+    free(trees);
+    free(vars);
+    free(treeOut);
+    free(vmOut);
+    free(regs);
+    free(e.nodes);
+    free(e.states);
+    free(e.values);
+    freeVariableList(v);
+    free(expr);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    /* generator options may come anywhere */
+    GeneratorOptions o = defaultGeneratorOptions();
+    int shape = -1, numArgs = 0, bad = 0;
+    char *args[4];
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--shape") && i + 1 < argc)
+        {
+            i++;
+            for (shape = NUM_SHAPES - 1; shape >= 0 && strcmp(argv[i], shapeNames[shape]); shape--)
+                ;
+            bad |= shape < 0;
+        }
+        else if (!strcmp(argv[i], "--vars") && i + 1 < argc)
+            o.vars = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--depth") && i + 1 < argc)
+            o.depth = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--functions") && i + 1 < argc)
+            o.functions = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--constants") && i + 1 < argc)
+            o.constants = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && numArgs < 4)
+            args[numArgs++] = argv[i];
+        else
+            bad = 1;
+    }
+    if (bad || o.vars < 1 || o.depth < 0)
+    {
+        fprintf(stderr, "Usage: %s [parse] [max tokens] [seed] [generator options]\n"
+                        "       %s eval [points] [seed] [threads] [generator options]\n"
+                        "       %s deep [max leaves] [seed] [generator options]\n"
+                        "       %s suite [max leaves] [seed] [generator options]\n"
+                        "       %s generate [leaves] [seed] [generator options]\n"
+                        "Generator options: --shape chain|balanced|random|nested --vars N\n"
+                        "                   --depth N --functions P --constants P\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *mode = numArgs && !isdigit((unsigned char)args[0][0]) ? args[0] : "parse";
+    int eval = !strcmp(mode, "eval");
+    int deep = !strcmp(mode, "deep");
+    int suite = !strcmp(mode, "suite");
+    int generate = !strcmp(mode, "generate");
+    int arg = mode == args[0] ? 1 : 0;
+    int n = numArgs > arg ? atoi(args[arg]) : eval ? 1000000 : deep ? 262144 : suite ? 65536
+                                                          : generate ? 1024 : 32768;
+    unsigned seed = numArgs > arg + 1 ? (unsigned)atoi(args[arg + 1]) : 1;
+    int threads = numArgs > arg + 2 ? atoi(args[arg + 2]) : 0;
+    o.seed = seed;
+    if (shape >= 0)
+        o.shape = (GeneratorShape)shape;
+    if (generate)
+    {
+        o.leaves = n;
+        char *expr = generateExpression(&o, NULL);
+        puts(expr);
+        free(expr);
+        return 0;
+    }
+    if (!eval && !deep && !suite && strcmp(mode, "parse"))
+    {
+        fprintf(stderr, "[main] unknown benchmark %s.\n", mode);
+        return EXIT_FAILURE;
+    }
+    if (suite ? suiteBench(o, shape, n) : deep ? deepBench(o, n) : eval ? evalBench(o, n, threads)
+                                                                      : parseBench(o, n))
+        return EXIT_FAILURE;
+    return 0;
+}
@@ -0,0 +1,1038 @@
+#include "compact.h"
+#include "arena.h"
+#include "dag.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @brief Create a Compact Tree object
+ *
+ * The tree will be dynamically allocated, so it must be freed by
+ * freeCompactTree after use.
+ *
+ * @param size initial number of nodes to make room for
+ * @return CompactTree* created tree
+ */
+CompactTree *createCompactTree(unsigned size)
+{
+    CompactTree *ret = (CompactTree *)malloc(sizeof(CompactTree));
+    if (!ret)
+    {
+        fprintf(stderr, "[createCompactTree] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    ret->num = 0;
+    ret->size = size ? size : 64;
+    ret->type = (unsigned char *)malloc(ret->size);
+    ret->value = (int *)malloc(ret->size * sizeof(int));
+    ret->a = (unsigned *)malloc(ret->size * sizeof(unsigned));
+    ret->b = (unsigned *)malloc(ret->size * sizeof(unsigned));
+    ret->hash = (unsigned *)malloc(ret->size * sizeof(unsigned));
+    if (!ret->type || !ret->value || !ret->a || !ret->b || !ret->hash)
+    {
+        fprintf(stderr, "[createCompactTree] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+/**
+ * @brief Append a node to the tree
+ *
+ * The arrays may move, so indices must be used instead of pointers into them.
+ *
+ * @param t compact tree
+ * @param token token of the node
+ * @param a index of the left child, COMPACT_NONE if none
+ * @param b index of the right child, COMPACT_NONE if none
+ * @return unsigned index of the node
+ */
+unsigned compactNode(CompactTree *t, Token token, unsigned a, unsigned b)
+{
+    if (t->num == t->size)
+    {
+        if (t->size >= COMPACT_NONE / 2)
+        {
+            fprintf(stderr, "[compactNode] too many nodes.\n");
+            exit(EXIT_FAILURE);
+        }
+        t->size *= 2;
+        t->type = realloc(t->type, t->size);
+        t->value = realloc(t->value, t->size * sizeof(int));
+        t->a = realloc(t->a, t->size * sizeof(unsigned));
+        t->b = realloc(t->b, t->size * sizeof(unsigned));
+        t->hash = realloc(t->hash, t->size * sizeof(unsigned));
+        if (!t->type || !t->value || !t->a || !t->b || !t->hash)
+        {
+            fprintf(stderr, "[compactNode] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    t->type[t->num] = (unsigned char)token.type;
+    t->value[t->num] = token.value;
+    t->a[t->num] = a;
+    t->b[t->num] = b;
+    t->hash[t->num] = combineHash(token, a != COMPACT_NONE ? t->hash[a] : 0,
+                                  b != COMPACT_NONE ? t->hash[b] : 0);
+    return t->num++;
+}
+
+/* shorthand for the rules below */
+static unsigned constant(CompactTree *t, int value)
+{
+    return compactNode(t, (Token){digit, value}, COMPACT_NONE, COMPACT_NONE);
+}
+static unsigned op(CompactTree *t, int c, unsigned a, unsigned b)
+{
+    return compactNode(t, (Token){operator, c}, a, b);
+}
+static unsigned fun(CompactTree *t, int f, unsigned a)
+{
+    return compactNode(t, (Token){fun1, f}, a, COMPACT_NONE);
+}
+static int isDigit(const CompactTree *t, unsigned n, int value)
+{
+    return t->type[n] == digit && t->value[n] == value;
+}
+
+/* Explicit stack */
+
+/**
+ * @brief Frame of a walk on an explicit stack
+ *
+ * The walks keep their pending nodes here instead of on the call stack, like
+ * the node walks, so a deep tree (a sum of 200k terms is a chain of 200k
+ * nodes) can't overflow it. state counts the children visited.
+ * compareCompact keeps the second subtree in other, printCompact its
+ * brackets, and compactParser the operator or function in t and the lowest
+ * binding power in minPrec.
+ */
+typedef struct compact_frame CompactFrame;
+struct compact_frame
+{
+    unsigned node, other;
+    Token t;
+    int state, minPrec;
+    int brackets; /* printCompact: 1 around a, 2 around b */
+};
+
+typedef struct compact_stack CompactStack;
+struct compact_stack
+{
+    CompactFrame *frames;
+    int num, size;
+};
+
+static void initStack(CompactStack *s)
+{
+    s->num = 0;
+    s->size = 64;
+    s->frames = (CompactFrame *)malloc(sizeof(CompactFrame) * s->size);
+    if (!s->frames)
+    {
+        fprintf(stderr, "[pushCompact] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Push a frame
+ *
+ * The frames may move, so pointers to them are invalid afterwards.
+ *
+ * @param s stack
+ * @param node node of the frame
+ * @param state state of the frame
+ * @return CompactFrame* new frame
+ */
+static CompactFrame *pushCompact(CompactStack *s, unsigned node, int state)
+{
+    if (s->num == s->size)
+    {
+        s->size *= 2;
+        s->frames = (CompactFrame *)realloc(s->frames, sizeof(CompactFrame) * s->size);
+        if (!s->frames)
+        {
+            fprintf(stderr, "[pushCompact] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    CompactFrame *f = &s->frames[s->num++];
+    f->node = node;
+    f->other = COMPACT_NONE;
+    f->state = state;
+    return f;
+}
+
+static void freeStack(CompactStack *s)
+{
+    free(s->frames);
+}
+
+/**
+ * @brief Mark the nodes of a subtree
+ *
+ * Children come before their parents, so one pass from the root down to
+ * index 0 reaches them all.
+ *
+ * @param t compact tree
+ * @param n index of the root
+ * @return unsigned char* 1 for each node of the subtree, n + 1 entries, to be
+ * freed with free()
+ */
+static unsigned char *markSubtree(const CompactTree *t, unsigned n)
+{
+    unsigned char *ret = (unsigned char *)calloc((size_t)n + 1, 1);
+    if (!ret)
+    {
+        fprintf(stderr, "[markSubtree] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    ret[n] = 1;
+    for (unsigned i = n + 1; i-- > 0;)
+    {
+        if (!ret[i])
+            continue;
+        if (t->a[i] != COMPACT_NONE)
+            ret[t->a[i]] = 1;
+        if (t->b[i] != COMPACT_NONE)
+            ret[t->b[i]] = 1;
+    }
+    return ret;
+}
+
+/* parser */
+
+/**
+ * @brief Cursor over a token stream for compactParser
+ */
+typedef struct compact_cursor CompactCursor;
+struct compact_cursor
+{
+    Token *t;
+    int index, num;
+    CompactTree *tree;
+};
+
+/**
+ * @brief Binding power of a binary operator
+ *
+ * @param t token
+ * @return int 1 for + -, 2 for * /, 3 for ^, 0 if t is not a binary operator
+ */
+static int precedence(Token t)
+{
+    if (t.type != operator)
+        return 0;
+    switch (t.value)
+    {
+    case '+':
+    case '-':
+        return 1;
+    case '*':
+    case '/':
+        return 2;
+    case '^':
+        return 3;
+    }
+    return 0;
+}
+
+/**
+ * @brief Consume the expected token
+ *
+ * @param c token cursor
+ * @param type expected type
+ * @param what name of the token in the error message
+ */
+static void expect(CompactCursor *c, Type type, const char *what)
+{
+    if (c->t[c->index].type != type)
+    {
+        fprintf(stderr, "[compactParser] Expected %s at token %d.\n", what, c->index);
+        exit(EXIT_FAILURE);
+    }
+    c->index++;
+}
+
+/**
+ * @brief States of the compactParser frames
+ *
+ * Same as the linearParser frames: a climb frame parses the operators
+ * binding at least as tight as its minPrec, a group frame the inside of
+ * brackets.
+ */
+enum climb_state
+{
+    CLIMB_START,   /* before the first operand */
+    CLIMB_SIGN,    /* waiting for the operand of the sign in t */
+    CLIMB_PRIMARY, /* waiting for a bracketed operand */
+    CLIMB_LOOP,    /* node holds the left operand */
+    CLIMB_RHS,     /* waiting for the right operand of the operator in t */
+    GROUP_BRACKET, /* waiting for (expr) */
+    GROUP_FUN1,    /* waiting for fun1(expr) */
+    GROUP_FUN2A,   /* waiting for the first operand of fun2 */
+    GROUP_FUN2B    /* node holds the first operand, waiting for the second */
+};
+
+static void pushClimb(CompactStack *s, int minPrec)
+{
+    pushCompact(s, COMPACT_NONE, CLIMB_START)->minPrec = minPrec;
+}
+
+/**
+ * @brief Start a climb frame: parse a sign or a primary
+ *
+ * Pattern: factor -> constant | variable | (expr) | fun1(expr) |
+ * fun2(expr, expr)
+ *
+ * @param s stack, the climb frame on top
+ * @param c token cursor
+ */
+static void startClimb(CompactStack *s, CompactCursor *c)
+{
+    CompactFrame *f = &s->frames[s->num - 1];
+    Token t = c->t[c->index];
+    if (t.type == operator && (t.value == '+' || t.value == '-'))
+    {
+        if (f->minPrec > 2)
+        {
+            fprintf(stderr, "[compactParser] Unexpected sign at token %d.\n", c->index);
+            exit(EXIT_FAILURE);
+        }
+        c->index++;
+        f->t = t;
+        f->state = CLIMB_SIGN;
+        pushClimb(s, 2);
+        return;
+    }
+    switch (t.type)
+    {
+    case digit:
+    case variable:
+        c->index++;
+        f->node = compactNode(c->tree, t, COMPACT_NONE, COMPACT_NONE);
+        f->state = CLIMB_LOOP;
+        return;
+    case left_bracket:
+        c->index++;
+        f->state = CLIMB_PRIMARY;
+        pushCompact(s, COMPACT_NONE, GROUP_BRACKET);
+        pushClimb(s, 1);
+        return;
+    case fun1:
+        c->index++;
+        expect(c, left_bracket, "'(' after function1");
+        f->state = CLIMB_PRIMARY;
+        pushCompact(s, COMPACT_NONE, GROUP_FUN1)->t = t;
+        pushClimb(s, 1);
+        return;
+    case fun2:
+        c->index++;
+        expect(c, left_bracket, "'(' after function2");
+        f->state = CLIMB_PRIMARY;
+        pushCompact(s, COMPACT_NONE, GROUP_FUN2A)->t = t;
+        pushClimb(s, 1);
+        return;
+    default:
+        break;
+    }
+    fprintf(stderr, "[compactParser] Can't parse factor at token %d.\n", c->index);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Give a parsed operand to the frame waiting for it
+ *
+ * @param s stack, the waiting frame on top
+ * @param c token cursor
+ * @param operand index of the parsed operand
+ * @return unsigned index of the result of the frame if it is done,
+ * COMPACT_NONE if not
+ */
+static unsigned takeOperand(CompactStack *s, CompactCursor *c, unsigned operand)
+{
+    CompactFrame *f = &s->frames[s->num - 1];
+    switch (f->state)
+    {
+    case CLIMB_SIGN:
+        f->node = op(c->tree, '*', constant(c->tree, f->t.value == '+' ? 1 : -1), operand);
+        f->state = CLIMB_LOOP;
+        return COMPACT_NONE;
+    case CLIMB_PRIMARY:
+        f->node = operand;
+        f->state = CLIMB_LOOP;
+        return COMPACT_NONE;
+    case CLIMB_RHS:
+        f->node = compactNode(c->tree, f->t, f->node, operand);
+        f->state = CLIMB_LOOP;
+        return COMPACT_NONE;
+    case GROUP_BRACKET:
+        expect(c, right_bracket, "')'");
+        return operand;
+    case GROUP_FUN1:
+        expect(c, right_bracket, "')' after function1");
+        return compactNode(c->tree, f->t, operand, COMPACT_NONE);
+    case GROUP_FUN2A:
+        expect(c, comma, "',' within function2");
+        f->node = operand;
+        f->state = GROUP_FUN2B;
+        pushClimb(s, 1);
+        return COMPACT_NONE;
+    default:
+        expect(c, right_bracket, "')' after function2");
+        return compactNode(c->tree, f->t, f->node, operand);
+    }
+}
+
+/**
+ * @brief Parse the token stream into the compact tree
+ *
+ * Same grammar and explicit stack as linearParser.
+ *
+ * @param t compact tree to append to
+ * @param tokens token stream ending with eof
+ * @param num number of tokens before eof
+ * @return unsigned index of the root
+ */
+unsigned compactParser(CompactTree *t, Token *tokens, int num)
+{
+    CompactCursor c = {tokens, 0, num, t};
+    CompactStack s;
+    initStack(&s);
+    pushClimb(&s, 1);
+    unsigned ret = COMPACT_NONE;
+    while (ret == COMPACT_NONE)
+    {
+        CompactFrame *f = &s.frames[s.num - 1];
+        if (f->state == CLIMB_START)
+        {
+            startClimb(&s, &c);
+            continue;
+        }
+        /* f->state == CLIMB_LOOP: parse operators binding at least as tight as minPrec */
+        int prec = precedence(c.t[c.index]);
+        if (prec >= f->minPrec && prec)
+        {
+            f->t = c.t[c.index++];
+            f->state = CLIMB_RHS;
+            pushClimb(&s, f->t.value == '^' ? prec : prec + 1);
+            continue;
+        }
+        /* the climb is done, hand its tree down until a frame is still waiting */
+        unsigned operand = f->node;
+        while (operand != COMPACT_NONE)
+        {
+            if (--s.num == 0)
+            {
+                ret = operand;
+                break;
+            }
+            operand = takeOperand(&s, &c, operand);
+        }
+    }
+    freeStack(&s);
+    if (c.index != c.num)
+    {
+        fprintf(stderr, "[compactParser] Unexpected token %d.\n", c.index);
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+/* Diff engine */
+
+/**
+ * @brief Differentiate one node
+ *
+ * @param t compact tree
+ * @param n index of the node
+ * @param grad derivatives of the nodes before n
+ * @param thisVar variable to be differentiated
+ * @return unsigned index of the derivative
+ */
+static unsigned gradRule(CompactTree *t, unsigned n, const unsigned *grad, int thisVar)
+{
+    int value = t->value[n];
+    unsigned a = t->a[n], b = t->b[n];
+    unsigned ga = a != COMPACT_NONE ? grad[a] : COMPACT_NONE;
+    unsigned gb = b != COMPACT_NONE ? grad[b] : COMPACT_NONE;
+
+    switch (t->type[n])
+    {
+    case variable:
+        return constant(t, value == thisVar);
+    case digit:
+        return constant(t, 0);
+    case operator:
+        switch (value)
+        {
+        case '+':
+            return op(t, '+', ga, gb);
+        case '-':
+            return op(t, '-', ga, gb);
+        case '*':
+            return op(t, '+', op(t, '*', ga, b), op(t, '*', a, gb));
+        case '/':
+            return op(t, '/', op(t, '-', op(t, '*', ga, b), op(t, '*', a, gb)),
+                      op(t, '^', b, constant(t, 2)));
+        case '^':
+            return op(t, '*', n,
+                      op(t, '+', op(t, '*', ga, op(t, '/', b, a)),
+                         op(t, '*', gb, fun(t, 0, a))));
+        }
+        break;
+    case fun1:
+        switch (value)
+        {
+        case 0: /* ln */
+            return op(t, '*', ga, op(t, '/', constant(t, 1), a));
+        case 1: /* cos */
+            return op(t, '*', constant(t, -1), op(t, '*', ga, fun(t, 2, a)));
+        case 2: /* sin */
+            return op(t, '*', ga, fun(t, 1, a));
+        case 3: /* tan */
+            return op(t, '/', ga, op(t, '^', fun(t, 1, a), constant(t, 2)));
+        case 4: /* exp */
+            return op(t, '*', ga, fun(t, 4, a));
+        }
+        break;
+    case fun2:
+        switch (value)
+        {
+        case 0: /* log */
+            return op(t, '/',
+                      op(t, '-', op(t, '*', gb, op(t, '/', fun(t, 0, a), b)),
+                         op(t, '*', ga, op(t, '/', fun(t, 0, b), a))),
+                      op(t, '^', fun(t, 0, a), constant(t, 2)));
+        case 1: /* pow */
+            return op(t, '*', n,
+                      op(t, '+', op(t, '*', ga, op(t, '/', b, a)),
+                         op(t, '*', gb, fun(t, 0, a))));
+        }
+        break;
+    default:
+        break;
+    }
+    fprintf(stderr, "[compactGrad] Invalid node.\n");
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Automatic differentiation on the compact tree
+ *
+ * Same rules as autoGrad. The derivative is appended to the tree, and
+ * operands are referred to instead of copied.
+ *
+ * Children come before their parents, so the nodes of the subtree are
+ * differentiated in index order, each once, without recursion.
+ *
+ * @param t compact tree
+ * @param n index of the root
+ * @param thisVar variable to be differentiated
+ * @return unsigned index of the derivative
+ */
+unsigned compactGrad(CompactTree *t, unsigned n, int thisVar)
+{
+    if (n == COMPACT_NONE)
+    {
+        fprintf(stderr, "[compactGrad] null tree.\n");
+        exit(EXIT_FAILURE);
+    }
+    unsigned char *marked = markSubtree(t, n);
+    unsigned *grad = (unsigned *)malloc(sizeof(unsigned) * ((size_t)n + 1));
+    if (!grad)
+    {
+        fprintf(stderr, "[compactGrad] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i <= n; i++)
+    {
+        if (marked[i])
+            grad[i] = gradRule(t, i, grad, thisVar);
+    }
+    unsigned ret = grad[n];
+    free(grad);
+    free(marked);
+    return ret;
+}
+
+/* Optimizer */
+
+/**
+ * @brief Optimize one node
+ *
+ * @param t compact tree
+ * @param n index of the node, not a leaf
+ * @param a index of the optimized left child
+ * @param b index of the optimized right child
+ * @return unsigned index of the optimized node
+ */
+static unsigned optimizeRule(CompactTree *t, unsigned n, unsigned a, unsigned b)
+{
+    Token token = {(Type)t->type[n], t->value[n]};
+    switch (token.type)
+    {
+    case operator:
+        switch (token.value)
+        {
+        case '+':
+            if (t->type[a] == digit && t->type[b] == digit)
+                return constant(t, t->value[a] + t->value[b]);
+            /* 0+f(x) = f(x), f(x)+0 = f(x) */
+            if (isDigit(t, a, 0))
+                return b;
+            if (isDigit(t, b, 0))
+                return a;
+            return compactNode(t, token, a, b);
+        case '-':
+            if (t->type[a] == digit && t->type[b] == digit)
+                return constant(t, t->value[a] - t->value[b]);
+            /* 0-f(x) = -f(x), f(x)-0 = f(x) */
+            if (isDigit(t, a, 0))
+                return op(t, '*', constant(t, -1), b);
+            if (isDigit(t, b, 0))
+                return a;
+            return compactNode(t, token, a, b);
+        case '*':
+            if (t->type[a] == digit && t->type[b] == digit)
+                return constant(t, t->value[a] * t->value[b]);
+            /* 0*f(x) = 0, 1*f(x) = f(x) */
+            if (isDigit(t, a, 0) || isDigit(t, b, 0))
+                return constant(t, 0);
+            if (isDigit(t, a, 1))
+                return b;
+            if (isDigit(t, b, 1))
+                return a;
+            return compactNode(t, token, a, b);
+        case '/':
+            if (t->type[a] == digit && t->type[b] == digit)
+            {
+                if (t->value[b] && t->value[a] % t->value[b] == 0)
+                    return constant(t, t->value[a] / t->value[b]);
+                return compactNode(t, token, a, b);
+            }
+            /* 0/f(x) = 0, f(x)/1 = f(x), f(x)/f(x) = 1 */
+            if (isDigit(t, a, 0))
+                return constant(t, 0);
+            if (isDigit(t, b, 1))
+                return a;
+            if (compareCompact(t, a, b))
+                return constant(t, 1);
+            return compactNode(t, token, a, b);
+        case '^':
+            if (t->type[a] == digit && t->type[b] == digit)
+                return constant(t, (int)pow(t->value[a], t->value[b]));
+            /* 0^f(x) = 0, f(x)^0 = 1, 1^f(x) = 1, f(x)^1 = f(x) */
+            if (isDigit(t, a, 0))
+                return constant(t, 0);
+            if (isDigit(t, b, 0) || isDigit(t, a, 1))
+                return constant(t, 1);
+            if (isDigit(t, b, 1))
+                return a;
+            return compactNode(t, token, a, b);
+        }
+        break;
+    case fun1:
+        switch (token.value)
+        {
+        case 0: /* ln(1) = 0 */
+            if (isDigit(t, a, 1))
+                return constant(t, 0);
+            return compactNode(t, token, a, COMPACT_NONE);
+        case 1: /* cos(0) = 1 */
+        case 4: /* exp(0) = 1 */
+            if (isDigit(t, a, 0))
+                return constant(t, 1);
+            return compactNode(t, token, a, COMPACT_NONE);
+        case 2: /* sin(0) = 0 */
+        case 3: /* tan(0) = 0 */
+            if (isDigit(t, a, 0))
+                return constant(t, 0);
+            return compactNode(t, token, a, COMPACT_NONE);
+        }
+        break;
+    case fun2:
+        switch (token.value)
+        {
+        case 0: /* log(f(x), f(x)) = 1, log(f(x), 1) = 0 */
+            if (compareCompact(t, a, b))
+                return constant(t, 1);
+            if (isDigit(t, b, 1))
+                return constant(t, 0);
+            return compactNode(t, token, a, b);
+        case 1: /* pow, as operator ^ */
+            if (t->type[a] == digit && t->type[b] == digit)
+                return constant(t, (int)pow(t->value[a], t->value[b]));
+            if (isDigit(t, a, 0))
+                return constant(t, 0);
+            if (isDigit(t, b, 0) || isDigit(t, a, 1))
+                return constant(t, 1);
+            if (isDigit(t, b, 1))
+                return a;
+            return op(t, '^', a, b);
+        }
+        break;
+    default:
+        break;
+    }
+    fprintf(stderr, "[compactOptimizer] Program error.\n");
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Constant optimizer on the compact tree
+ *
+ * Same rules as constantOptimizer. The optimized tree is appended to the
+ * tree, and unchanged subtrees are referred to instead of copied.
+ *
+ * Like compactGrad, the nodes of the subtree are optimized in index order,
+ * each once, without recursion.
+ *
+ * @param t compact tree
+ * @param n index of the root
+ * @return unsigned index of the optimized tree
+ */
+unsigned compactOptimizer(CompactTree *t, unsigned n)
+{
+    if (n == COMPACT_NONE)
+        return COMPACT_NONE;
+    if (t->a[n] == COMPACT_NONE)
+        return n;
+    unsigned char *marked = markSubtree(t, n);
+    unsigned *optimized = (unsigned *)malloc(sizeof(unsigned) * ((size_t)n + 1));
+    if (!optimized)
+    {
+        fprintf(stderr, "[compactOptimizer] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i <= n; i++)
+    {
+        if (!marked[i])
+            continue;
+        unsigned a = t->a[i], b = t->b[i];
+        if (a == COMPACT_NONE)
+            optimized[i] = i;
+        else
+            optimized[i] = optimizeRule(t, i, optimized[a],
+                                        b != COMPACT_NONE ? optimized[b] : COMPACT_NONE);
+    }
+    unsigned ret = optimized[n];
+    free(optimized);
+    free(marked);
+    return ret;
+}
+
+/* Tree */
+
+/**
+ * @brief Compare two subtrees of the compact tree
+ *
+ * Same as compareTree: operator + * is commutative. Subtrees with different
+ * structural hashes are different, so most unequal subtrees are told apart
+ * at once. Otherwise the pairs of children left to compare are kept on an
+ * explicit stack; for + and *, only the order of the children whose hashes
+ * match is compared, so this takes linear time.
+ *
+ * @param t compact tree
+ * @param a index of the first subtree
+ * @param b index of the second subtree
+ * @return int 1 if equal, 0 if not
+ */
+int compareCompact(const CompactTree *t, unsigned a, unsigned b)
+{
+    CompactStack s;
+    initStack(&s);
+    pushCompact(&s, a, 0)->other = b;
+    int ret = 1;
+    while (s.num && ret)
+    {
+        s.num--;
+        unsigned x = s.frames[s.num].node, y = s.frames[s.num].other;
+        if (x == y)
+            continue;
+        if (x == COMPACT_NONE || y == COMPACT_NONE || t->hash[x] != t->hash[y] ||
+            t->type[x] != t->type[y] || t->value[x] != t->value[y])
+        {
+            ret = 0;
+            break;
+        }
+        unsigned xa = t->a[x], xb = t->b[x], ya = t->a[y], yb = t->b[y];
+        /* operator + * commutative */
+        if (t->type[x] == operator && (t->value[x] == '+' || t->value[x] == '*') &&
+            t->hash[xa] != t->hash[ya])
+        {
+            unsigned swap = ya;
+            ya = yb;
+            yb = swap;
+        }
+        pushCompact(&s, xa, 0)->other = ya;
+        pushCompact(&s, xb, 0)->other = yb;
+    }
+    freeStack(&s);
+    return ret;
+}
+
+/**
+ * @brief Check if the node is one of the operators
+ *
+ * @param t compact tree
+ * @param n index of the node
+ * @param level 1 for + -, 2 for + - * /, 3 for + - * / ^
+ * @return int 1 if it is, 0 if not
+ */
+static int needBracket(const CompactTree *t, unsigned n, int level)
+{
+    return t->type[n] == operator && precedence((Token){operator, t->value[n]}) <= level;
+}
+
+/**
+ * @brief Print the compact tree
+ *
+ * Same output as printTree. The nodes are printed on an explicit stack.
+ *
+ * @param t compact tree
+ * @param n index of the root
+ * @param v variable list
+ */
+void printCompact(const CompactTree *t, unsigned n, const VariableList *v)
+{
+    if (n == COMPACT_NONE)
+    {
+        printf("Empty tree.\n");
+        return;
+    }
+    CompactStack s;
+    initStack(&s);
+    pushCompact(&s, n, 0);
+    while (s.num)
+    {
+        CompactFrame *f = &s.frames[s.num - 1];
+        unsigned m = f->node, a = t->a[m], b = t->b[m];
+        int value = t->value[m];
+        int state = f->state++;
+        switch (t->type[m])
+        {
+        case variable:
+            printf("%s", v->s[value]);
+            s.num--;
+            break;
+        case fun1:
+            if (state == 0)
+            {
+                printf("%s(", fun1s[value]);
+                pushCompact(&s, a, 0);
+                break;
+            }
+            putchar(')');
+            s.num--;
+            break;
+        case fun2:
+            if (state == 0)
+            {
+                printf("%s(", fun2s[value]);
+                pushCompact(&s, a, 0);
+                break;
+            }
+            if (state == 1)
+            {
+                putchar(',');
+                pushCompact(&s, b, 0);
+                break;
+            }
+            putchar(')');
+            s.num--;
+            break;
+        case digit:
+            value > 0 ? printf("%d", value) : printf("(%d)", value);
+            s.num--;
+            break;
+        case operator:
+            if (state == 0)
+            {
+                /* brackets for children of lower or equal priority, except on the
+                   left of + - and on the right of + */
+                int level = value == '+' || value == '-' ? 0 : precedence((Token){operator, value});
+                int left = needBracket(t, a, level);
+                int right = level ? needBracket(t, b, level)
+                                  : t->type[b] == operator && t->value[b] == '-';
+                f->brackets = left | right << 1;
+                if (left)
+                    putchar('(');
+                pushCompact(&s, a, 0);
+                break;
+            }
+            if (state == 1)
+            {
+                if (f->brackets & 1)
+                    putchar(')');
+                putchar(value);
+                if (f->brackets & 2)
+                    putchar('(');
+                pushCompact(&s, b, 0);
+                break;
+            }
+            if (f->brackets & 2)
+                putchar(')');
+            s.num--;
+            break;
+        default:
+            fprintf(stderr, "[printCompact] Invalid token type appeared in tree.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    freeStack(&s);
+}
+
+/**
+ * @brief Frame of compactTree
+ *
+ * a and b hold the indices of the children appended, state counts the
+ * children visited.
+ */
+typedef struct node_frame NodeFrame;
+struct node_frame
+{
+    const Node *node;
+    unsigned a, b;
+    int state;
+};
+
+/**
+ * @brief Append a copy of a node tree to the compact tree
+ *
+ * The nodes are appended children first on an explicit stack, in the order
+ * of the recursive definition, so deep trees don't overflow the call stack.
+ * Shared subtrees of a DAG are copied once for each parent.
+ *
+ * @param t compact tree
+ * @param n root of the node tree
+ * @return unsigned index of the root
+ */
+unsigned compactTree(CompactTree *t, const Node *n)
+{
+    if (!n)
+        return COMPACT_NONE;
+    int num = 0, size = 64;
+    NodeFrame *frames = (NodeFrame *)malloc(sizeof(NodeFrame) * size);
+    if (!frames)
+    {
+        fprintf(stderr, "[compactTree] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    frames[num++] = (NodeFrame){n, COMPACT_NONE, COMPACT_NONE, 0};
+    for (;;)
+    {
+        NodeFrame *f = &frames[num - 1];
+        unsigned index = COMPACT_NONE;
+        if (f->state < 2)
+        {
+            const Node *child = f->state ? f->node->b : f->node->a;
+            if (child)
+            {
+                if (num == size)
+                {
+                    size *= 2;
+                    frames = (NodeFrame *)realloc(frames, sizeof(NodeFrame) * size);
+                    if (!frames)
+                    {
+                        fprintf(stderr, "[compactTree] malloc failed.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                frames[num++] = (NodeFrame){child, COMPACT_NONE, COMPACT_NONE, 0};
+                continue;
+            }
+        }
+        else
+        {
+            index = compactNode(t, f->node->token, f->a, f->b);
+            if (--num == 0)
+                break;
+            f = &frames[num - 1];
+        }
+        /* hand the index to the parent */
+        if (f->state++)
+            f->b = index;
+        else
+            f->a = index;
+    }
+    free(frames);
+    return t->num - 1;
+}
+
+/**
+ * @brief Child of a node built by expandTree
+ *
+ * @param nodes node built for each index
+ * @param used 1 for each index already given to a parent
+ * @param copy 1 to copy a node given to a parent before
+ * @param c index of the child
+ * @return Node* child, NULL for COMPACT_NONE
+ */
+static Node *expandChild(Node **nodes, unsigned char *used, int copy, unsigned c)
+{
+    if (c == COMPACT_NONE)
+        return NULL;
+    if (copy && used[c])
+        return copyTree(nodes[c]);
+    used[c] = 1;
+    return nodes[c];
+}
+
+/**
+ * @brief Build a node tree from the compact tree
+ *
+ * Children come before their parents, so the nodes of the subtree are built
+ * in one forward pass over the indices. The nodes are created by createNode,
+ * so they follow the node store or arena in use. Without either, a node
+ * shared by several parents is copied for each further parent, so the
+ * result is a tree which freeTree can free.
+ *
+ * @param t compact tree
+ * @param n index of the root
+ * @return Node* root of the node tree
+ */
+Node *expandTree(const CompactTree *t, unsigned n)
+{
+    if (n == COMPACT_NONE)
+        return NULL;
+    unsigned char *mark = markSubtree(t, n);
+    unsigned char *used = (unsigned char *)calloc((size_t)n + 1, 1);
+    Node **nodes = (Node **)malloc(sizeof(Node *) * ((size_t)n + 1));
+    if (!used || !nodes)
+    {
+        fprintf(stderr, "[expandTree] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    int copy = !currentNodeStore() && !currentNodeArena();
+    for (unsigned i = 0; i <= n; i++)
+    {
+        if (!mark[i])
+            continue;
+        Node *a = expandChild(nodes, used, copy, t->a[i]);
+        Node *b = expandChild(nodes, used, copy, t->b[i]);
+        nodes[i] = createNode((Token){(Type)t->type[i], t->value[i]}, a, b);
+    }
+    Node *ret = nodes[n];
+    free(nodes);
+    free(used);
+    free(mark);
+    return ret;
+}
+
+/**
+ * @brief Free the compact tree
+ *
+ * @param t tree to be freed
+ */
+void freeCompactTree(CompactTree *t)
+{
+    free(t->type);
+    free(t->value);
+    free(t->a);
+    free(t->b);
+    free(t->hash);
+    free(t);
+}
@@ -0,0 +1,63 @@
+/**
+ * @file compact.h
+ * @brief Index-based expression trees.
+ *
+ * A Node holds its token and two 64-bit child pointers, and the nodes of a
+ * tree are scattered over the heap. A compact tree keeps all its nodes in
+ * parallel arrays instead (struct of arrays), and refers to children by 32-bit
+ * index, so a node takes 17 bytes with its structural hash, and traversals
+ * walk contiguous memory.
+ *
+ * Nodes are only appended, and the children of a node always come before it.
+ * A node never changes once appended, so derivatives and optimized trees are
+ * appended to the same arrays and simply refer to the nodes they share with
+ * the original tree instead of copying them.
+ */
+#ifndef _COMPACT_H_
+#define _COMPACT_H_
+
+#include "expression.h"
+
+/**
+ * @brief Index of a missing child.
+ */
+#define COMPACT_NONE 0xffffffffu
+
+/**
+ * @brief Compact tree type.
+ *
+ * Node i has token (type[i], value[i]), children a[i] and b[i], and the
+ * structural hash hash[i] of its subtree (see combineHash).
+ */
+typedef struct compact_tree CompactTree;
+struct compact_tree
+{
+    unsigned char *type;
+    int *value;
+    unsigned *a, *b;
+    unsigned *hash;
+    unsigned num, size;
+};
+
+/**
+ * @defgroup compact Compact tree functions
+ *
+ * The compact tree functions mirror the node functions, the parser, autoGrad
+ * and constantOptimizer, and give the same results. Nodes are referred to by
+ * their index in the compact tree.
+ *
+ * @{
+ */
+CompactTree *createCompactTree(unsigned size);
+unsigned compactNode(CompactTree *t, Token token, unsigned a, unsigned b);
+unsigned compactParser(CompactTree *t, Token *tokens, int num);
+unsigned compactGrad(CompactTree *t, unsigned n, int thisVar);
+unsigned compactOptimizer(CompactTree *t, unsigned n);
+int compareCompact(const CompactTree *t, unsigned a, unsigned b);
+void printCompact(const CompactTree *t, unsigned n, const VariableList *v);
+unsigned compactTree(CompactTree *t, const Node *n);
+Node *expandTree(const CompactTree *t, unsigned n);
+void freeCompactTree(CompactTree *t);
+/** @} */
+
+#endif
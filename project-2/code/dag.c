@@ -0,0 +1,402 @@
+#include "dag.h"
+#include "metrics.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @brief Node store in use by the current thread.
+ */
+static _Thread_local NodeStore *activeStore = NULL;
+
+/**
+ * @brief Create a Node Store object
+ *
+ * The store will be dynamically allocated, so it must be freed by
+ * freeNodeStore after use.
+ *
+ * @return NodeStore* created store
+ */
+NodeStore *createNodeStore(void)
+{
+    NodeStore *ret = (NodeStore *)malloc(sizeof(NodeStore));
+    if (!ret)
+    {
+        fprintf(stderr, "[createNodeStore] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    ret->nodeBuckets = 1024;
+    ret->numNodes = 0;
+    ret->nodes = (StoreEntry **)calloc(ret->nodeBuckets, sizeof(StoreEntry *));
+    ret->gradBuckets = 1024;
+    ret->numGrads = 0;
+    ret->grads = (GradEntry **)calloc(ret->gradBuckets, sizeof(GradEntry *));
+    ret->blocks = NULL;
+    if (!ret->nodes || !ret->grads)
+    {
+        fprintf(stderr, "[createNodeStore] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+/**
+ * @brief Use the store for the node functions of the current thread
+ *
+ * @param store store to be used, NULL to go back to individually allocated
+ * nodes
+ * @return NodeStore* the store used before
+ */
+NodeStore *useNodeStore(NodeStore *store)
+{
+    NodeStore *prev = activeStore;
+    activeStore = store;
+    return prev;
+}
+
+/**
+ * @brief Get the store in use by the current thread
+ *
+ * @return NodeStore* store in use, NULL if none
+ */
+NodeStore *currentNodeStore(void)
+{
+    return activeStore;
+}
+
+/**
+ * @brief Allocate memory from the blocks of the store
+ *
+ * Entries are never freed one by one, so they are simply carved from large
+ * blocks, which are freed together with the store.
+ *
+ * @param store store to allocate from
+ * @param size size of the memory
+ * @return void* allocated memory
+ */
+static void *storeAlloc(NodeStore *store, size_t size)
+{
+    /* keep pointers aligned */
+    size = (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+    StoreBlock *block = store->blocks;
+    if (!block || block->used + size > block->size)
+    {
+        size_t blockSize = block ? block->size * 2 : 64 * 1024;
+        while (blockSize < size)
+            blockSize *= 2;
+        block = (StoreBlock *)malloc(sizeof(StoreBlock) + blockSize);
+        if (!block)
+        {
+            fprintf(stderr, "[storeAlloc] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        block->next = store->blocks;
+        block->used = 0;
+        block->size = blockSize;
+        store->blocks = block;
+    }
+    void *ret = (char *)(block + 1) + block->used;
+    block->used += size;
+    return ret;
+}
+
+/**
+ * @brief Hash a pointer
+ *
+ * @param p pointer
+ * @return unsigned hash value
+ */
+static unsigned hashPointer(const void *p)
+{
+    uint64_t x = (uint64_t)(uintptr_t)p;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (unsigned)x;
+}
+
+/**
+ * @brief Hash a node by its token and the identity of its children
+ *
+ * Children of a node in the store are already unique, so comparing their
+ * addresses is enough to compare the subtrees.
+ *
+ * @param t token
+ * @param a left child
+ * @param b right child
+ * @return unsigned hash value
+ */
+static unsigned hashNode(Token t, const Node *a, const Node *b)
+{
+    unsigned h = (unsigned)t.type * 0x9e3779b9u ^ (unsigned)t.value;
+    h = h * 31 + hashPointer(a);
+    h = h * 31 + hashPointer(b);
+    return h;
+}
+
+/**
+ * @brief Double the number of buckets of the node table
+ *
+ * @param store store to be expanded
+ */
+static void expandNodes(NodeStore *store)
+{
+    int size = store->nodeBuckets * 2;
+    StoreEntry **nodes = (StoreEntry **)calloc(size, sizeof(StoreEntry *));
+    if (!nodes)
+    {
+        fprintf(stderr, "[expandNodes] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < store->nodeBuckets; i++)
+    {
+        StoreEntry *e = store->nodes[i];
+        while (e)
+        {
+            StoreEntry *next = e->next;
+            e->next = nodes[e->hash % size];
+            nodes[e->hash % size] = e;
+            e = next;
+        }
+    }
+    free(store->nodes);
+    store->nodes = nodes;
+    store->nodeBuckets = size;
+}
+
+/**
+ * @brief Get the unique node of the store for (t, a, b)
+ *
+ * The node is created if it doesn't exist yet. a and b must be nodes of the
+ * store (or NULL).
+ *
+ * @param store node store
+ * @param t token of the node
+ * @param a left child
+ * @param b right child
+ * @return Node* unique node
+ */
+Node *internNode(NodeStore *store, Token t, Node *a, Node *b)
+{
+    unsigned h = hashNode(t, a, b);
+    for (StoreEntry *e = store->nodes[h % store->nodeBuckets]; e; e = e->next)
+    {
+        if (e->hash == h && e->node.token.type == t.type &&
+            e->node.token.value == t.value && e->node.a == a && e->node.b == b)
+            return &e->node;
+    }
+    if (store->numNodes >= store->nodeBuckets)
+        expandNodes(store);
+    StoreEntry *e = (StoreEntry *)storeAlloc(store, sizeof(StoreEntry));
+    e->node.token = t;
+    e->node.a = a;
+    e->node.b = b;
+    e->node.hash = structuralHash(t, a, b);
+    e->hash = h;
+    e->optimized = NULL;
+    e->collected = NULL;
+    e->canonical = NULL;
+    e->next = store->nodes[h % store->nodeBuckets];
+    store->nodes[h % store->nodeBuckets] = e;
+    store->numNodes++;
+    METRICS_CREATED(1, sizeof(StoreEntry));
+    return &e->node;
+}
+
+/**
+ * @brief Check if the node belongs to the store
+ *
+ * @param store node store
+ * @param n node to be checked
+ * @return int 1 if n is a node of the store, 0 if not
+ */
+int isInterned(const NodeStore *store, const Node *n)
+{
+    if (!n)
+        return 0;
+    unsigned h = hashNode(n->token, n->a, n->b);
+    for (StoreEntry *e = store->nodes[h % store->nodeBuckets]; e; e = e->next)
+    {
+        if (&e->node == n)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the memoized derivative of a node
+ *
+ * @param store node store
+ * @param n node of the store
+ * @param var variable
+ * @return Node* derivative, NULL if not computed yet
+ */
+Node *storedGrad(const NodeStore *store, const Node *n, int var)
+{
+    unsigned h = hashPointer(n) ^ (unsigned)var * 0x9e3779b9u;
+    for (GradEntry *e = store->grads[h % store->gradBuckets]; e; e = e->next)
+    {
+        if (e->node == n && e->var == var)
+            return e->grad;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Memoize the derivative of a node
+ *
+ * @param store node store
+ * @param n node of the store
+ * @param var variable
+ * @param grad derivative of n with respect to var
+ */
+void storeGrad(NodeStore *store, const Node *n, int var, Node *grad)
+{
+    if (store->numGrads >= store->gradBuckets)
+    {
+        int size = store->gradBuckets * 2;
+        GradEntry **grads = (GradEntry **)calloc(size, sizeof(GradEntry *));
+        if (!grads)
+        {
+            fprintf(stderr, "[storeGrad] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < store->gradBuckets; i++)
+        {
+            GradEntry *e = store->grads[i];
+            while (e)
+            {
+                GradEntry *next = e->next;
+                unsigned h = hashPointer(e->node) ^ (unsigned)e->var * 0x9e3779b9u;
+                e->next = grads[h % size];
+                grads[h % size] = e;
+                e = next;
+            }
+        }
+        free(store->grads);
+        store->grads = grads;
+        store->gradBuckets = size;
+    }
+    unsigned h = hashPointer(n) ^ (unsigned)var * 0x9e3779b9u;
+    GradEntry *e = (GradEntry *)storeAlloc(store, sizeof(GradEntry));
+    e->node = n;
+    e->var = var;
+    e->grad = grad;
+    e->next = store->grads[h % store->gradBuckets];
+    store->grads[h % store->gradBuckets] = e;
+    store->numGrads++;
+}
+
+/**
+ * @brief Get the memoized constantOptimizer result of a node
+ *
+ * @param store node store
+ * @param n node of the store
+ * @return Node* optimized node, NULL if not computed yet
+ */
+Node *storedOptimized(const NodeStore *store, const Node *n)
+{
+    (void)store;
+    return ((const StoreEntry *)n)->optimized;
+}
+
+/**
+ * @brief Memoize the constantOptimizer result of a node
+ *
+ * @param store node store
+ * @param n node of the store
+ * @param optimized optimized node
+ */
+void storeOptimized(NodeStore *store, const Node *n, Node *optimized)
+{
+    (void)store;
+    ((StoreEntry *)n)->optimized = optimized;
+}
+
+/**
+ * @brief Get the memoized collectOptimizer result of a node
+ *
+ * @param store node store
+ * @param n node of the store
+ * @return Node* collected node, NULL if not computed yet
+ */
+Node *storedCollected(const NodeStore *store, const Node *n)
+{
+    (void)store;
+    return ((const StoreEntry *)n)->collected;
+}
+
+/**
+ * @brief Memoize the collectOptimizer result of a node
+ *
+ * @param store node store
+ * @param n node of the store
+ * @param collected collected node
+ */
+void storeCollected(NodeStore *store, const Node *n, Node *collected)
+{
+    (void)store;
+    ((StoreEntry *)n)->collected = collected;
+}
+
+/**
+ * @brief Get the memoized canonicalTree result of a node
+ *
+ * @param store node store
+ * @param n node of the store
+ * @return Node* canonical node, NULL if not computed yet
+ */
+Node *storedCanonical(const NodeStore *store, const Node *n)
+{
+    (void)store;
+    return ((const StoreEntry *)n)->canonical;
+}
+
+/**
+ * @brief Memoize the canonicalTree result of a node
+ *
+ * @param store node store
+ * @param n node of the store
+ * @param canonical canonical node
+ */
+void storeCanonical(NodeStore *store, const Node *n, Node *canonical)
+{
+    (void)store;
+    ((StoreEntry *)n)->canonical = canonical;
+}
+
+/**
+ * @brief Count the distinct nodes of the store
+ *
+ * @param store node store
+ * @return int number of nodes
+ */
+int countNodes(const NodeStore *store)
+{
+    return store->numNodes;
+}
+
+/**
+ * @brief Free the node store
+ *
+ * All the nodes of the store are freed at once. If the store is in use by
+ * the current thread, it is not any more.
+ *
+ * @param store store to be freed
+ */
+void freeNodeStore(NodeStore *store)
+{
+    if (activeStore == store)
+        activeStore = NULL;
+    METRICS_FREED(store->numNodes, store->numNodes * sizeof(StoreEntry));
+    StoreBlock *block = store->blocks;
+    while (block)
+    {
+        StoreBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(store->nodes);
+    free(store->grads);
+    free(store);
+}
@@ -0,0 +1,108 @@
+/**
+ * @file dag.h
+ * @brief Hash-consed node store.
+ *
+ * Expression trees built by the functions in expression.h may contain many
+ * structurally identical subtrees, especially after autoGrad, which copies the
+ * operands of every product, quotient and power. A node store keeps exactly
+ * one node for each distinct (token, a, b), so identical subtrees are shared
+ * and the tree becomes a DAG.
+ */
+#ifndef _DAG_H_
+#define _DAG_H_
+
+#include "expression.h"
+#include <stddef.h>
+
+/**
+ * @brief Entry of the node store.
+ *
+ * The node must stay the first member, so a Node * of the store can be cast
+ * back to its entry.
+ */
+typedef struct store_entry StoreEntry;
+struct store_entry
+{
+    Node node;
+    unsigned hash;
+    StoreEntry *next;
+    Node *optimized; /* memoized constantOptimizer result, NULL if unknown */
+    Node *collected; /* memoized collectOptimizer result, NULL if unknown */
+    Node *canonical; /* memoized canonicalTree result, NULL if unknown */
+};
+
+/**
+ * @brief Memoized autoGrad result of one node for one variable.
+ */
+typedef struct grad_entry GradEntry;
+struct grad_entry
+{
+    const Node *node;
+    int var;
+    Node *grad;
+    GradEntry *next;
+};
+
+/**
+ * @brief Block of memory the store allocates its entries from.
+ */
+typedef struct store_block StoreBlock;
+struct store_block
+{
+    StoreBlock *next;
+    size_t used, size;
+    /* entries follow */
+};
+
+/**
+ * @brief Node store type.
+ *
+ * Two hash tables with separate chaining: one interns the nodes, the other
+ * memoizes autoGrad results per (node, variable). All the memory is released
+ * at once by freeNodeStore.
+ */
+typedef struct node_store NodeStore;
+struct node_store
+{
+    StoreEntry **nodes;
+    int nodeBuckets, numNodes;
+    GradEntry **grads;
+    int gradBuckets, numGrads;
+    StoreBlock *blocks;
+};
+
+/**
+ * @defgroup dag Node store functions
+ *
+ * While a store is in use by the current thread (see useNodeStore), the node
+ * functions in expression.h work on it:
+ *
+ * - createNode returns the unique node of the store for (token, a, b);
+ * - copyTree returns nodes of the store unchanged, and interns other trees;
+ * - freeTree does nothing for nodes of the store;
+ * - compareTree returns at once for identical nodes;
+ * - autoGrad, constantOptimizer, collectOptimizer and canonicalTree memoize
+ *   their result per node.
+ *
+ * Trees built this way must not be used after the store is freed.
+ *
+ * @{
+ */
+NodeStore *createNodeStore(void);
+NodeStore *useNodeStore(NodeStore *store);
+NodeStore *currentNodeStore(void);
+Node *internNode(NodeStore *store, Token t, Node *a, Node *b);
+int isInterned(const NodeStore *store, const Node *n);
+Node *storedGrad(const NodeStore *store, const Node *n, int var);
+void storeGrad(NodeStore *store, const Node *n, int var, Node *grad);
+Node *storedOptimized(const NodeStore *store, const Node *n);
+void storeOptimized(NodeStore *store, const Node *n, Node *optimized);
+Node *storedCollected(const NodeStore *store, const Node *n);
+void storeCollected(NodeStore *store, const Node *n, Node *collected);
+Node *storedCanonical(const NodeStore *store, const Node *n);
+void storeCanonical(NodeStore *store, const Node *n, Node *canonical);
+int countNodes(const NodeStore *store);
+void freeNodeStore(NodeStore *store);
+/** @} */
+
+#endif
@@ -0,0 +1,279 @@
+#include "dual.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Create an evaluator
+ *
+ * @param numVars number of variables of the gradients
+ * @return DualEvaluator* new evaluator
+ */
+DualEvaluator *createDualEvaluator(int numVars)
+{
+    DualEvaluator *ret = (DualEvaluator *)malloc(sizeof(DualEvaluator));
+    if (!ret)
+    {
+        fprintf(stderr, "[createDualEvaluator] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    ret->numVars = numVars;
+    ret->numFrames = 0;
+    ret->frameSize = 64;
+    ret->valueSize = 64;
+    ret->nodes = (const Node **)malloc(sizeof(Node *) * ret->frameSize);
+    ret->states = (int *)malloc(sizeof(int) * ret->frameSize);
+    ret->values = (double *)malloc(sizeof(double) * ret->valueSize * (2 + numVars));
+    if (!ret->nodes || !ret->states || !ret->values)
+    {
+        fprintf(stderr, "[createDualEvaluator] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+static void pushFrame(DualEvaluator *e, const Node *n)
+{
+    if (e->numFrames == e->frameSize)
+    {
+        e->frameSize *= 2;
+        e->nodes = (const Node **)realloc(e->nodes, sizeof(Node *) * e->frameSize);
+        e->states = (int *)realloc(e->states, sizeof(int) * e->frameSize);
+        if (!e->nodes || !e->states)
+        {
+            fprintf(stderr, "[dualGradient] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    e->nodes[e->numFrames] = n;
+    e->states[e->numFrames++] = 0;
+}
+
+/**
+ * @brief Push the dual number of a leaf
+ *
+ * @param e evaluator
+ * @param n leaf
+ * @param vars value of each variable
+ * @param var variable of the tangent, -1 for one tangent per variable
+ * @param width number of tangents
+ * @param top number of dual numbers on the stack
+ */
+static void pushLeaf(DualEvaluator *e, const Node *n, const double *vars, int var, int width,
+                     int *top)
+{
+    if (*top == e->valueSize)
+    {
+        e->valueSize *= 2;
+        e->values = (double *)realloc(e->values, sizeof(double) * e->valueSize * (2 + e->numVars));
+        if (!e->values)
+        {
+            fprintf(stderr, "[dualGradient] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    double *r = e->values + (size_t)(*top)++ * (1 + width);
+    memset(r + 1, 0, sizeof(double) * width);
+    if (n->token.type == digit)
+    {
+        r[0] = n->token.value;
+        return;
+    }
+    if (n->token.type != variable)
+    {
+        fprintf(stderr, "[dualGradient] Invalid node.\n");
+        exit(EXIT_FAILURE);
+    }
+    int i = n->token.value;
+    r[0] = vars[i];
+    /* x' = 1, y' = 0 */
+    if (var < 0 ? i < width : i == var)
+        r[var < 0 ? 1 + i : 1] = 1;
+}
+
+/**
+ * @brief Replace the operands of a node by its dual number
+ *
+ * The rules are those of autoGrad, written as r' = ca * a' + cb * b'. The
+ * coefficients divide one step at a time, so they don't overflow where the
+ * derivative doesn't.
+ *
+ * @param e evaluator
+ * @param n node, not a leaf
+ * @param width number of tangents
+ * @param top number of dual numbers on the stack
+ */
+static void applyRule(DualEvaluator *e, const Node *n, int width, int *top)
+{
+    int binary = n->b != NULL;
+    double *ra = e->values + (size_t)(*top - 1 - binary) * (1 + width);
+    double *rb = binary ? ra + 1 + width : NULL;
+    double a = ra[0], b = binary ? rb[0] : 0;
+    double r, ca, cb = 0;
+    switch (n->token.type)
+    {
+    case operator:
+        switch (n->token.value)
+        {
+        case '+':
+            /* (a + b)' = a' + b' */
+            r = a + b, ca = 1, cb = 1;
+            break;
+        case '-':
+            /* (a - b)' = a' - b' */
+            r = a - b, ca = 1, cb = -1;
+            break;
+        case '*':
+            /* (a * b)' = a' * b + a * b' */
+            r = a * b, ca = b, cb = a;
+            break;
+        case '/':
+            /* (a / b)' = (a' * b - a * b') / b^2 */
+            r = a / b, ca = 1 / b, cb = -r / b;
+            break;
+        default:
+            /* (a ^ b)' = a ^ b * (a' * b / a + b' * ln(a)) */
+            r = pow(a, b), ca = r * (b / a), cb = r * log(a);
+            break;
+        }
+        break;
+    case fun1:
+        switch (n->token.value)
+        {
+        case 0:
+            /* ln(a)' = a' / a */
+            r = log(a), ca = 1 / a;
+            break;
+        case 1:
+            /* cos(a)' = -a' * sin(a) */
+            r = cos(a), ca = -sin(a);
+            break;
+        case 2:
+            /* sin(a)' = a' * cos(a) */
+            r = sin(a), ca = cos(a);
+            break;
+        case 3:
+            /* tan(a)' = a' / cos(a)^2 */
+            r = tan(a), ca = 1 / (cos(a) * cos(a));
+            break;
+        default:
+            /* exp(a)' = a' * exp(a) */
+            r = exp(a), ca = r;
+            break;
+        }
+        break;
+    case fun2:
+        if (n->token.value == 0)
+        {
+            /* log(a, b)' = (b' * ln(a) / b - a' * ln(b) / a) / ln(a)^2 */
+            r = log(b) / log(a), ca = -r / a / log(a), cb = 1 / b / log(a);
+        }
+        else
+        {
+            /* pow(a, b)' = (a ^ b)' */
+            r = pow(a, b), ca = r * (b / a), cb = r * log(a);
+        }
+        break;
+    default:
+        fprintf(stderr, "[dualGradient] Invalid node.\n");
+        exit(EXIT_FAILURE);
+    }
+    ra[0] = r;
+    for (int j = 1; j <= width; j++)
+    {
+        double t = ra[j] != 0 ? ca * ra[j] : 0;
+        if (binary && rb[j] != 0)
+            t += cb * rb[j];
+        ra[j] = t;
+    }
+    *top -= binary;
+}
+
+/**
+ * @brief Evaluate a tree on dual numbers
+ *
+ * The tree is walked on an explicit stack, so deep trees don't overflow the
+ * call stack.
+ *
+ * @param e evaluator
+ * @param n root of the tree
+ * @param vars value of each variable
+ * @param var variable of the tangent, -1 for one tangent per variable
+ * @param width number of tangents
+ * @param tangents tangents of the root
+ * @return double value of the root
+ */
+static double evalDual(DualEvaluator *e, const Node *n, const double *vars, int var, int width,
+                       double *tangents)
+{
+    int top = 0;
+    e->numFrames = 0;
+    if (n->a)
+        pushFrame(e, n);
+    else
+        pushLeaf(e, n, vars, var, width, &top);
+    while (e->numFrames)
+    {
+        int f = e->numFrames - 1;
+        const Node *m = e->nodes[f];
+        int state = e->states[f]++;
+        if (state == 0 || (state == 1 && m->b))
+        {
+            /* leaves at once */
+            const Node *child = state ? m->b : m->a;
+            if (child->a)
+                pushFrame(e, child);
+            else
+                pushLeaf(e, child, vars, var, width, &top);
+            continue;
+        }
+        e->numFrames--;
+        applyRule(e, m, width, &top);
+    }
+    memcpy(tangents, e->values + 1, sizeof(double) * width);
+    return e->values[0];
+}
+
+/**
+ * @brief Compute the value of a tree and its derivative for one variable
+ *
+ * @param e evaluator
+ * @param n root of the tree
+ * @param vars value of each variable
+ * @param var variable
+ * @param derivative derivative of the tree
+ * @return double value of the tree
+ */
+double dualDerivative(DualEvaluator *e, const Node *n, const double *vars, int var,
+                      double *derivative)
+{
+    return evalDual(e, n, vars, var, 1, derivative);
+}
+
+/**
+ * @brief Compute the value of a tree and its gradient in one walk
+ *
+ * @param e evaluator
+ * @param n root of the tree
+ * @param vars value of each variable
+ * @param grad derivative for each of the numVars variables
+ * @return double value of the tree
+ */
+double dualGradient(DualEvaluator *e, const Node *n, const double *vars, double *grad)
+{
+    return evalDual(e, n, vars, -1, e->numVars, grad);
+}
+
+/**
+ * @brief Free the evaluator
+ *
+ * @param e evaluator to be freed
+ */
+void freeDualEvaluator(DualEvaluator *e)
+{
+    free(e->nodes);
+    free(e->states);
+    free(e->values);
+    free(e);
+}
@@ -0,0 +1,52 @@
+/**
+ * @file dual.h
+ * @brief Forward-mode numeric differentiation with dual numbers.
+ *
+ * To check a gradient numerically at many points, building the derivative
+ * trees with autoGrad is not needed. A dual number carries a value and its
+ * tangents, the derivatives of the value with respect to the variables, and
+ * each operation computes both by the rules of autoGrad. One walk of the
+ * parsed tree then gives the value and the derivative for one variable, or
+ * with vector duals, the whole gradient.
+ *
+ * Every rule is a chain rule, r' = ca * a' + cb * b', where ca and cb only
+ * depend on the values. A tangent which is 0 adds nothing, even if its
+ * coefficient is not a number, as constantOptimizer removes 0 * f(x): the
+ * derivative of (-2)^3 is 0, not ln(-2) * 0.
+ */
+#ifndef _DUAL_H_
+#define _DUAL_H_
+
+#include "expression.h"
+
+/**
+ * @brief Evaluator type.
+ *
+ * The walk keeps a stack of nodes and a stack of dual numbers, a value and
+ * its tangents (one, or numVars for a gradient). Both grow as needed and are
+ * kept between calls, so evaluating at many points doesn't allocate.
+ */
+typedef struct dual_evaluator DualEvaluator;
+struct dual_evaluator
+{
+    int numVars;
+    const Node **nodes;
+    int *states;
+    int numFrames, frameSize;
+    double *values;
+    int valueSize; /* in dual numbers */
+};
+
+/**
+ * @defgroup dual Dual number functions
+ *
+ * @{
+ */
+DualEvaluator *createDualEvaluator(int numVars);
+double dualDerivative(DualEvaluator *e, const Node *n, const double *vars, int var,
+                      double *derivative);
+double dualGradient(DualEvaluator *e, const Node *n, const double *vars, double *grad);
+void freeDualEvaluator(DualEvaluator *e);
+/** @} */
+
+#endif
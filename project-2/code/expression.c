@@ -1,6 +1,13 @@
 #include "expression.h"
+#include "arena.h"
+#include "dag.h"
+#include "input.h"
+#include "metrics.h"
 #include <ctype.h>
+#include <limits.h>
 #include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,7 +30,8 @@ const char *fun2s[NUM_FUN2] = {"log", "pow"};
  * @brief Get one line of string from stdin.
  *
  * This function will read one line of string from stdin, and return the string
- * as a String object. EOF will be substituted by '\0'.
+ * as a String object. EOF will be substituted by '\0'. The whitespace is
+ * removed.
  *
  * The String object contains the length of the string, the index of the current
  * character, and the string itself.
@@ -48,38 +56,23 @@ String *getString(void)
         fprintf(stderr, "[getString] malloc failed.\n");
         exit(EXIT_FAILURE);
     }
-    ret->length = 10;
-    ret->index = 0;
-    ret->s = (char *)malloc(sizeof(char) * 10);
+    /* read the first line in bulk (see input.h) */
+    Input *in = openInput(stdin);
+    String line;
+    if (!nextExpression(in, &line))
+        line.length = 0;
+    ret->s = (char *)malloc(line.length + 1);
     if (!ret->s)
     {
         fprintf(stderr, "[getString] malloc failed.\n");
         exit(EXIT_FAILURE);
     }
-    /* read */
-    int c;
-    while ((c = getchar()) != '\n' && c != EOF)
-    {
-        /* filter space */
-        if (isspace(c))
-            continue;
-        ret->s[ret->index++] = c;
-        /* expand string */
-        if (ret->index == ret->length - 1)
-        {
-            ret->s = realloc(ret->s, ret->length * 2);
-            if (!ret->s)
-            {
-                fprintf(stderr, "[getString] malloc failed.\n");
-                exit(EXIT_FAILURE);
-            }
-            ret->length *= 2;
-        }
-    }
-    /* substitute eof */
-    ret->s[ret->index] = '\0';
-    ret->length = ret->index;
+    if (line.length)
+        memcpy(ret->s, line.s, line.length);
+    ret->s[line.length] = '\0';
+    ret->length = line.length;
     ret->index = 0;
+    closeInput(in);
 #ifdef DEBUG
     printf("[getString] Read success.\n");
 #endif
@@ -112,8 +105,8 @@ void freeString(String *s)
  * use.
  *
  * The variable list contains the size of the list, the index of the top
- * element, the array of strings, and the array of the index of the strings in
- * the dictionary order.
+ * element, the array of strings, the array of the index of the strings in
+ * the dictionary order, and a hash table to find the strings.
  *
  * The variable list will have an initial size of 10, and will be doubled when
  * the stack is full.
@@ -130,13 +123,62 @@ VariableList *createVariableList(void)
 {
     int size = 10;
     VariableList *ret = (VariableList *)malloc(sizeof(VariableList));
+    if (!ret)
+    {
+        fprintf(stderr, "[createVariableList] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
     ret->s = (char **)malloc(sizeof(char *) * size);
     ret->dictOrder = (int *)malloc(sizeof(int) * size);
     ret->size = size;
     ret->top = -1;
+    ret->buckets = 32;
+    ret->table = (int *)malloc(sizeof(int) * ret->buckets);
+    if (!ret->s || !ret->dictOrder || !ret->table)
+    {
+        fprintf(stderr, "[createVariableList] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ret->buckets; i++)
+        ret->table[i] = -1;
     return ret;
 }
 
+/**
+ * @brief Hash a symbol (FNV-1a)
+ *
+ * @param symbol first character of the symbol
+ * @param len length of the symbol
+ * @return unsigned hash value
+ */
+static unsigned hashSymbol(const char *symbol, int len)
+{
+    unsigned h = 2166136261u;
+    for (int i = 0; i < len; i++)
+        h = (h ^ (unsigned char)symbol[i]) * 16777619u;
+    return h;
+}
+
+/**
+ * @brief Find the slot of a symbol in the hash table
+ *
+ * The symbol doesn't need to be null-terminated, so it can be a slice of the
+ * input.
+ *
+ * @param s variable list
+ * @param symbol first character of the symbol
+ * @param len length of the symbol
+ * @return int slot of the symbol, or of the empty slot where it belongs
+ */
+static int symbolSlot(const VariableList *s, const char *symbol, int len)
+{
+    int slot = hashSymbol(symbol, len) & (s->buckets - 1);
+    while (s->table[slot] != -1 &&
+           (strncmp(s->s[s->table[slot]], symbol, len) || s->s[s->table[slot]][len]))
+        slot = (slot + 1) & (s->buckets - 1);
+    return slot;
+}
+
 /**
  * @brief Query the symbol in the variable list
  *
@@ -152,12 +194,7 @@ VariableList *createVariableList(void)
  */
 int querySymbol(const VariableList *s, char *symbol)
 {
-    for (int i = 0; i <= s->top; i++)
-    {
-        if (!strcmp(s->s[i], symbol))
-            return i;
-    }
-    return -1;
+    return s->table[symbolSlot(s, symbol, strlen(symbol))];
 }
 
 /**
@@ -168,7 +205,8 @@ int querySymbol(const VariableList *s, char *symbol)
  *
  * When stack is full, the size of the stack will be doubled.
  *
- * This function is responsible for the sorting of the variable list.
+ * The new symbol is put at the end of dictOrder, so sortVariableList must be
+ * called once all the symbols are added.
  *
  * 
  * 
@@ -181,8 +219,9 @@ int querySymbol(const VariableList *s, char *symbol)
 int addSymbol(VariableList *s, char *symbol)
 {
     /* query if existed */
-    if (querySymbol(s, symbol) != -1)
-        return querySymbol(s, symbol);
+    int slot = symbolSlot(s, symbol, strlen(symbol));
+    if (s->table[slot] != -1)
+        return s->table[slot];
     /* dynamically allocate memory */
     if (s->top == s->size - 1)
     {
@@ -199,20 +238,76 @@ int addSymbol(VariableList *s, char *symbol)
         s->size *= 2;
     }
     s->s[++s->top] = symbol;
-    /* insert index to dictOrder array*/
     s->dictOrder[s->top] = s->top;
-    for (int i = s->top; i > 0; i--)
+    s->table[slot] = s->top;
+    /* keep the load factor of the table under 1/2 */
+    if (2 * (s->top + 1) > s->buckets)
     {
-        if (strcmp(s->s[s->dictOrder[i]], s->s[s->dictOrder[i - 1]]) < 0)
+        free(s->table);
+        s->buckets *= 2;
+        s->table = (int *)malloc(sizeof(int) * s->buckets);
+        if (!s->table)
         {
-            int temp = s->dictOrder[i];
-            s->dictOrder[i] = s->dictOrder[i - 1];
-            s->dictOrder[i - 1] = temp;
+            fprintf(stderr, "[addSymbol] malloc failed.\n");
+            exit(EXIT_FAILURE);
         }
+        for (int i = 0; i < s->buckets; i++)
+            s->table[i] = -1;
+        for (int i = 0; i <= s->top; i++)
+            s->table[symbolSlot(s, s->s[i], strlen(s->s[i]))] = i;
     }
     return s->top;
 }
 
+/**
+ * @brief Get the index of a symbol, adding it if it is new
+ *
+ * Only a new symbol is copied, so a symbol can be looked up directly in the
+ * input without allocating anything.
+ *
+ * @param s variable list
+ * @param symbol first character of the symbol
+ * @param len length of the symbol
+ * @return int index of the symbol in the list
+ */
+int internSymbol(VariableList *s, const char *symbol, int len)
+{
+    int index = s->table[symbolSlot(s, symbol, len)];
+    if (index != -1)
+        return index;
+    char *name = (char *)malloc(sizeof(char) * (len + 1));
+    if (!name)
+    {
+        fprintf(stderr, "[internSymbol] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(name, symbol, len);
+    name[len] = '\0';
+    return addSymbol(s, name);
+}
+
+/**
+ * @brief Variable list being sorted by sortVariableList.
+ */
+static _Thread_local const VariableList *sortingList;
+
+static int compareSymbols(const void *a, const void *b)
+{
+    return strcmp(sortingList->s[*(const int *)a], sortingList->s[*(const int *)b]);
+}
+
+/**
+ * @brief Sort dictOrder in the dictionary order of the symbols
+ *
+ * @param s variable list to be sorted
+ */
+void sortVariableList(VariableList *s)
+{
+    sortingList = s;
+    qsort(s->dictOrder, s->top + 1, sizeof(int), compareSymbols);
+    sortingList = NULL;
+}
+
 /**
  * @brief Print the variable list
  *
@@ -250,10 +345,111 @@ void freeVariableList(VariableList *s)
     }
     free(s->s);
     free(s->dictOrder);
+    free(s->table);
     free(s);
 }
 
+/**
+ * @brief Clear the variable list
+ *
+ * The list is emptied but keeps its memory, so it can be reused for the
+ * next expression.
+ *
+ * @param s variable list to be cleared
+ */
+void clearVariableList(VariableList *s)
+{
+    for (int i = 0; i <= s->top; i++)
+        free(s->s[i]);
+    s->top = -1;
+    for (int i = 0; i < s->buckets; i++)
+        s->table[i] = -1;
+}
+
 /* Token */
+
+/**
+ * @brief Match a name against the function names
+ *
+ * A switch on the length and the first character picks the only candidate,
+ * which is then compared, instead of trying every name in fun1s and fun2s.
+ *
+ * @param name first character of the name
+ * @param len length of the name
+ * @return Token fun1 or fun2 token, or a variable token if it is no function
+ */
+static Token keyword(const char *name, int len)
+{
+    Token ret = {variable, -1};
+    switch (len)
+    {
+    case 2:
+        if (name[0] == 'l' && name[1] == 'n')
+            ret = (Token){fun1, 0};
+        break;
+    case 3:
+        switch (name[0])
+        {
+        case 'c':
+            ret = (Token){fun1, 1};
+            break;
+        case 's':
+            ret = (Token){fun1, 2};
+            break;
+        case 't':
+            ret = (Token){fun1, 3};
+            break;
+        case 'e':
+            ret = (Token){fun1, 4};
+            break;
+        case 'l':
+            ret = (Token){fun2, 0};
+            break;
+        case 'p':
+            ret = (Token){fun2, 1};
+            break;
+        default:
+            return ret;
+        }
+        if (memcmp(name, ret.type == fun1 ? fun1s[ret.value] : fun2s[ret.value], 3))
+            ret = (Token){variable, -1};
+        break;
+    }
+    return ret;
+}
+
+/* where syntax errors go while tryParser runs, stderr otherwise */
+static _Thread_local char *syntaxBuffer;
+static _Thread_local size_t syntaxSize;
+static _Thread_local int syntaxFailed;
+
+/**
+ * @brief Report a syntax error
+ *
+ * Outside of tryParser, the message is printed to stderr and the program
+ * ends. Within it, the first message is kept and the caller must stop
+ * parsing.
+ *
+ * @param where function name printed before the message
+ * @param format printf format of the message
+ */
+static void syntaxError(const char *where, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if (!syntaxBuffer)
+    {
+        fprintf(stderr, "[%s] ", where);
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+        exit(EXIT_FAILURE);
+    }
+    if (!syntaxFailed)
+        vsnprintf(syntaxBuffer, syntaxSize, format, args);
+    syntaxFailed = 1;
+    va_end(args);
+}
+
 /**
  * @brief Get the Token object
  *
@@ -261,9 +457,12 @@ void freeVariableList(VariableList *s)
  *
  * The token contains the type of the token, and the value of the token.
  *
- * This function uses greedy algorithm to get the token. For example, when
- * parsing "ln", the function will first try to parse "l", and then "ln".
+ * This function uses greedy algorithm to get the token: a name is the longest
+ * run of lowercase letters, and it is a function only if the whole name is a
+ * function name. For example, "lnx" is a variable.
  *
+ * Each character is looked at once, and the name of a variable is only
+ * copied the first time it appears.
  * 
  * 
  * 
@@ -273,18 +472,18 @@ void freeVariableList(VariableList *s)
  */
 Token getToken(String *s, VariableList *list)
 {
-    /* prevent broken token */
-    if (s->s[s->index] == '\0')
-        return (Token){eof, 0};
-
     /* filter space */
     while (isspace(s->s[s->index]))
     {
         s->index++;
     }
 
-    switch (s->s[s->index])
+    const char *p = s->s + s->index;
+    switch (*p)
     {
+    /* prevent broken token */
+    case '\0':
+        return (Token){eof, 0};
     /* one character token */
     case '(':
         s->index++;
@@ -293,20 +492,12 @@ Token getToken(String *s, VariableList *list)
         s->index++;
         return (Token){right_bracket, 0};
     case '^':
-        s->index++;
-        return (Token){operator, '^' };
     case '*':
-        s->index++;
-        return (Token){operator, '*' };
     case '/':
-        s->index++;
-        return (Token){operator, '/' };
     case '+':
-        s->index++;
-        return (Token){operator, '+' };
     case '-':
         s->index++;
-        return (Token){operator, '-' };
+        return (Token){operator, *p};
     case ',':
         s->index++;
         return (Token){comma, 0};
@@ -315,63 +506,37 @@ Token getToken(String *s, VariableList *list)
     default:
     {
         /* number */
-        if (isdigit(s->s[s->index]))
+        if (isdigit(*p))
         {
-            int ret = s->s[s->index++] - '0';
-            while (isdigit(s->s[s->index]))
+            int ret = *p++ - '0';
+            while (isdigit(*p))
             {
                 ret *= 10;
-                ret += s->s[s->index] - '0';
-                s->index++;
+                ret += *p++ - '0';
             }
+            s->index = p - s->s;
             return (Token){digit, ret};
         }
 
         /* illegal character */
-        if (!islower(s->s[s->index]))
-        {
-            fprintf(stderr, "[getToken] Syntax error: Undefined character %c\n",
-                    s->s[s->index]);
-            exit(EXIT_FAILURE);
-        }
-
-        /* function1 name */
-        for (int i = 0; i < NUM_FUN1; i++)
-        {
-            if (strstr(s->s + s->index, fun1s[i]) == s->s + s->index &&
-                !islower(s->s[s->index + strlen(fun1s[i])]))
-            {
-                s->index += strlen(fun1s[i]);
-                return (Token){fun1, i};
-            }
-        }
-
-        /* function2 name*/
-        for (int i = 0; i < NUM_FUN2; i++)
+        if (!islower(*p))
         {
-            if (strstr(s->s + s->index, fun2s[i]) == s->s + s->index &&
-                !islower(s->s[s->index + strlen(fun2s[i])]))
-            {
-                s->index += strlen(fun2s[i]);
-                return (Token){fun2, i};
-            }
+            syntaxError("getToken", "Syntax error: Undefined character %c", *p);
+            return (Token){eof, 0};
         }
 
-        /* detect variable name */
         int nameLen = 1;
-        while (islower(s->s[s->index + nameLen]))
+        while (islower(p[nameLen]))
             nameLen++;
-        char *varName = (char *)malloc(sizeof(char) * (nameLen + 1));
-        strncpy(varName, s->s + s->index, nameLen);
-        varName[nameLen] = '\0';
         s->index += nameLen;
 
-        /* query if existed */
-        int query_result = querySymbol(list, varName);
-        if (query_result == -1)
-            return (Token){variable, addSymbol(list, varName)};
-        else
-            return (Token){variable, query_result};
+        /* function name */
+        Token ret = keyword(p, nameLen);
+        if (ret.type != variable)
+            return ret;
+
+        /* variable name */
+        return (Token){variable, internSymbol(list, p, nameLen)};
     }
     }
 }
@@ -437,8 +602,9 @@ void printTokens(Token *t, int num, const VariableList *v)
  * The node contains the token of the node, and the left and right child of the
  * node.
  *
- * 
- * 
+ * If a node store is in use, the unique node of the store is returned
+ * instead of a new one. Otherwise, if a node arena is in use, the node is
+ * allocated from the arena.
  * 
  * @param t token of the node
  * @param a left child
@@ -447,18 +613,361 @@ void printTokens(Token *t, int num, const VariableList *v)
  */
 Node *createNode(Token t, Node *a, Node *b)
 {
+    NodeStore *store = currentNodeStore();
+    if (store)
+        return internNode(store, t, a, b);
+    NodeArena *arena = currentNodeArena();
+    if (arena)
+        return arenaNode(arena, t, a, b);
     Node *ret = (Node *)malloc(sizeof(Node));
     if (!ret)
     {
         fprintf(stderr, "[createNode] malloc failed.\n");
         exit(EXIT_FAILURE);
     }
+    METRICS_CREATED(1, sizeof(Node));
     ret->token = t;
     ret->a = a;
     ret->b = b;
+    ret->hash = structuralHash(t, a, b);
+    return ret;
+}
+
+/**
+ * @brief Finalize a hash value (murmur3 fmix32)
+ *
+ * @param h hash value
+ * @return unsigned mixed value
+ */
+static unsigned mixBits(unsigned h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/**
+ * @brief Structural hash of a node
+ *
+ * The hash is computed from the token and the cached hashes of the
+ * children, so it takes constant time. The children of + and * are taken in
+ * hash order, so trees equal by compareTree have equal hashes.
+ *
+ * @param t token of the node
+ * @param a left child
+ * @param b right child
+ * @return unsigned hash value
+ */
+unsigned structuralHash(Token t, const Node *a, const Node *b)
+{
+    return combineHash(t, a ? a->hash : 0x6a09e667u, b ? b->hash : 0xbb67ae85u);
+}
+
+/**
+ * @brief Structural hash of a node from the hashes of its children
+ *
+ * Same as structuralHash, for trees which don't keep their nodes in Node,
+ * like compact trees.
+ *
+ * @param t token of the node
+ * @param ha hash of the left child
+ * @param hb hash of the right child
+ * @return unsigned hash value
+ */
+unsigned combineHash(Token t, unsigned ha, unsigned hb)
+{
+    if (t.type == operator && (t.value == '+' || t.value == '*') && ha > hb)
+    {
+        unsigned swap = ha;
+        ha = hb;
+        hb = swap;
+    }
+    /* the children are mixed already, so one round is enough */
+    return mixBits(((unsigned)t.type << 24 ^ (unsigned)t.value) + ha * 0x9e3779b1u +
+                   hb * 0x85ebca77u);
+}
+
+/* Explicit stack */
+
+/**
+ * @brief Frame of a walk on an explicit stack
+ *
+ * The tree walks keep their pending nodes here instead of on the call stack,
+ * so a deep tree (a sum of 200k terms is a chain of 200k nodes) can't
+ * overflow it. a and b hold the results of the children, state counts the
+ * children visited. linearParser also uses t and minPrec, renderTree
+ * brackets, compareTree and orderTree other.
+ */
+typedef struct walk_frame WalkFrame;
+struct walk_frame
+{
+    const Node *node;
+    const Node *other; /* node of the second tree, compared with node */
+    Node *a, *b;
+    Token t;
+    int state, minPrec;
+    int brackets; /* renderTree: 1 around a, 2 around b */
+};
+
+/**
+ * @brief Number of frames kept in the WalkStack itself, so walking a small
+ * tree doesn't allocate
+ */
+#define WALK_LOCAL 64
+
+typedef struct walk_stack WalkStack;
+struct walk_stack
+{
+    WalkFrame *frames;
+    int num, size;
+    WalkFrame local[WALK_LOCAL];
+};
+
+static void initWalk(WalkStack *w)
+{
+    w->frames = w->local;
+    w->num = 0;
+    w->size = WALK_LOCAL;
+}
+
+/**
+ * @brief Double the size of the stack
+ *
+ * @param w stack
+ */
+static void growWalk(WalkStack *w)
+{
+    WalkFrame *frames = (WalkFrame *)malloc(sizeof(WalkFrame) * w->size * 2);
+    if (!frames)
+    {
+        fprintf(stderr, "[pushFrame] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(frames, w->frames, sizeof(WalkFrame) * w->num);
+    if (w->frames != w->local)
+        free(w->frames);
+    w->frames = frames;
+    w->size *= 2;
+}
+
+/**
+ * @brief Push a frame
+ *
+ * The frames may move, so pointers to them are invalid afterwards.
+ *
+ * @param w stack
+ * @param node node of the frame
+ * @param state state of the frame
+ * @return WalkFrame* new frame
+ */
+static inline WalkFrame *pushFrame(WalkStack *w, const Node *node, int state)
+{
+    if (w->num == w->size)
+        growWalk(w);
+    WalkFrame *f = &w->frames[w->num++];
+    METRICS_DEPTH(w->num);
+    f->node = node;
+    f->a = f->b = NULL;
+    f->state = state;
+    return f;
+}
+
+static void freeWalk(WalkStack *w)
+{
+    if (w->frames != w->local)
+        free(w->frames);
+}
+
+/**
+ * @brief Walks done by walkTree
+ */
+enum walk_kind
+{
+    WALK_COPY,    /* copyTree */
+    WALK_GRAD,    /* autoGrad */
+    WALK_OPTIMIZE /* constantOptimizer */
+};
+typedef enum walk_kind WalkKind;
+
+/**
+ * @brief Walk of walkTree
+ */
+typedef struct walk Walk;
+struct walk
+{
+    WalkKind kind;
+    NodeStore *store; /* node store in use, NULL if none */
+    int var;          /* variable to be differentiated */
+};
+
+static Node *gradRule(const Node *n, Node *da, Node *db, const int thisVar);
+static Node *optimizeRule(const Node *n, Node *a, Node *b);
+
+/**
+ * @brief Look up the result of a node in the node store
+ *
+ * Nodes of the store are shared instead of copied, and their derivatives
+ * and optimized trees are kept there.
+ *
+ * @param k walk
+ * @param n node
+ * @return Node* result, NULL if not known
+ */
+static inline Node *knownResult(const Walk *k, const Node *n)
+{
+    if (!k->store || !isInterned(k->store, n))
+        return NULL;
+    switch (k->kind)
+    {
+    case WALK_COPY:
+        return (Node *)n;
+    case WALK_GRAD:
+        return storedGrad(k->store, n, k->var);
+    default:
+        return storedOptimized(k->store, n);
+    }
+}
+
+/**
+ * @brief Build the result of a node from the results of its children
+ *
+ * The result is kept in the node store if n is there.
+ *
+ * @param k walk
+ * @param n node
+ * @param a result of the left child
+ * @param b result of the right child
+ * @return Node* result
+ */
+static inline Node *buildResult(const Walk *k, const Node *n, Node *a, Node *b)
+{
+    Node *ret;
+    switch (k->kind)
+    {
+    case WALK_COPY:
+        return createNode(n->token, a, b);
+    case WALK_GRAD:
+        ret = gradRule(n, a, b, k->var);
+        if (k->store && isInterned(k->store, n))
+            storeGrad(k->store, n, k->var, ret);
+        return ret;
+    default:
+        ret = optimizeRule(n, a, b);
+        if (k->store && isInterned(k->store, n))
+            storeOptimized(k->store, n, ret);
+        return ret;
+    }
+}
+
+/**
+ * @brief Number of levels walked by recursion before walkTree switches to
+ * the explicit stack
+ */
+#define WALK_DEPTH 1024
+
+/**
+ * @brief Walk a deep subtree on the explicit stack
+ *
+ * Same as walkNode, for a node which is neither known nor a leaf.
+ *
+ * @param k walk
+ * @param n root of the subtree
+ * @return Node* result of the root
+ */
+static Node *walkStack(const Walk *k, const Node *n)
+{
+    Node *ret = NULL;
+    WalkStack w;
+    initWalk(&w);
+    pushFrame(&w, n, 0);
+    for (;;)
+    {
+        WalkFrame *f = &w.frames[w.num - 1];
+        Node *result;
+        if (f->state < 2)
+        {
+            /* visit the next child, leaves at once */
+            const Node *child = f->state++ ? f->node->b : f->node->a;
+            if (!child)
+                continue;
+            result = knownResult(k, child);
+            if (!result)
+            {
+                if (child->a || child->b)
+                {
+                    pushFrame(&w, child, 0);
+                    METRICS_DEPTH(WALK_DEPTH + w.num);
+                    continue;
+                }
+                result = buildResult(k, child, NULL, NULL);
+            }
+        }
+        else
+        {
+            result = buildResult(k, f->node, f->a, f->b);
+            if (--w.num == 0)
+            {
+                ret = result;
+                break;
+            }
+            f = &w.frames[w.num - 1];
+        }
+        /* hand the result to the parent */
+        if (f->state == 1)
+            f->a = result;
+        else
+            f->b = result;
+    }
+    freeWalk(&w);
     return ret;
 }
 
+/**
+ * @brief Walk a subtree for walkTree
+ *
+ * @param k walk
+ * @param n root of the subtree
+ * @param depth depth of n
+ * @return Node* result of the root
+ */
+static Node *walkNode(const Walk *k, const Node *n, int depth)
+{
+    Node *ret = knownResult(k, n);
+    if (ret)
+        return ret;
+    METRICS_DEPTH(depth + 1);
+    if (depth >= WALK_DEPTH && (n->a || n->b))
+        return walkStack(k, n);
+    Node *a = n->a ? walkNode(k, n->a, depth + 1) : NULL;
+    Node *b = n->b ? walkNode(k, n->b, depth + 1) : NULL;
+    return buildResult(k, n, a, b);
+}
+
+/**
+ * @brief Compute a result for each node, children first
+ *
+ * A node whose result is known (see knownResult) is not walked. Otherwise
+ * the result is built once the children are done (see buildResult).
+ *
+ * The first WALK_DEPTH levels are walked by recursion, which is faster than
+ * the explicit stack on the shallow trees of most expressions. Deeper
+ * subtrees are walked on the explicit stack, so the call stack stays
+ * bounded however deep the tree is.
+ *
+ * @param kind walk to be done
+ * @param n root of the tree, not NULL
+ * @param var variable to be differentiated, for WALK_GRAD
+ * @return Node* result of the root
+ */
+static Node *walkTree(WalkKind kind, const Node *n, int var)
+{
+    Walk k = {kind, currentNodeStore(), var};
+    return walkNode(&k, n, 0);
+}
+
 /* parser */
 
 /**
@@ -499,46 +1008,337 @@ int isBracketPaired(Token *t, int start, int end)
 }
 
 /**
- * @brief Parse the expression into a tree
+ * @brief Convert the string into a token stream
  *
- * This function will parse the expression into a tree.
+ * The token stream is dynamically allocated and ends with an eof token, so it
+ * must be freed after use. The variable list is sorted afterwards.
  *
- * 
- * 
- * @param s string to be parsed
+ * @param s string to be converted
  * @param list variable list
- * @return Node* root of the tree
+ * @param num number of tokens before eof
+ * @return Token* token stream
  */
-Node *parser(String *s, VariableList *list)
+Token *tokenize(String *s, VariableList *list, int *num)
 {
-    /* convert to token stream */
-    int size = 10, index = 0;
+    /* every token but eof takes at least one character */
+    int size = s->length - s->index + 1, index = 0;
     Token *tokens = (Token *)malloc(sizeof(Token) * size);
+    if (!tokens)
+    {
+        fprintf(stderr, "[tokenize] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
     Token temp;
     while ((temp = getToken(s, list)).type != eof)
-    {
         tokens[index++] = temp;
-        if (index == size - 1)
-        {
-            size *= 2;
-            tokens = realloc(tokens, size * sizeof(Token));
-            if (!tokens)
-            {
-                fprintf(stderr, "[parser] malloc failed.\n");
-                exit(EXIT_FAILURE);
-            }
-        }
-    }
     tokens[index] = temp;
-    /* avaliable tokens from 0 to index - 1 */
-    /* actually we do not mind eof */
+    *num = index;
+    sortVariableList(list);
+    return tokens;
+}
+
+/**
+ * @brief Parse the expression into a tree
+ *
+ * This function will parse the expression into a tree with linearParser.
+ *
+ * 
+ * 
+ * @param s string to be parsed
+ * @param list variable list
+ * @return Node* root of the tree
+ */
+Node *parser(String *s, VariableList *list)
+{
+    /* convert to token stream */
+    int num;
+    Token *tokens = tokenize(s, list, &num);
+    /* avaliable tokens from 0 to num - 1 */
 
 #ifdef DEBUG
-    printTokens(tokens, index, list);
+    printTokens(tokens, num, list);
 #endif
 
-    Node *ret = exprParser(tokens, 0, index - 1);
+    Node *ret = linearParser(tokens, num);
+    free(tokens);
+    return ret;
+}
+
+/**
+ * @brief Parse the expression, returning on a syntax error
+ *
+ * Same as parser, but a syntax error doesn't end the program: its message is
+ * written to error and NULL is returned. The nodes built before the error
+ * are not freed, so a node arena should be in use.
+ *
+ * @param s string to be parsed
+ * @param list variable list
+ * @param error buffer of the error message
+ * @param size size of the buffer
+ * @return Node* root of the tree, NULL on a syntax error
+ */
+Node *tryParser(String *s, VariableList *list, char *error, size_t size)
+{
+    syntaxBuffer = error;
+    syntaxSize = size;
+    syntaxFailed = 0;
+    int num;
+    Token *tokens = tokenize(s, list, &num);
+    Node *ret = syntaxFailed ? NULL : linearParser(tokens, num);
     free(tokens);
+    syntaxBuffer = NULL;
+    return ret;
+}
+
+/**
+ * @brief Cursor over a token stream for linearParser
+ */
+typedef struct token_cursor TokenCursor;
+struct token_cursor
+{
+    Token *t;
+    int index, num;
+};
+
+/**
+ * @brief Binding power of a binary operator
+ *
+ * @param t token
+ * @return int 1 for + -, 2 for * /, 3 for ^, 0 if t is not a binary operator
+ */
+static int precedence(Token t)
+{
+    if (t.type != operator)
+        return 0;
+    switch (t.value)
+    {
+    case '+':
+    case '-':
+        return 1;
+    case '*':
+    case '/':
+        return 2;
+    case '^':
+        return 3;
+    }
+    return 0;
+}
+
+/**
+ * @brief Consume the expected token
+ *
+ * @param c token cursor
+ * @param type expected type
+ * @param what name of the token in the error message
+ */
+static void expect(TokenCursor *c, Type type, const char *what)
+{
+    if (c->t[c->index].type != type)
+    {
+        syntaxError("linearParser", "Expected %s at token %d.", what, c->index);
+        return;
+    }
+    c->index++;
+}
+
+/**
+ * @brief States of the linearParser frames
+ *
+ * A climb frame parses the operators binding at least as tight as its
+ * minPrec, a group frame the inside of brackets. Frames waiting for an
+ * operand get it from the frame above them when it is done.
+ */
+enum climb_state
+{
+    CLIMB_START,   /* before the first operand */
+    CLIMB_SIGN,    /* waiting for the operand of the sign in t */
+    CLIMB_PRIMARY, /* waiting for a bracketed operand */
+    CLIMB_LOOP,    /* a holds the left operand */
+    CLIMB_RHS,     /* waiting for the right operand of the operator in t */
+    GROUP_BRACKET, /* waiting for (expr) */
+    GROUP_FUN1,    /* waiting for fun1(expr) */
+    GROUP_FUN2A,   /* waiting for the first operand of fun2 */
+    GROUP_FUN2B    /* a holds the first operand, waiting for the second */
+};
+
+/**
+ * @brief Push a climb frame
+ *
+ * @param w stack
+ * @param minPrec lowest binding power to be parsed
+ */
+static void pushClimb(WalkStack *w, int minPrec)
+{
+    pushFrame(w, NULL, CLIMB_START)->minPrec = minPrec;
+}
+
+/**
+ * @brief Start a climb frame: parse a sign or a primary
+ *
+ * Pattern: factor -> constant | variable | (expr) | fun1(expr) |
+ * fun2(expr, expr)
+ *
+ * A leading + or - is only allowed where a term starts (minPrec 1 or 2), and
+ * applies to the whole term like termParser does: -a*b is -1*(a*b). Right
+ * after * / or ^ it is an error, as with exprParser.
+ *
+ * @param w stack, the climb frame on top
+ * @param c token cursor
+ */
+static void startClimb(WalkStack *w, TokenCursor *c)
+{
+    WalkFrame *f = &w->frames[w->num - 1];
+    Token t = c->t[c->index];
+    if (t.type == operator && (t.value == '+' || t.value == '-'))
+    {
+        if (f->minPrec > 2)
+        {
+            syntaxError("linearParser", "Unexpected sign at token %d.", c->index);
+            return;
+        }
+        c->index++;
+        f->t = t;
+        f->state = CLIMB_SIGN;
+        pushClimb(w, 2);
+        return;
+    }
+    switch (t.type)
+    {
+    case digit:
+    case variable:
+        c->index++;
+        f->a = createNode(t, NULL, NULL);
+        f->state = CLIMB_LOOP;
+        return;
+    case left_bracket:
+        c->index++;
+        f->state = CLIMB_PRIMARY;
+        pushFrame(w, NULL, GROUP_BRACKET);
+        pushClimb(w, 1);
+        return;
+    case fun1:
+        c->index++;
+        expect(c, left_bracket, "'(' after function1");
+        f->state = CLIMB_PRIMARY;
+        pushFrame(w, NULL, GROUP_FUN1)->t = t;
+        pushClimb(w, 1);
+        return;
+    case fun2:
+        c->index++;
+        expect(c, left_bracket, "'(' after function2");
+        f->state = CLIMB_PRIMARY;
+        pushFrame(w, NULL, GROUP_FUN2A)->t = t;
+        pushClimb(w, 1);
+        return;
+    default:
+        break;
+    }
+    syntaxError("linearParser", "Can't parse factor at token %d.", c->index);
+}
+
+/**
+ * @brief Give a parsed operand to the frame waiting for it
+ *
+ * @param w stack, the waiting frame on top
+ * @param c token cursor
+ * @param operand parsed operand
+ * @return Node* result of the frame if it is done, NULL if not
+ */
+static Node *takeOperand(WalkStack *w, TokenCursor *c, Node *operand)
+{
+    WalkFrame *f = &w->frames[w->num - 1];
+    switch (f->state)
+    {
+    case CLIMB_SIGN:
+        f->a = createNode((Token){operator, '*'}, createNode((Token){digit, f->t.value == '+' ? 1 : -1}, NULL, NULL), operand);
+        f->state = CLIMB_LOOP;
+        return NULL;
+    case CLIMB_PRIMARY:
+        f->a = operand;
+        f->state = CLIMB_LOOP;
+        return NULL;
+    case CLIMB_RHS:
+        f->a = createNode(f->t, f->a, operand);
+        f->state = CLIMB_LOOP;
+        return NULL;
+    case GROUP_BRACKET:
+        expect(c, right_bracket, "')'");
+        return operand;
+    case GROUP_FUN1:
+        expect(c, right_bracket, "')' after function1");
+        return createNode(f->t, operand, NULL);
+    case GROUP_FUN2A:
+        expect(c, comma, "',' within function2");
+        f->a = operand;
+        f->state = GROUP_FUN2B;
+        pushClimb(w, 1);
+        return NULL;
+    default:
+        expect(c, right_bracket, "')' after function2");
+        return createNode(f->t, f->a, operand);
+    }
+}
+
+/**
+ * @brief Parse the token stream into a tree in one pass
+ *
+ * This is a precedence climbing parser. Each token is looked at once, so
+ * parsing takes linear time, while exprParser scans the token range and checks
+ * the brackets on both sides of every candidate operator. Both parsers build
+ * the same tree.
+ *
+ * Operators of the same level are left associative, except ^ which is right
+ * associative. The pending operators and brackets are kept on an explicit
+ * stack, so deep nesting can't overflow the call stack.
+ *
+ * @param t token stream ending with eof
+ * @param num number of tokens before eof
+ * @return Node* parsed tree
+ */
+Node *linearParser(Token *t, int num)
+{
+    TokenCursor c = {t, 0, num};
+    WalkStack w;
+    initWalk(&w);
+    pushClimb(&w, 1);
+    Node *ret = NULL;
+    while (!ret && !syntaxFailed)
+    {
+        WalkFrame *f = &w.frames[w.num - 1];
+        if (f->state == CLIMB_START)
+        {
+            startClimb(&w, &c);
+            continue;
+        }
+        /* f->state == CLIMB_LOOP: parse operators binding at least as tight as minPrec */
+        int prec = precedence(c.t[c.index]);
+        if (prec >= f->minPrec && prec)
+        {
+            f->t = c.t[c.index++];
+            f->state = CLIMB_RHS;
+            pushClimb(&w, f->t.value == '^' ? prec : prec + 1);
+            continue;
+        }
+        /* the climb is done, hand its tree down until a frame is still waiting */
+        Node *operand = f->a;
+        while (operand && !syntaxFailed)
+        {
+            if (--w.num == 0)
+            {
+                ret = operand;
+                break;
+            }
+            operand = takeOperand(&w, &c, operand);
+        }
+    }
+    freeWalk(&w);
+    if (syntaxFailed)
+        return NULL;
+    if (c.index != c.num)
+    {
+        syntaxError("linearParser", "Unexpected token %d.", c.index);
+        return NULL;
+    }
     return ret;
 }
 
@@ -791,126 +1591,598 @@ Node *factorParser(Token *t, int start, int end)
 /* Tree */
 
 /**
- * @brief Print the tree
+ * @brief Check if a child of an operator needs brackets
  *
- * 
+ * Compare the priority of the operator and its child: the right child of -
+ * needs brackets if it is a -, the children of * / if they are + - * /, and
+ * the children of ^ if they are any operator.
+ *
+ * @param n operator node
+ * @param child child of n
+ * @param right 1 for the right child
+ * @return int 1 if brackets are needed
+ */
+static int needBracket(const Node *n, const Node *child, int right)
+{
+    if (child->token.type != operator)
+    return 0;
+    switch (n->token.value)
+    {
+    case '+':
+    case '-': /* lowest-priority */
+    return right && child->token.value == '-';
+    case '*':
+    case '/': /* medium-priority */
+    return child->token.value != '^';
+    default: /* highest-priority */
+    return 1;
+    }
+}
+
+/**
+ * @brief Text marking the end of a truncated tree.
+ */
+static const char truncationMarker[] = "...";
+
+/**
+ * @brief Set up an output buffer
+ *
+ * @param b buffer
+ * @param s storage, NULL for a buffer grown by the printer
+ * @param size size of s, or initial size if s is NULL
+ * @param fp file written when s fills up, NULL to keep the text in s
+ * @param limit most characters rendered per tree, 0 for no limit
+ */
+void initPrintBuffer(PrintBuffer *b, char *s, size_t size, FILE *fp, size_t limit)
+{
+    b->owned = !s;
+    if (b->owned)
+    {
+    size = size > 16 ? size : 16;
+    s = (char *)malloc(size);
+    if (!s)
+    {
+        fprintf(stderr, "[initPrintBuffer] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    }
+    b->s = s;
+    b->length = 0;
+    b->size = size;
+    b->fp = fp;
+    b->limit = limit;
+    b->total = 0;
+    b->truncated = 0;
+    if (size)
+    s[0] = '\0';
+}
+
+/**
+ * @brief Write the text in the buffer to its file
+ *
+ * @param b buffer
+ */
+void flushPrintBuffer(PrintBuffer *b)
+{
+    if (b->fp && b->length)
+    fwrite(b->s, 1, b->length, b->fp);
+    if (b->fp)
+    b->length = 0;
+    if (b->size)
+    b->s[b->length] = '\0';
+}
+
+/**
+ * @brief Free the storage of a buffer grown by the printer
+ *
+ * @param b buffer
+ */
+void freePrintBuffer(PrintBuffer *b)
+{
+    if (b->owned)
+    free(b->s);
+    b->s = NULL;
+    b->length = b->size = 0;
+}
+
+/**
+ * @brief Make room for len more characters and the terminating zero
+ *
+ * @param b buffer
+ * @param len number of characters
+ * @return size_t number of characters that fit
+ */
+static size_t roomFor(PrintBuffer *b, size_t len)
+{
+    if (b->length + len < b->size)
+    return len;
+    if (b->fp)
+    {
+    flushPrintBuffer(b);
+    if (len < b->size)
+        return len;
+    }
+    else if (b->owned)
+    {
+    while (b->length + len >= b->size)
+        b->size *= 2;
+    b->s = (char *)realloc(b->s, b->size);
+    if (!b->s)
+    {
+        fprintf(stderr, "[renderTree] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    return len;
+    }
+    return b->size ? b->size - 1 - b->length : 0;
+}
+
+/**
+ * @brief Append text to the buffer
+ *
+ * Text past the limit, or past the end of a caller's buffer, is dropped and
+ * the tree is marked as truncated.
+ *
+ * @param b buffer
+ * @param text text
+ * @param len length of the text
+ */
+static void putText(PrintBuffer *b, const char *text, size_t len)
+{
+    if (b->truncated)
+    return;
+    if (b->limit && b->total + len > b->limit)
+    {
+    len = b->limit - b->total;
+    b->truncated = 1;
+    }
+    size_t fit = roomFor(b, len);
+    while (fit < len && b->fp)
+    {
+    /* longer than the whole buffer */
+    memcpy(b->s + b->length, text, fit);
+    b->length += fit;
+    b->total += fit;
+    text += fit;
+    len -= fit;
+    fit = roomFor(b, len);
+    }
+    if (fit < len)
+    b->truncated = 1;
+    memcpy(b->s + b->length, text, fit);
+    b->length += fit;
+    b->total += fit;
+    if (!b->truncated)
+    return;
+    /* end with the marker, over the last characters of a full buffer */
+    size_t marker = sizeof(truncationMarker) - 1;
+    size_t room = roomFor(b, marker);
+    if (room < marker)
+    b->length -= b->length < marker - room ? b->length : marker - room;
+    room = roomFor(b, marker);
+    memcpy(b->s + b->length, truncationMarker, room);
+    b->length += room;
+}
+
+static void putChar(PrintBuffer *b, char c)
+{
+    if (!b->truncated && b->length + 1 < b->size && (!b->limit || b->total < b->limit))
+    {
+    b->s[b->length++] = c;
+    b->total++;
+    return;
+    }
+    putText(b, &c, 1);
+}
+
+static void putString(PrintBuffer *b, const char *text)
+{
+    putText(b, text, strlen(text));
+}
+
+/**
+ * @brief Append a number, in brackets if it is not positive like printTree
+ *
+ * @param b buffer
+ * @param value number
+ * @param bracket 1 to put brackets around numbers below 1
+ */
+static void putNumber(PrintBuffer *b, long value, int bracket)
+{
+    char digits[24];
+    int i = sizeof(digits);
+    int open = bracket && value <= 0;
+    unsigned long u = value < 0 ? 0UL - (unsigned long)value : (unsigned long)value;
+    if (open)
+    digits[--i] = ')';
+    do
+    {
+    digits[--i] = '0' + u % 10;
+    u /= 10;
+    } while (u);
+    if (value < 0)
+    digits[--i] = '-';
+    if (open)
+    digits[--i] = '(';
+    putText(b, digits + i, sizeof(digits) - i);
+}
+
+/**
+ * @brief Nodes printed as let-bindings
+ *
+ * An open addressing table of the nodes reachable from the root, with the
+ * number of references to each node and its binding number, 0 if it is
+ * not bound. bound lists the bound nodes, children first.
+ */
+typedef struct shared_nodes SharedNodes;
+struct shared_nodes
+{
+    const Node **nodes;
+    int *counts, *ids;
+    int num, buckets; /* power of 2 */
+    const Node **bound;
+    int numBound;
+};
+
+static unsigned hashAddress(const Node *n)
+{
+    uintptr_t p = (uintptr_t)n;
+    return mixBits((unsigned)(p >> 4) ^ (unsigned)((uint64_t)p >> 32));
+}
+
+static int findShared(const SharedNodes *t, const Node *n)
+{
+    unsigned mask = t->buckets - 1;
+    unsigned i = hashAddress(n) & mask;
+    while (t->nodes[i] && t->nodes[i] != n)
+    i = (i + 1) & mask;
+    return i;
+}
+
+static void *sharedArray(size_t num, size_t width)
+{
+    void *ret = calloc(num, width);
+    if (!ret)
+    {
+    fprintf(stderr, "[renderTree] calloc failed.\n");
+    exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+/**
+ * @brief Count one more reference to a node
+ *
+ * @param t table
+ * @param n node
+ * @return int 1 if n was seen for the first time
+ */
+static int countShared(SharedNodes *t, const Node *n)
+{
+    if ((t->num + 1) * 2 > t->buckets)
+    {
+    SharedNodes old = *t;
+    t->buckets *= 2;
+    t->nodes = (const Node **)sharedArray(t->buckets, sizeof(Node *));
+    t->counts = (int *)sharedArray(t->buckets, sizeof(int));
+    t->ids = (int *)sharedArray(t->buckets, sizeof(int));
+    for (int i = 0; i < old.buckets; i++)
+        if (old.nodes[i])
+        {
+            int j = findShared(t, old.nodes[i]);
+            t->nodes[j] = old.nodes[i];
+            t->counts[j] = old.counts[i];
+        }
+    free(old.nodes);
+    free(old.counts);
+    free(old.ids);
+    }
+    int i = findShared(t, n);
+    if (t->nodes[i])
+    {
+    t->counts[i]++;
+    return 0;
+    }
+    t->nodes[i] = n;
+    t->counts[i] = 1;
+    t->num++;
+    return 1;
+}
+
+/**
+ * @brief Find the subtrees referenced more than once
+ *
+ * The DAG is walked once, children first, so each subtree is numbered after
+ * the subtrees it uses. Leaves are never bound.
+ *
+ * @param t table, filled
  * @param n root of the tree
- * @param v variable list
  */
-void printTree(Node *n, const VariableList *v)
+static void findSharedNodes(SharedNodes *t, const Node *n)
 {
-    if (!n)
+    t->num = t->numBound = 0;
+    t->buckets = 64;
+    t->nodes = (const Node **)sharedArray(t->buckets, sizeof(Node *));
+    t->counts = (int *)sharedArray(t->buckets, sizeof(int));
+    t->ids = (int *)sharedArray(t->buckets, sizeof(int));
+    t->bound = NULL;
+    /* count the references, visiting each node once */
+    WalkStack w;
+    initWalk(&w);
+    countShared(t, n);
+    pushFrame(&w, n, 0);
+    while (w.num)
     {
-    printf("Empty tree.\n");
+    const Node *m = w.frames[--w.num].node;
+    if (m->a && countShared(t, m->a))
+        pushFrame(&w, m->a, 0);
+    if (m->b && countShared(t, m->b))
+        pushFrame(&w, m->b, 0);
+    }
+    /* number the shared subtrees, children first */
+    int numShared = 0;
+    for (int i = 0; i < t->buckets; i++)
+    if (t->nodes[i] && t->counts[i] > 1 && t->nodes[i]->a)
+        numShared++;
+    if (!numShared)
+    {
+    freeWalk(&w);
     return;
     }
+    t->bound = (const Node **)sharedArray(numShared, sizeof(Node *));
+    pushFrame(&w, n, 0);
+    while (w.num)
+    {
+    WalkFrame *f = &w.frames[w.num - 1];
+    const Node *m = f->node;
+    const Node *child = f->state == 0 ? m->a : f->state == 1 ? m->b : NULL;
+    if (f->state++ < 2)
+    {
+        int i;
+        if (child && child->a && !t->ids[i = findShared(t, child)])
+        {
+            t->ids[i] = -1; /* visited */
+            pushFrame(&w, child, 0);
+        }
+        continue;
+    }
+    w.num--;
+    int i = findShared(t, m);
+    if (t->counts[i] > 1 && m->a)
+    {
+        t->bound[t->numBound++] = m;
+        t->ids[i] = t->numBound;
+    }
+    else
+        t->ids[i] = 0;
+    }
+    freeWalk(&w);
+}
 
+static void freeSharedNodes(SharedNodes *t)
+{
+    free(t->nodes);
+    free(t->counts);
+    free(t->ids);
+    free(t->bound);
+}
+
+/**
+ * @brief Binding number of a node
+ *
+ * @param t table, NULL if nothing is bound
+ * @param n node
+ * @return int binding number, 0 if not bound
+ */
+static int bindingOf(const SharedNodes *t, const Node *n)
+{
+    return t && t->numBound && n->a ? t->ids[findShared(t, n)] : 0;
+}
+
+/**
+ * @brief Render a leaf, or the name of a bound subtree
+ *
+ * @param b buffer
+ * @param n node, may be NULL
+ * @param v variable list
+ * @param t bound subtrees, may be NULL
+ * @param self binding being defined, rendered in full
+ * @return int 1 if rendered, 0 if n must be walked
+ */
+static int renderLeaf(PrintBuffer *b, const Node *n, const VariableList *v,
+                      const SharedNodes *t, const Node *self)
+{
+    if (!n)
+    {
+    putString(b, "Empty tree.\n");
+    return 1;
+    }
     switch (n->token.type)
     {
-    /* factor */
     case variable:
-    printf("%s", v->s[n->token.value]);
+    putString(b, v->s[n->token.value]);
+    return 1;
+    case digit:
+    putNumber(b, n->token.value, 1);
+    return 1;
+    default:
+    break;
+    }
+    int id = n != self ? bindingOf(t, n) : 0;
+    if (!id)
+    return 0;
+    putChar(b, 'T');
+    putNumber(b, id, 0);
+    return 1;
+}
+
+/**
+ * @brief Render one tree, stopping at the bound subtrees
+ *
+ * The brackets of the children of a node are decided once, when the node
+ * is entered. The name of a bound subtree needs none.
+ *
+ * @param b buffer
+ * @param n root of the tree
+ * @param v variable list
+ * @param t bound subtrees, may be NULL
+ */
+static void renderNode(PrintBuffer *b, const Node *n, const VariableList *v, const SharedNodes *t)
+{
+    if (renderLeaf(b, n, v, t, n))
     return;
+    WalkStack w;
+    initWalk(&w);
+    pushFrame(&w, n, 0);
+    while (w.num && !b->truncated)
+    {
+    WalkFrame *f = &w.frames[w.num - 1];
+    const Node *m = f->node;
+    const Node *child = NULL;
+    switch (m->token.type)
+    {
     case fun1:
-    printf("%s(", fun1s[n->token.value]);
-    printTree(n->a, v);
-    printf(")");
-    return;
     case fun2:
-    printf("%s(", fun2s[n->token.value]);
-    printTree(n->a, v);
-    putchar(',');
-    printTree(n->b, v);
-    putchar(')');
-    return;
-    case digit:
-    n->token.value > 0 ? printf("%d", n->token.value)
-                       : printf("(%d)", n->token.value);
-    return;
+        if (f->state == 0)
+        {
+            putString(b, m->token.type == fun1 ? fun1s[m->token.value] : fun2s[m->token.value]);
+            putChar(b, '(');
+            child = m->a;
+        }
+        else if (f->state == 1 && m->token.type == fun2)
+        {
+            putChar(b, ',');
+            child = m->b;
+        }
+        else
+        {
+            putChar(b, ')');
+            w.num--;
+            continue;
+        }
+        break;
     case
     operator:
-    /* compare priority of this node and its child to add brackets */
-    switch (n->token.value)
+        if (f->state == 0)
+        {
+            f->brackets = (needBracket(m, m->a, 0) && !bindingOf(t, m->a)) |
+                          (needBracket(m, m->b, 1) && !bindingOf(t, m->b)) << 1;
+            if (f->brackets & 1)
+                putChar(b, '(');
+            child = m->a;
+        }
+        else if (f->state == 1)
+        {
+            if (f->brackets & 1)
+                putChar(b, ')');
+            putChar(b, m->token.value);
+            if (f->brackets & 2)
+                putChar(b, '(');
+            child = m->b;
+        }
+        else
+        {
+            if (f->brackets & 2)
+                putChar(b, ')');
+            w.num--;
+            continue;
+        }
+        break;
+    default:
+        fprintf(stderr, "[renderTree] Invalid token type appeared in tree.\n");
+        exit(EXIT_FAILURE);
+    }
+    f->state = f->state ? 2 : 1;
+    if (!renderLeaf(b, child, v, t, NULL))
+        pushFrame(&w, child, 0);
+    }
+    freeWalk(&w);
+}
+
+/**
+ * @brief Render the tree into a buffer
+ *
+ * With let, the subtrees referenced more than once (shared nodes of a DAG
+ * built in a node store) are rendered once each, as bindings before the
+ * tree: let T1 = x*y, T2 = sin(T1)*T1 in T2^2. Without, they are expanded
+ * wherever they are used, as printTree does.
+ *
+ * At most b->limit characters are rendered, not counting the "..." that
+ * ends a truncated tree; the walk stops there, so a huge tree is cheap to
+ * preview.
+ *
+ * @param b buffer
+ * @param n root of the tree
+ * @param v variable list
+ * @param let 1 to render the shared subtrees as bindings
+ */
+void renderTree(PrintBuffer *b, const Node *n, const VariableList *v, int let)
+{
+    b->total = 0;
+    b->truncated = 0;
+    if (!let || !n)
+    renderNode(b, n, v, NULL);
+    else
     {
-    case '+':
-    case '-': /* lowest-priority */
-        printTree(n->a, v);
-        putchar(n->token.value);
-        /* right tree of - need bracket */
-        if (n->b->token.type == operator&& n->b->token.value == '-')
-      putchar('(');
-        printTree(n->b, v);
-        if (n->b->token.type == operator&& n->b->token.value == '-')
-      putchar(')');
-        return;
-    case '*':
-    case '/':
-        /* medium-priority */
-        if (n->a->token.type == operator&&(n->a->token.value == '+' ||
-                                           n->a->token.value == '-' ||
-                                           n->a->token.value == '*' ||
-                                           n->a->token.value == '/'))
-      putchar('(');
-        printTree(n->a, v);
-        if (n->a->token.type == operator&&(n->a->token.value == '+' ||
-                                           n->a->token.value == '-' ||
-                                           n->a->token.value == '*' ||
-                                           n->a->token.value == '/'))
-      putchar(')');
-        putchar(n->token.value);
-        if (n->b->token.type == operator&&(n->b->token.value == '+' ||
-                                           n->b->token.value == '-' ||
-                                           n->b->token.value == '*' ||
-                                           n->b->token.value == '/'))
-      putchar('(');
-        printTree(n->b, v);
-        if (n->b->token.type == operator&&(n->b->token.value == '+' ||
-                                           n->b->token.value == '-' ||
-                                           n->b->token.value == '*' ||
-                                           n->b->token.value == '/'))
-      putchar(')');
-        return;
-    case '^':
-        /* highest-priority */
-        if (n->a->token.type == operator&&(n->a->token.value == '+' ||
-                                           n->a->token.value == '-' ||
-                                           n->a->token.value == '*' ||
-                                           n->a->token.value == '/' || 
-                                           n->a->token.value == '^'))
-      putchar('(');
-        printTree(n->a, v);
-        if (n->a->token.type == operator&&(n->a->token.value == '+' ||
-                                           n->a->token.value == '-' ||
-                                           n->a->token.value == '*' ||
-                                           n->a->token.value == '/' ||
-                                           n->a->token.value == '^'))
-      putchar(')');
-        putchar(n->token.value);
-        if (n->b->token.type == operator&&(n->b->token.value == '+' ||
-                                           n->b->token.value == '-' ||
-                                           n->b->token.value == '*' ||
-                                           n->b->token.value == '/' ||
-                                           n->b->token.value == '^'))
-      putchar('(');
-        printTree(n->b, v);
-        if (n->b->token.type == operator&&(n->b->token.value == '+' ||
-                                           n->b->token.value == '-' ||
-                                           n->b->token.value == '*' ||
-                                           n->b->token.value == '/' ||
-                                           n->b->token.value == '^'))
-      putchar(')');
-        return;
+    SharedNodes t;
+    findSharedNodes(&t, n);
+    if (t.numBound)
+    {
+        putString(b, "let ");
+        for (int i = 0; i < t.numBound && !b->truncated; i++)
+        {
+            if (i)
+                putString(b, ", ");
+            putChar(b, 'T');
+            putNumber(b, i + 1, 0);
+            putString(b, " = ");
+            renderNode(b, t.bound[i], v, &t);
+        }
+        putString(b, " in ");
     }
-    return;
-    default:
-    fprintf(stderr, "[printTree] Invalid token type appeared in tree.\n");
-    exit(EXIT_FAILURE);
+    renderNode(b, n, v, &t);
+    freeSharedNodes(&t);
     }
+    if (b->size)
+    b->s[b->length] = '\0';
+}
+
+/**
+ * @brief Print the tree to a file
+ *
+ * The tree is rendered into a buffer on the stack, which is written out
+ * whenever it fills up, so printing doesn't allocate and a tree of a few
+ * thousand characters takes one write.
+ *
+ * @param fp output file
+ * @param n root of the tree
+ * @param v variable list
+ */
+void fprintTree(FILE *fp, Node *n, const VariableList *v)
+{
+    char s[4096];
+    PrintBuffer b;
+    initPrintBuffer(&b, s, sizeof(s), fp, 0);
+    renderTree(&b, n, v, 0);
+    flushPrintBuffer(&b);
+}
+
+/**
+ * @brief Print the tree
+ *
+ * @param n root of the tree
+ * @param v variable list
+ */
+void printTree(Node *n, const VariableList *v)
+{
+    fprintTree(stdout, n, v);
 }
 
 /**
  * @brief Copy the tree
  *
+ * If a node store is in use, nodes of the store are shared instead of copied,
+ * and other trees are interned into the store.
  * 
  * @param n root of the tree
  * @return Node* copied tree
@@ -919,7 +2191,10 @@ Node *copyTree(const Node *n)
 {
     if (!n)
     return NULL;
-    return createNode(n->token, copyTree(n->a), copyTree(n->b));
+    NodeStore *store = currentNodeStore();
+    if (store && isInterned(store, n))
+    return (Node *)n;
+    return walkTree(WALK_COPY, n, 0);
 }
 
 /**
@@ -927,7 +2202,11 @@ Node *copyTree(const Node *n)
  *
  * note: operator + * is commutative, so the order of a and b does not matter
  *
- * 
+ * Trees with different structural hashes are different, so most unequal
+ * trees are told apart at once. Otherwise the pairs of nodes still to be
+ * compared are kept on an explicit stack, so deep trees are compared without
+ * recursion; for + and *, only the order of the children whose hashes match
+ * is tried, so this takes linear time.
  * 
  * @param a root of the first tree
  * @param b root of the second tree
@@ -935,28 +2214,278 @@ Node *copyTree(const Node *n)
  */
 int compareTree(const Node *a, const Node *b)
 {
-    if (!a && !b)
+    /* shared subtree, always the case for equal trees in a node store */
+    if (a == b)
     return 1;
-    if (!a || !b)
-    return 0;
+    int equal = 1;
+    WalkStack w;
+    initWalk(&w);
+    pushFrame(&w, a, 0)->other = b;
+    while (equal && w.num)
+    {
+    WalkFrame *f = &w.frames[--w.num];
+    const Node *x = f->node, *y = f->other;
+    if (x == y)
+        continue;
+    if (!x || !y || x->hash != y->hash || x->token.type != y->token.type ||
+        x->token.value != y->token.value)
+        equal = 0;
+    else if (!x->a)
+        equal = !y->a;
+    else
+    {
+        const Node *ya = y->a, *yb = y->b;
+        /* operator + * commutative */
+        if (x->token.type == operator && (x->token.value == '+' || x->token.value == '*') &&
+            x->a->hash != ya->hash)
+        {
+            ya = y->b;
+            yb = y->a;
+        }
+        pushFrame(&w, x->b, 0)->other = yb;
+        pushFrame(&w, x->a, 0)->other = ya;
+    }
+    }
+    freeWalk(&w);
+    return equal;
+}
 
-    /* operator + commutative */
-    if (a->token.type == operator&& a->token.value == '+' &&
-                         b->token.type ==
-                         operator&& b->token.value == '+')
-    return (compareTree(a->a, b->a) && compareTree(a->b, b->b)) ||
-           (compareTree(a->a, b->b) && compareTree(a->b, b->a));
-
-    /* operator * commutative */
-    if (a->token.type == operator&& a->token.value == '*' &&
-                         b->token.type ==
-                         operator&& b->token.value == '*')
-    return (compareTree(a->a, b->a) && compareTree(a->b, b->b)) ||
-           (compareTree(a->a, b->b) && compareTree(a->b, b->a));
-
-    if (a->token.type != b->token.type || a->token.value != b->token.value)
-    return 0;
-    return compareTree(a->a, b->a) && compareTree(a->b, b->b);
+/**
+ * @brief Total order of trees for canonicalTree
+ *
+ * Trees are ordered by structural hash first, so the order is cheap to
+ * compute and only ties are walked, on an explicit stack in preorder.
+ *
+ * @param a root of the first tree
+ * @param b root of the second tree
+ * @return int negative, 0 or positive like strcmp
+ */
+static int orderTree(const Node *a, const Node *b)
+{
+    int ret = 0;
+    WalkStack w;
+    initWalk(&w);
+    pushFrame(&w, a, 0)->other = b;
+    while (!ret && w.num)
+    {
+        WalkFrame *f = &w.frames[--w.num];
+        const Node *x = f->node, *y = f->other;
+        if (x == y)
+            continue;
+        if (!x || !y)
+            ret = x ? 1 : -1;
+        else if (x->hash != y->hash)
+            ret = x->hash < y->hash ? -1 : 1;
+        else if (x->token.type != y->token.type)
+            ret = x->token.type < y->token.type ? -1 : 1;
+        else if (x->token.value != y->token.value)
+            ret = x->token.value < y->token.value ? -1 : 1;
+        else
+        {
+            pushFrame(&w, x->b, 0)->other = y->b;
+            pushFrame(&w, x->a, 0)->other = y->a;
+        }
+    }
+    freeWalk(&w);
+    return ret;
+}
+
+/**
+ * @brief orderTree for qsort on an array of nodes
+ *
+ * @param a first node
+ * @param b second node
+ * @return int order
+ */
+static int orderNodes(const void *a, const void *b)
+{
+    return orderTree(*(Node *const *)a, *(Node *const *)b);
+}
+
+/**
+ * @brief Frame of canonicalTree
+ *
+ * A chain of + or of * keeps its operands on the operand stack, from first
+ * on, and state counts the operands canonicalized. Other nodes keep their
+ * canonical children in a and b, and state counts the children visited.
+ */
+typedef struct canonical_frame CanonicalFrame;
+struct canonical_frame
+{
+    const Node *node;
+    Node *a, *b;
+    int first, num; /* operands of a chain */
+    int state;
+};
+
+/**
+ * @brief Stacks of canonicalTree
+ *
+ * The operands of the chains being canonicalized are stacked in operands,
+ * each chain above the chains it is nested in.
+ */
+typedef struct canonical_walk CanonicalWalk;
+struct canonical_walk
+{
+    CanonicalFrame *frames;
+    int num, size;
+    Node **operands;
+    int numOperands, operandSize;
+};
+
+/**
+ * @brief Grow an array of the walk to hold one more element
+ *
+ * @param array array to grow
+ * @param size current capacity, updated
+ * @param width size of an element
+ * @return void* reallocated array
+ */
+static void *growCanonical(void *array, int *size, size_t width)
+{
+    *size = *size ? *size * 2 : 64;
+    array = realloc(array, width * *size);
+    if (!array)
+    {
+        fprintf(stderr, "[canonicalTree] realloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
+
+static int isCommutative(const Node *n)
+{
+    return n->token.type == operator && (n->token.value == '+' || n->token.value == '*');
+}
+
+/**
+ * @brief Push the frame of a node, gathering its operands if it is a chain
+ *
+ * The operands are gathered in place: an operand which is the operator of
+ * the chain is replaced by its left child and its right child is appended.
+ *
+ * @param w walk
+ * @param n node
+ */
+static void pushCanonical(CanonicalWalk *w, const Node *n)
+{
+    if (w->num == w->size)
+        w->frames = (CanonicalFrame *)growCanonical(w->frames, &w->size, sizeof(CanonicalFrame));
+    CanonicalFrame *f = &w->frames[w->num++];
+    *f = (CanonicalFrame){n, NULL, NULL, w->numOperands, 0, 0};
+    if (!isCommutative(n))
+        return;
+    if (w->numOperands == w->operandSize)
+        w->operands = (Node **)growCanonical(w->operands, &w->operandSize, sizeof(Node *));
+    w->operands[w->numOperands++] = (Node *)n;
+    for (int i = f->first; i < w->numOperands;)
+    {
+        const Node *m = w->operands[i];
+        if (m->token.type != operator || m->token.value != n->token.value)
+        {
+            i++;
+            continue;
+        }
+        if (w->numOperands == w->operandSize)
+            w->operands = (Node **)growCanonical(w->operands, &w->operandSize, sizeof(Node *));
+        w->operands[i] = m->a;
+        w->operands[w->numOperands++] = m->b;
+    }
+    f->num = w->numOperands - f->first;
+}
+
+/**
+ * @brief Build the canonical node of a frame whose children are done
+ *
+ * @param w walk, the operands of a chain are popped
+ * @param f frame
+ * @return Node* canonical tree
+ */
+static Node *canonicalNode(CanonicalWalk *w, const CanonicalFrame *f)
+{
+    if (!isCommutative(f->node))
+        return createNode(f->node->token, f->a, f->b);
+    Node **operands = w->operands + f->first;
+    qsort(operands, f->num, sizeof(Node *), orderNodes);
+    Node *ret = operands[0];
+    for (int i = 1; i < f->num; i++)
+        ret = createNode(f->node->token, ret, operands[i]);
+    w->numOperands = f->first;
+    return ret;
+}
+
+/**
+ * @brief Canonicalize a tree
+ *
+ * The operands of each chain of + or of * are sorted and the chain is
+ * rebuilt from the left, so trees that only differ in the order or grouping
+ * of such operands, like (a+b)+c and c+(b+a), become identical. The order
+ * is arbitrary but fixed, so the result is meant for comparing and hashing
+ * rather than printing.
+ *
+ * The tree is walked on explicit stacks, so deep trees and long chains
+ * don't overflow the call stack. If a node store is in use, each node of the
+ * store is canonicalized only once.
+ *
+ * @param n root of the tree
+ * @return Node* canonical tree
+ */
+Node *canonicalTree(const Node *n)
+{
+    if (!n)
+        return NULL;
+    NodeStore *store = currentNodeStore();
+    if (store && isInterned(store, n) && storedCanonical(store, n))
+        return storedCanonical(store, n);
+    Node *ret = NULL;
+    CanonicalWalk w = {NULL, 0, 0, NULL, 0, 0};
+    pushCanonical(&w, n);
+    for (;;)
+    {
+        CanonicalFrame *f = &w.frames[w.num - 1];
+        const Node *child = NULL;
+        Node *result;
+        if (f->num ? f->state < f->num : f->state < 2)
+        {
+            /* canonicalize the next child, leaves and known nodes at once */
+            child = f->num ? w.operands[f->first + f->state]
+                           : f->state ? f->node->b : f->node->a;
+            if (!child)
+                result = NULL;
+            else if (store && isInterned(store, child) && storedCanonical(store, child))
+                result = storedCanonical(store, child);
+            else if (!child->a && !child->b)
+                result = createNode(child->token, NULL, NULL);
+            else
+            {
+                pushCanonical(&w, child);
+                continue;
+            }
+        }
+        else
+        {
+            result = canonicalNode(&w, f);
+            if (store && isInterned(store, f->node))
+                storeCanonical(store, f->node, result);
+            if (--w.num == 0)
+            {
+                ret = result;
+                break;
+            }
+            f = &w.frames[w.num - 1];
+        }
+        /* hand the result to the parent */
+        if (f->num)
+            w.operands[f->first + f->state] = result;
+        else if (f->state == 0)
+            f->a = result;
+        else
+            f->b = result;
+        f->state++;
+    }
+    free(w.frames);
+    free(w.operands);
+    return ret;
 }
 
 /**
@@ -964,18 +2493,37 @@ int compareTree(const Node *a, const Node *b)
  * 
  * This function will free the tree.
  * 
- * 
- * 
+ * Nodes of the node store or arena in use are owned by them, so they are
+ * left untouched.
  *
  * @param n root of the tree
  */
 void freeTree(Node *n)
 {
     if (!n)
-    return;
-    freeTree(n->a);
-    freeTree(n->b);
-    free(n);
+        return;
+    NodeStore *store = currentNodeStore();
+    if (store && isInterned(store, n))
+        return;
+    NodeArena *arena = currentNodeArena();
+    if (arena && inNodeArena(arena, n))
+        return;
+    WalkStack w;
+    initWalk(&w);
+    pushFrame(&w, n, 0);
+    while (w.num)
+    {
+        Node *m = (Node *)w.frames[--w.num].node;
+        if (!m || (store && isInterned(store, m)) || (arena && inNodeArena(arena, m)))
+            continue;
+        if (m->a)
+            pushFrame(&w, m->a, 0);
+        if (m->b)
+            pushFrame(&w, m->b, 0);
+        free(m);
+        METRICS_FREED(1, sizeof(Node));
+    }
+    freeWalk(&w);
 }
 
 /* Diff engine */
@@ -1011,9 +2559,11 @@ void freeTree(Node *n)
  * 
  * 
  * 
+ * If a node store is in use, the derivative of each node of the store is
+ * computed only once per variable and shared afterwards.
+ *
  * @param n root of the tree
  * @param thisVar variable to be differentiated
- * @param v variable list
  * @return Node* differentiated tree
  */
 Node *autoGrad(Node *n, const int thisVar)
@@ -1023,7 +2573,20 @@ Node *autoGrad(Node *n, const int thisVar)
     fprintf(stderr, "[autoGrad] null tree.\n");
     exit(EXIT_FAILURE);
     }
+    return walkTree(WALK_GRAD, n, thisVar);
+}
 
+/**
+ * @brief Apply the rule of autoGrad for the token of n
+ *
+ * @param n node
+ * @param da derivative of the left child
+ * @param db derivative of the right child
+ * @param thisVar variable to be differentiated
+ * @return Node* differentiated tree
+ */
+static Node *gradRule(const Node *n, Node *da, Node *db, const int thisVar)
+{
     switch (n->token.type)
     {
     case variable:
@@ -1041,29 +2604,29 @@ Node *autoGrad(Node *n, const int thisVar)
     {
     case '+':
         /* (a + b)' = a' + b' */
-            return createNode((Token){operator, '+'}, autoGrad(n->a, thisVar), autoGrad(n->b, thisVar));
+            return createNode((Token){operator, '+'}, da, db);
     case '-':
             /* (a - b)' = a' - b' */
-            return createNode((Token){operator, '-'}, autoGrad(n->a, thisVar), autoGrad(n->b, thisVar));
+            return createNode((Token){operator, '-'}, da, db);
     case '*':
             /* (a * b)' = a' * b + a * b' */
             return createNode((Token){operator, '+'},
                               createNode((Token){operator, '*'},
-                                         autoGrad(n->a, thisVar),
+                                         da,
                                          copyTree(n->b)),
                               createNode((Token){operator, '*'},
                                          copyTree(n->a),
-                                         autoGrad(n->b, thisVar)));
+                                         db));
     case '/':
             /* (a / b)' = (a' * b - a * b') / b^2 */
             return createNode((Token){operator, '/'},
                               createNode((Token){operator, '-'},
                                          createNode((Token){operator, '*'},
-                                                    autoGrad(n->a, thisVar),
+                                                    da,
                                                     copyTree(n->b)),
                                          createNode((Token){operator, '*'},
                                                     copyTree(n->a),
-                                                    autoGrad(n->b, thisVar))),
+                                                    db)),
                               createNode((Token){operator, '^'},
                                          copyTree(n->b),
                                          createNode((Token){digit, 2}, NULL, NULL)));
@@ -1073,12 +2636,12 @@ Node *autoGrad(Node *n, const int thisVar)
                               copyTree(n),
                               createNode((Token){operator, '+'},
                                           createNode((Token){operator, '*'},
-                                                      autoGrad(n->a, thisVar),
+                                                      da,
                                                       createNode((Token){operator, '/'},
                                                                  copyTree(n->b),
                                                                  copyTree(n->a))),
                                           createNode((Token){operator, '*'},
-                                                      autoGrad(n->b, thisVar),
+                                                      db,
                                                       createNode((Token){fun1, 0},
                                                                  copyTree(n->a),
                                                                  NULL))));
@@ -1090,7 +2653,7 @@ Node *autoGrad(Node *n, const int thisVar)
     case 0:
             /* sin(a)' = a' * cos(a) */
             return createNode((Token){operator, '*'},
-                autoGrad(n->a, thisVar),
+                da,
                 createNode((Token){operator, '/'},
                     createNode((Token){digit, 1}, NULL, NULL),
                     copyTree(n->a)));
@@ -1099,24 +2662,24 @@ Node *autoGrad(Node *n, const int thisVar)
             return createNode((Token){operator, '*'},
                               createNode((Token){digit, -1}, NULL, NULL),
                               createNode((Token){operator, '*'},
-                                         autoGrad(n->a, thisVar),
+                                         da,
                                          createNode((Token){fun1, 2}, copyTree(n->a), NULL)));
     case 2:
             /* tan(a)' = a' / cos(a)^2 */
             return createNode((Token){operator, '*'},
-                              autoGrad(n->a, thisVar),
+                              da,
                               createNode((Token){fun1, 1}, copyTree(n->a), NULL));
     case 3:
             /* cot(a)' = -a' / sin(a)^2 */
             return createNode((Token){operator, '/'},
-                              autoGrad(n->a, thisVar),
+                              da,
                               createNode((Token){operator, '^'},
                                          createNode((Token){fun1, 1}, copyTree(n->a), NULL),
                                          createNode((Token){digit, 2}, NULL, NULL)));
     case 4:
             /* ln(a)' = a' / a */
             return createNode((Token){operator, '*'},
-                              autoGrad(n->a, thisVar),
+                              da,
                               createNode((Token){fun1, 4}, copyTree(n->a), NULL));
     }
     break;
@@ -1128,14 +2691,14 @@ Node *autoGrad(Node *n, const int thisVar)
             return createNode((Token){operator, '/'},
                               createNode((Token){operator, '-'},
                                          createNode((Token){operator, '*'},
-                                                    autoGrad(n->b, thisVar),
+                                                    db,
                                                     createNode((Token){operator, '/'},
                                                                createNode((Token){fun1, 0},
                                                                           copyTree(n->a),
                                                                           NULL),
                                                                copyTree(n->b))),
                                          createNode((Token){operator, '*'},
-                                                    autoGrad(n->a, thisVar),
+                                                    da,
                                                     createNode((Token){operator, '/'},
                                                                createNode((Token){fun1, 0},
                                                                           copyTree(n->b),
@@ -1152,12 +2715,12 @@ Node *autoGrad(Node *n, const int thisVar)
                               copyTree(n),
                               createNode((Token){operator, '+'},
                                           createNode((Token){operator, '*'},
-                                                      autoGrad(n->a, thisVar),
+                                                      da,
                                                       createNode((Token){operator, '/'},
                                                                  copyTree(n->b),
                                                                  copyTree(n->a))),
                                           createNode((Token){operator, '*'},
-                                                      autoGrad(n->b, thisVar),
+                                                      db,
                                                       createNode((Token){fun1, 0},
                                                                  copyTree(n->a),
                                                                  NULL))));
@@ -1193,6 +2756,8 @@ Node *autoGrad(Node *n, const int thisVar)
  * 
  * 
  * 
+ * If a node store is in use, each node of the store is optimized only once.
+ *
  * @param n root of the tree
  * @return Node* optimized tree
  */
@@ -1200,18 +2765,25 @@ Node *constantOptimizer(const Node *n)
 {
     if (!n)
     return NULL;
+    return walkTree(WALK_OPTIMIZE, n, 0);
+}
+
+/**
+ * @brief Apply the rules of constantOptimizer for the token of n
+ *
+ * @param n node
+ * @param a optimized left child
+ * @param b optimized right child
+ * @return Node* optimized tree
+ */
+static Node *optimizeRule(const Node *n, Node *a, Node *b)
+{
     if (n->token.type != operator&& n->token.type != fun1 &&
                          n->token.type != fun2)
     {
     return copyTree(n);
     }
 
-    Node *a = NULL, *b = NULL;
-    if (n->a)
-    a = constantOptimizer(n->a);
-    if (n->b)
-    b = constantOptimizer(n->b);
-
     switch (n->token.type)
     {
     /* operator constant optimizer */
@@ -1300,7 +2872,7 @@ Node *constantOptimizer(const Node *n)
             /* compute two constant */
             if (a->token.type == digit && b->token.type == digit)
             {
-        if (a->token.value % b->token.value == 0)
+        if (b->token.value && a->token.value % b->token.value == 0)
             return createNode((Token){digit, a->token.value / b->token.value},
                               NULL, NULL);
         return createNode(n->token, a, b);
@@ -1509,3 +3081,589 @@ Node *constantOptimizer(const Node *n)
     fprintf(stderr, "[constantOptimizer] Program error.\n");
     exit(EXIT_FAILURE);
 }
+
+/* Collector */
+
+/**
+ * @brief Term of a sum (coef * node) or factor of a product (node ^ coef)
+ *
+ * The nodes are borrowed from collected subtrees.
+ */
+typedef struct collect_item CollectItem;
+struct collect_item
+{
+    int coef;
+    const Node *node;
+};
+
+/**
+ * @brief Terms or factors gathered by collectOptimizer
+ *
+ * owned holds the collected subtrees the items point into, freed once the
+ * result has been built.
+ */
+typedef struct collect_list CollectList;
+struct collect_list
+{
+    CollectItem *items;
+    int num, size;
+    int *index; /* open addressing table of item numbers + 1, by node hash */
+    int buckets; /* power of 2 */
+    Node **owned;
+    int numOwned, ownedSize;
+    int constant; /* constant term of a sum, numerator coefficient of a product */
+    int denominator; /* denominator coefficient of a product */
+    int overflow;    /* 1 if a coefficient overflowed, the node is kept as it is */
+};
+
+/**
+ * @brief Grow an array to hold one more element
+ *
+ * @param array array to grow
+ * @param size current capacity, updated
+ * @param width size of an element
+ * @return void* reallocated array
+ */
+static void *growArray(void *array, int *size, size_t width)
+{
+    *size = *size ? *size * 2 : 8;
+    array = realloc(array, width * *size);
+    if (!array)
+    {
+        fprintf(stderr, "[collectOptimizer] realloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
+
+/**
+ * @brief Multiply coefficients
+ *
+ * INT_MIN counts as an overflow too, so coefficients can always be negated.
+ *
+ * @param l list, marked on overflow
+ * @param a first factor
+ * @param b second factor
+ * @return int product
+ */
+static int mulCoef(CollectList *l, int a, int b)
+{
+    int ret;
+    if (__builtin_mul_overflow(a, b, &ret) || ret == INT_MIN)
+    l->overflow = 1;
+    return ret;
+}
+
+/**
+ * @brief Add coefficients
+ *
+ * @param l list, marked on overflow
+ * @param a first term
+ * @param b second term
+ * @return int sum
+ */
+static int addCoef(CollectList *l, int a, int b)
+{
+    int ret;
+    if (__builtin_add_overflow(a, b, &ret) || ret == INT_MIN)
+    l->overflow = 1;
+    return ret;
+}
+
+/**
+ * @brief Find the slot of the item of an equal node
+ *
+ * Nodes are looked up by structural hash, so equal terms are found without
+ * comparing the new node to every item.
+ *
+ * @param l list
+ * @param node term or base
+ * @return int* slot holding the item number + 1, or an empty slot (0)
+ */
+static int *findItem(const CollectList *l, const Node *node)
+{
+    unsigned mask = l->buckets - 1;
+    for (unsigned i = node->hash & mask;; i = (i + 1) & mask)
+    {
+    int k = l->index[i];
+    if (!k || compareTree(l->items[k - 1].node, node))
+        return &l->index[i];
+    }
+}
+
+/**
+ * @brief Double the index of the items
+ *
+ * @param l list
+ */
+static void indexItems(CollectList *l)
+{
+    l->buckets = l->buckets ? l->buckets * 2 : 16;
+    free(l->index);
+    l->index = (int *)calloc(l->buckets, sizeof(int));
+    if (!l->index)
+    {
+    fprintf(stderr, "[collectOptimizer] calloc failed.\n");
+    exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < l->num; i++)
+    *findItem(l, l->items[i].node) = i + 1;
+}
+
+/**
+ * @brief Add coef to the item of an equal node, or append a new item
+ *
+ * @param l list
+ * @param coef coefficient or exponent
+ * @param node term or base
+ */
+static void addItem(CollectList *l, int coef, const Node *node)
+{
+    if (l->num * 2 >= l->buckets)
+    indexItems(l);
+    int *slot = findItem(l, node);
+    if (*slot)
+    {
+    CollectItem *item = &l->items[*slot - 1];
+    item->coef = addCoef(l, item->coef, coef);
+    return;
+    }
+    if (l->num == l->size)
+    l->items = (CollectItem *)growArray(l->items, &l->size, sizeof(CollectItem));
+    l->items[l->num++] = (CollectItem){coef, node};
+    *slot = l->num;
+}
+
+/**
+ * @brief Keep a collected leaf of a sum or product chain until the result
+ * has been built
+ *
+ * @param l list owning the leaf
+ * @param n collected leaf
+ */
+static void ownLeaf(CollectList *l, Node *n)
+{
+    if (l->numOwned == l->ownedSize)
+    l->owned = (Node **)growArray(l->owned, &l->ownedSize, sizeof(Node *));
+    l->owned[l->numOwned++] = n;
+}
+
+/**
+ * @brief Check for an operator node
+ *
+ * @param n node
+ * @param op operator character
+ * @return int 1 if n is the operator op
+ */
+static int isOperator(const Node *n, int op)
+{
+    return n->token.type == operator && n->token.value == op;
+}
+
+/**
+ * @brief Chain a node belongs to
+ *
+ * @param n node
+ * @return int '+' for + and -, '*' for * and /, 0 otherwise
+ */
+static int chainOf(const Node *n)
+{
+    if (isOperator(n, '+') || isOperator(n, '-'))
+    return '+';
+    if (isOperator(n, '*') || isOperator(n, '/'))
+    return '*';
+    return 0;
+}
+
+/**
+ * @brief Add a collected term of a chain of + and -
+ *
+ * @param l list of terms
+ * @param n term
+ * @param sign 1 or -1
+ */
+static void addTerm(CollectList *l, const Node *n, int sign)
+{
+    /* c, c*f(x) */
+    if (n->token.type == digit)
+    l->constant = addCoef(l, l->constant, mulCoef(l, sign, n->token.value));
+    else if (isOperator(n, '*') && n->a->token.type == digit)
+    addItem(l, mulCoef(l, sign, n->a->token.value), n->b);
+    else
+    addItem(l, sign, n);
+}
+
+/**
+ * @brief Add a collected factor of a chain of * and /
+ *
+ * Constants are multiplied into the coefficients, f(x)^c adds c to the
+ * exponent of f(x), and factors of the divisor count negatively.
+ *
+ * @param l list of factors
+ * @param n factor
+ * @param side 1 for the dividend, -1 for the divisor
+ */
+static void addFactor(CollectList *l, const Node *n, int side)
+{
+    /* f(x)/0 is kept as it is */
+    if (n->token.type == digit && (side > 0 || n->token.value != 0))
+    {
+    if (side > 0)
+        l->constant = mulCoef(l, l->constant, n->token.value);
+    else
+        l->denominator = mulCoef(l, l->denominator, n->token.value);
+    }
+    else if (isOperator(n, '^') && n->b->token.type == digit)
+    addItem(l, mulCoef(l, side, n->b->token.value), n->a);
+    else
+    addItem(l, side, n);
+}
+
+/**
+ * @brief Free the buffers of a list and the subtrees it owns
+ *
+ * @param l list
+ */
+static void freeCollectList(CollectList *l)
+{
+    for (int i = 0; i < l->numOwned; i++)
+    freeTree(l->owned[i]);
+    free(l->owned);
+    free(l->items);
+    free(l->index);
+}
+
+/**
+ * @brief Create a constant node
+ *
+ * @param value constant
+ * @return Node* new node
+ */
+static Node *digitNode(int value)
+{
+    return createNode((Token){digit, value}, NULL, NULL);
+}
+
+/**
+ * @brief Build a sum from gathered terms
+ *
+ * Terms are kept in the order they first appeared, the constant goes last.
+ * Negative coefficients become subtractions.
+ *
+ * @param l list of terms
+ * @return Node* sum
+ */
+static Node *buildSum(const CollectList *l)
+{
+    Node *ret = NULL;
+    for (int i = 0; i < l->num; i++)
+    {
+    int coef = l->items[i].coef;
+    if (coef == 0)
+        continue;
+    Node *term = copyTree(l->items[i].node);
+    if (!ret)
+    {
+        ret = coef == 1 ? term : createNode((Token){operator, '*'}, digitNode(coef), term);
+        continue;
+    }
+    int abs = coef < 0 ? -coef : coef;
+    if (abs != 1)
+        term = createNode((Token){operator, '*'}, digitNode(abs), term);
+    ret = createNode((Token){operator, coef < 0 ? '-' : '+'}, ret, term);
+    }
+    if (!ret)
+    return digitNode(l->constant);
+    if (l->constant)
+    ret = createNode((Token){operator, l->constant < 0 ? '-' : '+'}, ret,
+                     digitNode(l->constant < 0 ? -l->constant : l->constant));
+    return ret;
+}
+
+/**
+ * @brief Multiply the factors of one side of a product
+ *
+ * @param l list of factors
+ * @param side 1 for positive exponents, -1 for negative ones
+ * @return Node* product, NULL if there is no factor
+ */
+static Node *buildFactors(const CollectList *l, int side)
+{
+    Node *ret = NULL;
+    for (int i = 0; i < l->num; i++)
+    {
+    int exponent = side * l->items[i].coef;
+    if (exponent <= 0)
+        continue;
+    Node *factor = copyTree(l->items[i].node);
+    if (exponent != 1)
+        factor = createNode((Token){operator, '^'}, factor, digitNode(exponent));
+    ret = ret ? createNode((Token){operator, '*'}, ret, factor) : factor;
+    }
+    return ret;
+}
+
+/**
+ * @brief Greatest common divisor
+ *
+ * @param a first number
+ * @param b second number, not 0
+ * @return int gcd, positive
+ */
+static int gcd(int a, int b)
+{
+    while (b)
+    {
+    int t = a % b;
+    a = b;
+    b = t;
+    }
+    return a < 0 ? -a : a;
+}
+
+/**
+ * @brief Build a product from gathered factors
+ *
+ * The result is c*(f/g), c*f or f/g, so a product used as a term of a sum
+ * shows its coefficient.
+ *
+ * @param l list of factors
+ * @return Node* product
+ */
+static Node *buildProduct(CollectList *l)
+{
+    if (l->constant == 0)
+    return digitNode(0);
+    int divisor = gcd(l->constant, l->denominator);
+    l->constant /= divisor;
+    l->denominator /= divisor;
+    if (l->denominator < 0)
+    {
+    l->constant = -l->constant;
+    l->denominator = -l->denominator;
+    }
+
+    Node *num = buildFactors(l, 1);
+    Node *den = buildFactors(l, -1);
+    if (l->denominator != 1)
+    den = den ? createNode((Token){operator, '*'}, digitNode(l->denominator), den)
+              : digitNode(l->denominator);
+    if (!num)
+    {
+    Node *ret = digitNode(l->constant);
+    return den ? createNode((Token){operator, '/'}, ret, den) : ret;
+    }
+    if (den)
+    num = createNode((Token){operator, '/'}, num, den);
+    return l->constant == 1 ? num
+                            : createNode((Token){operator, '*'}, digitNode(l->constant), num);
+}
+
+/**
+ * @brief Part of a chain still to be gathered by collectOptimizer
+ */
+typedef struct collect_part CollectPart;
+struct collect_part
+{
+    const Node *node;
+    int sign;      /* sign of a term, or side of a factor */
+    int collected; /* 1 if node is already collected */
+};
+
+/**
+ * @brief Frame of collectOptimizer
+ *
+ * A chain gathers its terms or factors into l, taking its parts from the
+ * part stack down to first; sign is the sign of the leaf being collected.
+ * Other nodes keep their collected children in a and b, and state counts
+ * the children visited.
+ */
+typedef struct collect_frame CollectFrame;
+struct collect_frame
+{
+    const Node *node;
+    Node *a, *b;
+    int chain; /* chainOf(node) */
+    CollectList l;
+    int first, sign;
+    int state;
+};
+
+/**
+ * @brief Stacks of collectOptimizer
+ */
+typedef struct collect_walk CollectWalk;
+struct collect_walk
+{
+    CollectFrame *frames;
+    int num, size;
+    CollectPart *parts;
+    int numParts, partSize;
+};
+
+static void pushPart(CollectWalk *w, const Node *n, int sign, int collected)
+{
+    if (w->numParts == w->partSize)
+    w->parts = (CollectPart *)growArray(w->parts, &w->partSize, sizeof(CollectPart));
+    w->parts[w->numParts++] = (CollectPart){n, sign, collected};
+}
+
+static void pushCollect(CollectWalk *w, const Node *n)
+{
+    if (w->num == w->size)
+    w->frames = (CollectFrame *)growArray(w->frames, &w->size, sizeof(CollectFrame));
+    CollectFrame *f = &w->frames[w->num++];
+    *f = (CollectFrame){n, NULL, NULL, chainOf(n), {NULL, 0, 0, NULL, 0, NULL, 0, 0, 0, 1, 0},
+                        w->numParts, 0, 0};
+    if (f->chain == '*')
+    f->l.constant = 1;
+    if (f->chain)
+    pushPart(w, n, 1, 0);
+}
+
+/**
+ * @brief Collected tree of a leaf or of a node collected before
+ *
+ * @param store node store in use, NULL if none
+ * @param n node
+ * @return Node* collected tree, NULL if n must be walked
+ */
+static Node *knownCollected(NodeStore *store, const Node *n)
+{
+    if (n->token.type != operator && n->token.type != fun1 && n->token.type != fun2)
+    return copyTree(n);
+    return store && isInterned(store, n) ? storedCollected(store, n) : NULL;
+}
+
+/**
+ * @brief Hand a collected leaf to its chain
+ *
+ * A leaf that becomes a chain of the same kind is gathered further.
+ *
+ * @param w walk
+ * @param f frame of the chain
+ * @param n collected leaf
+ */
+static void takeLeaf(CollectWalk *w, CollectFrame *f, Node *n)
+{
+    ownLeaf(&f->l, n);
+    if (chainOf(n) == f->chain)
+    pushPart(w, n, f->sign, 1);
+    else if (f->chain == '+')
+    addTerm(&f->l, n, f->sign);
+    else
+    addFactor(&f->l, n, f->sign);
+}
+
+/**
+ * @brief Collect optimizer
+ *
+ * This function will collect like terms and powers:
+ *
+ * 1. x*2+x*3 = 5*x, x-x = 0
+ * 2. x*x*2 = 2*x^2, x^2/x = x, 4*x/6 = 2*x/3
+ *
+ * A whole chain of + and -, or of * and /, is flattened and rebuilt at once.
+ * The leaves of the chain are collected first; a leaf that becomes a chain
+ * of the same kind is gathered further. Each leaf is collected once and
+ * equal subtrees are found by structural hash and compareTree, so a long
+ * chain takes expected linear time. A chain whose coefficients would
+ * overflow an int is left as it is. Constants are not folded inside other
+ * operators; use it together with constantOptimizer (see rewrite.h).
+ *
+ * The tree is walked on explicit stacks, so deep trees and long chains
+ * don't overflow the call stack. If a node store is in use, each node of the
+ * store is collected only once.
+ *
+ * @param n root of the tree
+ * @return Node* collected tree
+ */
+Node *collectOptimizer(const Node *n)
+{
+    if (!n)
+    return NULL;
+    NodeStore *store = currentNodeStore();
+    Node *ret = knownCollected(store, n);
+    if (ret)
+    return ret;
+    CollectWalk w = {NULL, 0, 0, NULL, 0, 0};
+    pushCollect(&w, n);
+    for (;;)
+    {
+    CollectFrame *f = &w.frames[w.num - 1];
+    Node *result;
+    if (f->chain && w.numParts > f->first)
+    {
+        CollectPart part = w.parts[--w.numParts];
+        const Node *m = part.node;
+        if (chainOf(m) == f->chain)
+        {
+            /* the left part is gathered first, so the terms keep their order */
+            int inverse = isOperator(m, '-') || isOperator(m, '/');
+            pushPart(&w, m->b, inverse ? -part.sign : part.sign, part.collected);
+            pushPart(&w, m->a, part.sign, part.collected);
+        }
+        else if (part.collected)
+        {
+            if (f->chain == '+')
+                addTerm(&f->l, m, part.sign);
+            else
+                addFactor(&f->l, m, part.sign);
+        }
+        else
+        {
+            f->sign = part.sign;
+            result = knownCollected(store, m);
+            if (result)
+                takeLeaf(&w, f, result);
+            else
+                pushCollect(&w, m);
+        }
+        continue;
+    }
+    if (!f->chain && f->state < 2)
+    {
+        /* collect the next child, leaves and known nodes at once */
+        const Node *child = f->state ? f->node->b : f->node->a;
+        result = child ? knownCollected(store, child) : NULL;
+        if (child && !result)
+        {
+            pushCollect(&w, child);
+            continue;
+        }
+        if (f->state++)
+            f->b = result;
+        else
+            f->a = result;
+        continue;
+    }
+    if (!f->chain)
+        result = createNode(f->node->token, f->a, f->b);
+    else
+    {
+        if (f->l.overflow)
+            result = copyTree(f->node);
+        else
+            result = f->chain == '+' ? buildSum(&f->l) : buildProduct(&f->l);
+        freeCollectList(&f->l);
+    }
+    if (store && isInterned(store, f->node))
+        storeCollected(store, f->node, result);
+    if (--w.num == 0)
+    {
+        ret = result;
+        break;
+    }
+    /* hand the result to the parent */
+    f = &w.frames[w.num - 1];
+    if (f->chain)
+        takeLeaf(&w, f, result);
+    else if (f->state++)
+        f->b = result;
+    else
+        f->a = result;
+    }
+    free(w.frames);
+    free(w.parts);
+    return ret;
+}
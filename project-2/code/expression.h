@@ -7,6 +7,8 @@
 #ifndef _EXPRESSION_H_
 #define _EXPRESSION_H_
 
+#include <stdio.h>
+
 /**
  * @brief Predefined function names.
  *
@@ -54,6 +56,10 @@ void freeString(String *s);
  * @brief Variable list type.
  *
  * Used to store the variables in the expression.
+ *
+ * table is an open-addressing hash table of the indices of the variables,
+ * -1 for empty slots. dictOrder is only sorted by sortVariableList, which
+ * tokenize calls once all the variables are known.
  */
 typedef struct variable_list VariableList;
 struct variable_list
@@ -61,6 +67,8 @@ struct variable_list
     char **s;
     int *dictOrder;
     int size, top;
+    int *table;
+    int buckets; /* power of 2 */
 };
 /**
  * @defgroup variable_list Variable list functions
@@ -73,7 +81,10 @@ struct variable_list
 VariableList *createVariableList(void);
 int querySymbol(const VariableList *s, char *symbol);
 int addSymbol(VariableList *s, char *symbol);
+int internSymbol(VariableList *s, const char *symbol, int len);
+void sortVariableList(VariableList *s);
 void printVariableList(const VariableList *s);
+void clearVariableList(VariableList *s);
 void freeVariableList(VariableList *s);
 /** @} */
 
@@ -104,13 +115,37 @@ void printTokens(Token *t, int num, const VariableList *v);
  * @brief Node type.
  *
  * Used to store the expression in the form of a tree.
+ *
+ * hash is the structural hash of the subtree, set when the node is created
+ * (see structuralHash). Nodes must not be changed after they are created.
  */
 typedef struct node Node;
 struct node
 {
     Token token;
     Node *a, *b;
+    unsigned hash;
 };
+
+/**
+ * @brief Output buffer of the printer.
+ *
+ * The text of a tree is rendered into s. When s fills up, it is written to
+ * fp if there is one, grown if the printer owns it, and otherwise the text
+ * is truncated. At most limit characters of a tree are rendered, 0 for no
+ * limit; the text of a truncated tree ends with "..." and truncated is set.
+ */
+typedef struct print_buffer PrintBuffer;
+struct print_buffer
+{
+    char *s;
+    size_t length, size;
+    FILE *fp;
+    int owned;
+    size_t limit, total; /* total: characters of the current tree */
+    int truncated;
+};
+
 /**
  * @defgroup node Node functions
  *
@@ -119,9 +154,17 @@ struct node
  * @{
  */
 Node *createNode(Token t, Node *a, Node *b);
+unsigned structuralHash(Token t, const Node *a, const Node *b);
+unsigned combineHash(Token t, unsigned ha, unsigned hb);
 void printTree(Node *n, const VariableList *v);
+void fprintTree(FILE *fp, Node *n, const VariableList *v);
+void initPrintBuffer(PrintBuffer *b, char *s, size_t size, FILE *fp, size_t limit);
+void renderTree(PrintBuffer *b, const Node *n, const VariableList *v, int let);
+void flushPrintBuffer(PrintBuffer *b);
+void freePrintBuffer(PrintBuffer *b);
 Node *copyTree(const Node *n);
 int compareTree(const Node *a, const Node *b);
+Node *canonicalTree(const Node *n);
 void freeTree(Node *n);
 /** @} */
 
@@ -134,7 +177,10 @@ void freeTree(Node *n);
  * @{
  */
 int isBracketPaired(Token *t, int start, int end);
+Token *tokenize(String *s, VariableList *list, int *num);
 Node *parser(String *s, VariableList *list);
+Node *tryParser(String *s, VariableList *list, char *error, size_t size);
+Node *linearParser(Token *t, int num);
 Node *exprParser(Token *t, int start, int end);
 Node *termParser(Token *t, int start, int end);
 Node *powParser(Token *t, int start, int end);
@@ -151,7 +197,7 @@ Node *factorParser(Token *t, int start, int end);
  */
 Node *autoGrad(Node *n, const int thisVar);
 Node *constantOptimizer(const Node *n);
+Node *collectOptimizer(const Node *n);
 /** @} */
-// Node *collectOptimizer(Node *n); /* not implemented */
 
 #endif
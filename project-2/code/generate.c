@@ -0,0 +1,267 @@
+#include "generate.h"
+#include "expression.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *shapeNames[NUM_SHAPES] = {"chain", "balanced", "random", "nested"};
+
+/**
+ * @brief State of one generation
+ */
+typedef struct generator Generator;
+struct generator
+{
+    const GeneratorOptions *o;
+    unsigned long long state; /* xorshift64*, never 0 */
+    char *s;
+    int length, size;
+};
+
+/**
+ * @brief Get the default options: 1024 leaves of 3 variables in a random
+ * shape, nested at most 8 levels, 10% functions and 20% constants, seed 1
+ *
+ * @return GeneratorOptions default options
+ */
+GeneratorOptions defaultGeneratorOptions(void)
+{
+    return (GeneratorOptions){1024, 8, 3, 10, 20, SHAPE_RANDOM, 1};
+}
+
+static unsigned long long nextRandom(Generator *g)
+{
+    g->state ^= g->state >> 12;
+    g->state ^= g->state << 25;
+    g->state ^= g->state >> 27;
+    return g->state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * @brief Get a random number
+ *
+ * @param g generator
+ * @param n bound, positive
+ * @return int random number from 0 to n - 1
+ */
+static int randomBelow(Generator *g, int n)
+{
+    return (int)((nextRandom(g) >> 33) % (unsigned)n);
+}
+
+static int chance(Generator *g, int percent)
+{
+    return randomBelow(g, 100) < percent;
+}
+
+static void put(Generator *g, const char *s)
+{
+    while (*s)
+    {
+        if (g->length + 1 >= g->size)
+        {
+            g->size *= 2;
+            g->s = (char *)realloc(g->s, g->size);
+            if (!g->s)
+            {
+                fprintf(stderr, "[generateExpression] malloc failed.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        g->s[g->length++] = *s++;
+    }
+}
+
+/**
+ * @brief Write the name of a variable: a to z, then va, vb, ..., vz, vba, ...
+ *
+ * No name is a function name.
+ *
+ * @param g generator
+ * @param var variable
+ */
+static void putVariable(Generator *g, int var)
+{
+    char name[16];
+    int i = sizeof(name) - 1;
+    name[i] = '\0';
+    if (var < 26)
+        name[--i] = 'a' + var;
+    else
+    {
+        var -= 26;
+        do
+        {
+            name[--i] = 'a' + var % 26;
+            var /= 26;
+        } while (var);
+        name[--i] = 'v';
+    }
+    put(g, name + i);
+}
+
+static void putLeaf(Generator *g)
+{
+    static const char *digits[] = {"1", "2", "3", "4", "5", "6", "7", "8", "9"};
+    if (chance(g, g->o->constants))
+        put(g, digits[randomBelow(g, 9)]);
+    else
+        putVariable(g, randomBelow(g, g->o->vars));
+}
+
+/**
+ * @brief Write two leaves joined by an operator
+ *
+ * @param g generator
+ * @param ops operators to pick from
+ */
+static void putLeaves(Generator *g, const char *ops)
+{
+    char op[2] = {ops[randomBelow(g, (int)strlen(ops))], '\0'};
+    putLeaf(g);
+    put(g, op);
+    if (op[0] == '/')
+        putVariable(g, randomBelow(g, g->o->vars));
+    else if (op[0] == '^')
+        put(g, randomBelow(g, 2) ? "2" : "3");
+    else
+        putLeaf(g);
+}
+
+/**
+ * @brief Write a term of a chain
+ *
+ * @param g generator
+ * @param leaves 1 or 2
+ */
+static void putTerm(Generator *g, int leaves)
+{
+    int fun = chance(g, g->o->functions);
+    if (fun && leaves == 2 && randomBelow(g, 2))
+    {
+        put(g, fun2s[randomBelow(g, NUM_FUN2)]);
+        put(g, "(");
+        putLeaf(g);
+        put(g, ",");
+        putLeaf(g);
+        put(g, ")");
+        return;
+    }
+    if (fun)
+    {
+        put(g, fun1s[randomBelow(g, NUM_FUN1)]);
+        put(g, "(");
+    }
+    if (leaves == 2)
+        putLeaves(g, "*/^");
+    else
+        putLeaf(g);
+    if (fun)
+        put(g, ")");
+}
+
+/**
+ * @brief Write a subexpression of a balanced or random expression
+ *
+ * @param g generator
+ * @param leaves number of leaves, positive
+ * @param depth nesting of brackets and functions left
+ * @param wrap 0 if the subexpression is already the argument of a fun1
+ */
+static void putSubexpression(Generator *g, int leaves, int depth, int wrap)
+{
+    int balanced = g->o->shape == SHAPE_BALANCED;
+    if (wrap && depth > 0 && chance(g, g->o->functions))
+    {
+        if (leaves >= 2 && randomBelow(g, 2))
+        {
+            int k = balanced ? leaves / 2 : 1 + randomBelow(g, leaves - 1);
+            put(g, fun2s[randomBelow(g, NUM_FUN2)]);
+            put(g, "(");
+            putSubexpression(g, k, depth - 1, 1);
+            put(g, ",");
+            putSubexpression(g, leaves - k, depth - 1, 1);
+        }
+        else
+        {
+            put(g, fun1s[randomBelow(g, NUM_FUN1)]);
+            put(g, "(");
+            putSubexpression(g, leaves, depth - 1, 0);
+        }
+        put(g, ")");
+        return;
+    }
+    if (leaves == 1)
+    {
+        putLeaf(g);
+        return;
+    }
+    int bracket = balanced || (depth > 0 && randomBelow(g, 2));
+    if (bracket)
+    {
+        put(g, "(");
+        depth--;
+    }
+    if (leaves == 2)
+        putLeaves(g, "+-*/^");
+    else
+    {
+        static const char *ops[] = {"+", "-", "*"};
+        int k = balanced ? leaves / 2 : 1 + randomBelow(g, leaves - 1);
+        putSubexpression(g, k, depth, 1);
+        put(g, ops[randomBelow(g, 3)]);
+        putSubexpression(g, leaves - k, depth, 1);
+    }
+    if (bracket)
+        put(g, ")");
+}
+
+/**
+ * @brief Generate a random expression
+ *
+ * @param o options
+ * @param length length of the expression, may be NULL
+ * @return char* expression, to be freed by the caller
+ */
+char *generateExpression(const GeneratorOptions *o, int *length)
+{
+    Generator g = {o, 0, (char *)malloc(64), 0, 64};
+    if (!g.s)
+    {
+        fprintf(stderr, "[generateExpression] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    /* splitmix64, so nearby seeds give unrelated states */
+    unsigned long long z = o->seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    g.state = (z ^ (z >> 31)) | 1;
+
+    int leaves = o->leaves > 0 ? o->leaves : 1;
+    if (o->shape == SHAPE_CHAIN || o->shape == SHAPE_NESTED)
+    {
+        int brackets = 0;
+        for (int i = 0; i < leaves;)
+        {
+            int n = leaves - i >= 2 && randomBelow(&g, 2) ? 2 : 1;
+            if (i)
+                put(&g, randomBelow(&g, 2) ? "+" : "-");
+            if (i && o->shape == SHAPE_NESTED && i + n < leaves)
+            {
+                put(&g, "(");
+                brackets++;
+            }
+            putTerm(&g, n);
+            i += n;
+        }
+        while (brackets--)
+            put(&g, ")");
+    }
+    else
+        putSubexpression(&g, leaves, o->shape == SHAPE_RANDOM ? o->depth : INT_MAX, 1);
+    g.s[g.length] = '\0';
+    if (length)
+        *length = g.length;
+    return g.s;
+}
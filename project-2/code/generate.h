@@ -0,0 +1,64 @@
+/**
+ * @file generate.h
+ * @brief Seeded random expression generator.
+ *
+ * The generator writes expressions of a given number of leaves (variables
+ * and constants) in one of four shapes:
+ *
+ * - chain: terms joined by + and -, a tree as deep as the number of terms.
+ *   A term is a leaf, a short product, quotient or power of leaves, or a
+ *   function of them.
+ * - nested: the terms of a chain, each but the first with the rest of the
+ *   chain in brackets after it, so the parser nests as deep as the tree.
+ * - balanced: a tree split in halves down to the leaves, as deep as log2 of
+ *   the number of leaves, plus the functions.
+ * - random: halves of random sizes with + - * at random, and brackets and
+ *   functions nested at most depth levels.
+ *
+ * The right operand of / is always a variable and that of ^ a constant 2 or 3,
+ * so folding the constants never divides by zero or overflows. The same
+ * options and seed give the same expression on every platform.
+ */
+#ifndef _GENERATE_H_
+#define _GENERATE_H_
+
+/**
+ * @brief Shape of the generated expressions.
+ */
+enum generator_shape
+{
+    SHAPE_CHAIN,
+    SHAPE_BALANCED,
+    SHAPE_RANDOM,
+    SHAPE_NESTED,
+    NUM_SHAPES
+};
+typedef enum generator_shape GeneratorShape;
+
+extern const char *shapeNames[NUM_SHAPES];
+
+/**
+ * @brief Options of the generator.
+ */
+typedef struct generator_options GeneratorOptions;
+struct generator_options
+{
+    int leaves;    /* variables and constants */
+    int depth;     /* nesting of brackets and functions, for SHAPE_RANDOM */
+    int vars;      /* a to z, then va, vb, ... */
+    int functions; /* percent of the subexpressions in a function */
+    int constants; /* percent of the leaves which are constants */
+    GeneratorShape shape;
+    unsigned long long seed;
+};
+
+/**
+ * @defgroup generate Generator functions
+ *
+ * @{
+ */
+GeneratorOptions defaultGeneratorOptions(void);
+char *generateExpression(const GeneratorOptions *o, int *length);
+/** @} */
+
+#endif
@@ -0,0 +1,419 @@
+#include "gradient.h"
+#include "dag.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @brief Distinct nodes of a DAG in post-order.
+ *
+ * Every node comes after all of its descendants. A small open-addressing
+ * table maps each node to its position.
+ */
+typedef struct node_order NodeOrder;
+struct node_order
+{
+    const Node **nodes;
+    char *hasVar; /* 1 if the subtree contains a variable */
+    int num, size;
+    const Node **keys;
+    int *values;
+    int capacity; /* power of 2 */
+};
+
+/**
+ * @brief Find the slot of a node in the table of the order
+ *
+ * @param o node order
+ * @param n node
+ * @return int slot of n, or of the empty slot where n belongs
+ */
+static int orderSlot(const NodeOrder *o, const Node *n)
+{
+    uint64_t h = (uint64_t)(uintptr_t)n;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    int slot = (int)(h & (uint64_t)(o->capacity - 1));
+    while (o->keys[slot] && o->keys[slot] != n)
+        slot = (slot + 1) & (o->capacity - 1);
+    return slot;
+}
+
+/**
+ * @brief Get the position of a node in the order
+ *
+ * @param o node order
+ * @param n node
+ * @return int position, -1 if n is not in the order
+ */
+static int orderIndex(const NodeOrder *o, const Node *n)
+{
+    int slot = orderSlot(o, n);
+    return o->keys[slot] ? o->values[slot] : -1;
+}
+
+/**
+ * @brief Append a node to the order
+ *
+ * @param o node order
+ * @param n node
+ * @param hasVar 1 if the subtree of n contains a variable
+ */
+static void orderAppend(NodeOrder *o, const Node *n, char hasVar)
+{
+    if (o->num == o->size)
+    {
+        o->size *= 2;
+        o->nodes = realloc(o->nodes, o->size * sizeof(Node *));
+        o->hasVar = realloc(o->hasVar, o->size);
+        if (!o->nodes || !o->hasVar)
+        {
+            fprintf(stderr, "[orderAppend] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* keep the load factor of the table under 1/2 */
+    if (2 * (o->num + 1) > o->capacity)
+    {
+        const Node **keys = o->keys;
+        int *values = o->values;
+        int capacity = o->capacity;
+        o->capacity *= 2;
+        o->keys = (const Node **)calloc(o->capacity, sizeof(Node *));
+        o->values = (int *)calloc(o->capacity, sizeof(int));
+        if (!o->keys || !o->values)
+        {
+            fprintf(stderr, "[orderAppend] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < capacity; i++)
+        {
+            if (keys[i])
+            {
+                int slot = orderSlot(o, keys[i]);
+                o->keys[slot] = keys[i];
+                o->values[slot] = values[i];
+            }
+        }
+        free(keys);
+        free(values);
+    }
+    int slot = orderSlot(o, n);
+    o->keys[slot] = n;
+    o->values[slot] = o->num;
+    o->nodes[o->num] = n;
+    o->hasVar[o->num] = hasVar;
+    o->num++;
+}
+
+/**
+ * @brief Frame of the walk of visit
+ */
+typedef struct order_frame OrderFrame;
+struct order_frame
+{
+    const Node *node;
+    int state; /* children visited */
+};
+
+/**
+ * @brief Visit the DAG in post-order
+ *
+ * The pending nodes are kept on an explicit stack, so a deep DAG (a sum of
+ * 200k terms is a chain of 200k nodes) can't overflow the call stack. Only
+ * the ancestors of a node are pending, so a shared node is never pushed
+ * twice.
+ *
+ * @param o node order
+ * @param n root of the DAG
+ */
+static void visit(NodeOrder *o, const Node *n)
+{
+    int num = 0, size = 64;
+    OrderFrame *stack = (OrderFrame *)malloc(sizeof(OrderFrame) * size);
+    if (!stack)
+    {
+        fprintf(stderr, "[visit] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (orderIndex(o, n) == -1)
+        stack[num++] = (OrderFrame){n, 0};
+    while (num)
+    {
+        OrderFrame *f = &stack[num - 1];
+        const Node *m = f->node;
+        if (f->state < 2)
+        {
+            const Node *child = f->state++ ? m->b : m->a;
+            if (!child || orderIndex(o, child) != -1)
+                continue;
+            if (num == size)
+            {
+                size *= 2;
+                stack = (OrderFrame *)realloc(stack, sizeof(OrderFrame) * size);
+                if (!stack)
+                {
+                    fprintf(stderr, "[visit] malloc failed.\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            stack[num++] = (OrderFrame){child, 0};
+            continue;
+        }
+        num--;
+        char hasVar = m->token.type == variable;
+        if (m->a && o->hasVar[orderIndex(o, m->a)])
+            hasVar = 1;
+        if (m->b && o->hasVar[orderIndex(o, m->b)])
+            hasVar = 1;
+        orderAppend(o, m, hasVar);
+    }
+    free(stack);
+}
+
+/* shorthand for the rules below */
+static Node *constant(int value)
+{
+    return createNode((Token){digit, value}, NULL, NULL);
+}
+static Node *op(int c, Node *a, Node *b)
+{
+    return createNode((Token){operator, c}, a, b);
+}
+static Node *fun(int f, Node *a)
+{
+    return createNode((Token){fun1, f}, a, NULL);
+}
+
+/**
+ * @brief Add a contribution to the adjoint of a node
+ *
+ * Contributions from several parents of a shared node are summed.
+ *
+ * @param o node order
+ * @param adjoint adjoints of the nodes in the order
+ * @param n node
+ * @param c contribution
+ */
+static void accumulate(const NodeOrder *o, Node **adjoint, const Node *n, Node *c)
+{
+    int index = orderIndex(o, n);
+    adjoint[index] = adjoint[index] ? op('+', adjoint[index], c) : c;
+}
+
+/* contributions to subtrees without variables are not even built */
+#define ACCUMULATE(n, c)                              \
+    do                                                \
+    {                                                 \
+        if (o.hasVar[orderIndex(&o, (n))])            \
+            accumulate(&o, adjoint, (n), (c));        \
+    } while (0)
+
+/**
+ * @brief Reverse-mode differentiation
+ *
+ * This function will differentiate the tree with respect to all the
+ * variables in one pass.
+ *
+ * The adjoint of a node is the derivative of the whole expression with
+ * respect to that node. The adjoint of the root is 1, and the adjoint of a
+ * node is passed to its children multiplied by the partial derivative of the
+ * node with respect to each child, following the same rules as autoGrad:
+ *
+ * 1. a + b: A, A
+ * 2. a - b: A, -A
+ * 3. a * b: A * b, A * a
+ * 4. a / b: A / b, -(A * a) / b^2
+ * 5. a ^ b, pow(a, b): A * (a ^ b * (b / a)), A * (a ^ b * ln(a))
+ * 6. ln(a): A * (1 / a)
+ * 7. cos(a): A * -sin(a)
+ * 8. sin(a): A * cos(a)
+ * 9. tan(a): A / cos(a)^2
+ * 10. exp(a): A * exp(a)
+ * 11. log(a, b): -(A * (ln(b) / a)) / ln(a)^2, (A * (ln(a) / b)) / ln(a)^2
+ *
+ * Nodes are visited once, parents before children, so a node shared by
+ * several parents sums their contributions before passing it on. The
+ * derivative for a variable is the adjoint of its node. Subtrees without
+ * variables are skipped. The adjoints are shared by all the derivatives, so
+ * the results must be used while the node store is alive.
+ *
+ * @param n root of the tree
+ * @param numVars number of variables in the variable list
+ * @return Node** derivatives indexed by variable, to be freed with free()
+ */
+Node **reverseGrad(Node *n, int numVars)
+{
+    if (!currentNodeStore())
+    {
+        fprintf(stderr, "[reverseGrad] no node store in use.\n");
+        exit(EXIT_FAILURE);
+    }
+    Node **ret = (Node **)malloc(sizeof(Node *) * (numVars > 0 ? numVars : 1));
+    NodeOrder o = {NULL, NULL, 0, 16, NULL, NULL, 32};
+    o.nodes = (const Node **)malloc(o.size * sizeof(Node *));
+    o.hasVar = (char *)malloc(o.size);
+    o.keys = (const Node **)calloc(o.capacity, sizeof(Node *));
+    o.values = (int *)calloc(o.capacity, sizeof(int));
+    if (!ret || !o.nodes || !o.hasVar || !o.keys || !o.values)
+    {
+        fprintf(stderr, "[reverseGrad] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    visit(&o, n);
+
+    Node **adjoint = (Node **)calloc(o.num, sizeof(Node *));
+    if (!adjoint)
+    {
+        fprintf(stderr, "[reverseGrad] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    adjoint[o.num - 1] = constant(1);
+    for (int i = 0; i < numVars; i++)
+        ret[i] = NULL;
+
+    /* parents before children */
+    for (int i = o.num - 1; i >= 0; i--)
+    {
+        Node *A = adjoint[i];
+        Node *p = (Node *)o.nodes[i];
+        if (!A || !o.hasVar[i])
+            continue;
+        Node *a = p->a, *b = p->b;
+        switch (p->token.type)
+        {
+        case variable:
+            ret[p->token.value] = ret[p->token.value] ? op('+', ret[p->token.value], A) : A;
+            break;
+        case operator:
+            switch (p->token.value)
+            {
+            case '+':
+                ACCUMULATE(a, A);
+                ACCUMULATE(b, A);
+                break;
+            case '-':
+                ACCUMULATE(a, A);
+                ACCUMULATE(b, op('*', constant(-1), A));
+                break;
+            case '*':
+                ACCUMULATE(a, op('*', A, b));
+                ACCUMULATE(b, op('*', A, a));
+                break;
+            case '/':
+                ACCUMULATE(a, op('/', A, b));
+                ACCUMULATE(b, op('/', op('*', constant(-1), op('*', A, a)),
+                                             op('^', b, constant(2))));
+                break;
+            case '^':
+                ACCUMULATE(a, op('*', A, op('*', p, op('/', b, a))));
+                ACCUMULATE(b, op('*', A, op('*', p, fun(0, a))));
+                break;
+            }
+            break;
+        case fun1:
+            switch (p->token.value)
+            {
+            case 0: /* ln */
+                ACCUMULATE(a, op('*', A, op('/', constant(1), a)));
+                break;
+            case 1: /* cos */
+                ACCUMULATE(a, op('*', A, op('*', constant(-1), fun(2, a))));
+                break;
+            case 2: /* sin */
+                ACCUMULATE(a, op('*', A, fun(1, a)));
+                break;
+            case 3: /* tan */
+                ACCUMULATE(a, op('/', A, op('^', fun(1, a), constant(2))));
+                break;
+            case 4: /* exp */
+                ACCUMULATE(a, op('*', A, p));
+                break;
+            }
+            break;
+        case fun2:
+            switch (p->token.value)
+            {
+            case 0: /* log */
+                ACCUMULATE(a, op('/', op('*', constant(-1), op('*', A, op('/', fun(0, b), a))),
+                                 op('^', fun(0, a), constant(2))));
+                ACCUMULATE(b, op('/', op('*', A, op('/', fun(0, a), b)),
+                                 op('^', fun(0, a), constant(2))));
+                break;
+            case 1: /* pow */
+                ACCUMULATE(a, op('*', A, op('*', p, op('/', b, a))));
+                ACCUMULATE(b, op('*', A, op('*', p, fun(0, a))));
+                break;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    for (int i = 0; i < numVars; i++)
+    {
+        if (!ret[i])
+            ret[i] = constant(0);
+    }
+    free(adjoint);
+    free(o.nodes);
+    free(o.hasVar);
+    free(o.keys);
+    free(o.values);
+    return ret;
+}
+
+/**
+ * @brief Second derivatives for all the pairs of variables
+ *
+ * The first derivatives are computed and optimized once per variable, and
+ * each second derivative is the derivative of one of them. Mixed partials
+ * are symmetric, so only the pairs i <= j are differentiated, and entry
+ * (j, i) is the same node as entry (i, j). autoGrad and constantOptimizer
+ * memoize per node in the store, so subtrees shared between the first
+ * derivatives are differentiated only once for each variable.
+ *
+ * @param n root of the tree
+ * @param numVars number of variables in the variable list
+ * @return Node** numVars * numVars entries, (i, j) at i * numVars + j, to
+ * be freed with free()
+ */
+Node **hessianGrad(Node *n, int numVars)
+{
+    Node **first = (Node **)malloc(sizeof(Node *) * (numVars ? numVars : 1));
+    Node **ret = (Node **)malloc(sizeof(Node *) * (numVars ? numVars * numVars : 1));
+    if (!first || !ret)
+    {
+        fprintf(stderr, "[hessianGrad] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < numVars; i++)
+        first[i] = constantOptimizer(autoGrad(n, i));
+    for (int i = 0; i < numVars; i++)
+        for (int j = i; j < numVars; j++)
+            ret[i * numVars + j] = ret[j * numVars + i] =
+                constantOptimizer(autoGrad(first[i], j));
+    free(first);
+    return ret;
+}
+
+/**
+ * @brief Derivative of any order for one variable
+ *
+ * Each order is the optimized derivative of the one before, so every
+ * intermediate derivative is computed once.
+ *
+ * @param n root of the tree
+ * @param var variable
+ * @param order order of the derivative, 0 for n itself
+ * @return Node* derivative
+ */
+Node *nthGrad(Node *n, int var, int order)
+{
+    Node *ret = n;
+    for (int k = 0; k < order; k++)
+        ret = constantOptimizer(autoGrad(ret, var));
+    return ret;
+}
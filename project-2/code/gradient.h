@@ -0,0 +1,27 @@
+/**
+ * @file gradient.h
+ * @brief Derivatives for all the variables at once.
+ *
+ * autoGrad differentiates the whole tree once for every variable. The
+ * functions here share the work between the variables instead, or between
+ * the orders of higher derivatives.
+ */
+#ifndef _GRADIENT_H_
+#define _GRADIENT_H_
+
+#include "expression.h"
+
+/**
+ * @defgroup gradient Gradient functions
+ *
+ * These functions build DAGs, so a node store (see dag.h) must be in use by
+ * the current thread when they are called.
+ *
+ * @{
+ */
+Node **reverseGrad(Node *n, int numVars);
+Node **hessianGrad(Node *n, int numVars);
+Node *nthGrad(Node *n, int var, int order);
+/** @} */
+
+#endif
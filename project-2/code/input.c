@@ -0,0 +1,230 @@
+#include "input.h"
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Allocate an input or exit
+ *
+ * @return Input* new input, empty
+ */
+static Input *createInput(void)
+{
+    Input *ret = (Input *)calloc(1, sizeof(Input));
+    if (!ret)
+    {
+        fprintf(stderr, "[openInput] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    ret->fd = -1;
+    return ret;
+}
+
+/**
+ * @brief Open the input of a stream
+ *
+ * A regular file is mapped from its current position to its end. Anything
+ * else, such as a pipe or a terminal, is read in chunks as the lines are
+ * asked for, so an interactive line is used as soon as it is typed.
+ *
+ * @param fp stream, left open
+ * @return Input* new input
+ */
+Input *openInput(FILE *fp)
+{
+    Input *ret = createInput();
+    ret->fd = fileno(fp);
+    struct stat st;
+    off_t start = lseek(ret->fd, 0, SEEK_CUR);
+    if (!fstat(ret->fd, &st) && S_ISREG(st.st_mode) && start >= 0 && st.st_size > start)
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, ret->fd, 0);
+        if (map != MAP_FAILED)
+        {
+            /* the lines are stripped in place, on private copies of the pages */
+            ret->data = (char *)map;
+            ret->mapSize = ret->size = st.st_size;
+            ret->pos = start;
+            ret->eof = 1;
+            return ret;
+        }
+    }
+    ret->capacity = INPUT_CHUNK;
+    ret->data = (char *)malloc(ret->capacity);
+    if (!ret->data)
+    {
+        fprintf(stderr, "[openInput] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    ret->owned = 1;
+    return ret;
+}
+
+/**
+ * @brief Open the input of a memory block
+ *
+ * The lines are stripped in place, so the block is changed.
+ *
+ * @param s memory block, must outlive the input
+ * @param size size of the block
+ * @return Input* new input
+ */
+Input *openMemoryInput(char *s, size_t size)
+{
+    Input *ret = createInput();
+    ret->data = s;
+    ret->size = size;
+    ret->eof = 1;
+    return ret;
+}
+
+/**
+ * @brief Read more of a stream into the buffer
+ *
+ * The bytes before pos have been handed out and are dropped. The buffer is
+ * doubled when less than INPUT_CHUNK bytes are left, and always keeps one
+ * byte past size for the '\0' of the last line.
+ *
+ * @param in input, not mapped
+ */
+static void fillInput(Input *in)
+{
+    if (in->pos)
+    {
+        memmove(in->data, in->data + in->pos, in->size - in->pos);
+        in->size -= in->pos;
+        in->pos = 0;
+    }
+    if (in->capacity - in->size <= INPUT_CHUNK)
+    {
+        in->capacity *= 2;
+        in->data = (char *)realloc(in->data, in->capacity);
+        if (!in->data)
+        {
+            fprintf(stderr, "[nextExpression] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ssize_t got;
+    do
+        got = read(in->fd, in->data + in->size, in->capacity - in->size - 1);
+    while (got < 0 && errno == EINTR);
+    if (got < 0)
+    {
+        fprintf(stderr, "[nextExpression] read failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!got)
+        in->eof = 1;
+    in->size += got;
+}
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/**
+ * @brief Remove the whitespace from a line in place
+ *
+ * Whitespace bytes are all below '!', so a word of eight bytes with no byte
+ * below '!' is moved as a whole. Bytes are only written once something has
+ * been removed, which leaves the pages of a mapped file clean.
+ *
+ * @param s line
+ * @param n length of the line
+ * @return size_t length of the stripped line
+ */
+static size_t stripSpace(char *s, size_t n)
+{
+    size_t len = 0, i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        if (!((w - ONES * '!') & ~w & HIGHS))
+        {
+            if (len != i)
+                memcpy(s + len, &w, 8);
+            len += 8;
+            continue;
+        }
+        for (int k = 0; k < 8; k++)
+            if (!isspace((unsigned char)s[i + k]))
+                s[len++] = s[i + k];
+    }
+    for (; i < n; i++)
+        if (!isspace((unsigned char)s[i]))
+            s[len++] = s[i];
+    return len;
+}
+
+/**
+ * @brief Get the next expression of the input
+ *
+ * The expression is the next line without its whitespace, so it may be
+ * empty. The last line needs no '\n'.
+ *
+ * @param in input
+ * @param s view of the expression
+ * @return int 1 if there was a line, 0 at the end of the input
+ */
+int nextExpression(Input *in, String *s)
+{
+    size_t scan = in->pos;
+    char *end;
+    while (!(end = (char *)memchr(in->data + scan, '\n', in->size - scan)) && !in->eof)
+    {
+        /* fillInput moves the unread bytes to the front */
+        scan = in->size - in->pos;
+        fillInput(in);
+    }
+    if (!end && in->pos == in->size)
+        return 0;
+    size_t lineEnd = end ? (size_t)(end - in->data) : in->size;
+    char *line = in->data + in->pos;
+    size_t len = stripSpace(line, lineEnd - in->pos);
+    if (len > INT_MAX)
+    {
+        fprintf(stderr, "[nextExpression] expression too long.\n");
+        exit(EXIT_FAILURE);
+    }
+    in->pos = end ? lineEnd + 1 : lineEnd;
+    if (!in->owned && line + len == in->data + in->size)
+    {
+        /* a mapped file or a memory block may end right after the line */
+        free(in->spare);
+        in->spare = (char *)malloc(len + 1);
+        if (!in->spare)
+        {
+            fprintf(stderr, "[nextExpression] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(in->spare, line, len);
+        line = in->spare;
+    }
+    line[len] = '\0';
+    *s = (String){line, (int)len, 0};
+    return 1;
+}
+
+/**
+ * @brief Close the input
+ *
+ * The stream or the memory block is left open.
+ *
+ * @param in input to be closed
+ */
+void closeInput(Input *in)
+{
+    if (in->mapSize)
+        munmap(in->data, in->mapSize);
+    if (in->owned)
+        free(in->data);
+    free(in->spare);
+    free(in);
+}
@@ -0,0 +1,59 @@
+/**
+ * @file input.h
+ * @brief Bulk input of expressions.
+ *
+ * getString used to read stdin one getchar at a time. An Input reads a whole
+ * file, a stream or a memory block instead: regular files are mapped with
+ * mmap, other streams are read in large chunks with read. The expressions are
+ * the lines of the input; the whitespace of each line is removed in place,
+ * eight bytes at a time where there is none, and the line is handed out as a
+ * String view on the input, NUL-terminated like the strings of getString.
+ */
+#ifndef _INPUT_H_
+#define _INPUT_H_
+
+#include "expression.h"
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * @brief Bytes asked of read at least, when the input is not mapped.
+ */
+#define INPUT_CHUNK 65536
+
+/**
+ * @brief Input type.
+ *
+ * data holds the input from pos to size. A mapped input or a memory block is
+ * whole from the start; otherwise data is a buffer of capacity bytes that is
+ * refilled from fd, and eof is set once read has returned 0.
+ */
+typedef struct input Input;
+struct input
+{
+    int fd;
+    char *data;
+    size_t size, pos, capacity;
+    size_t mapSize;  /* bytes mapped, 0 if data is not mapped */
+    int owned;       /* data was allocated by the input */
+    int eof;
+    char *spare;     /* copy of a last line with no room for its '\0' */
+};
+
+/**
+ * @defgroup input Input functions
+ *
+ * The String of nextExpression points into the input. It stays valid until
+ * the input is closed if the input is mapped or in memory, and until the
+ * next call otherwise. A stream is read from its current position, so it must
+ * not have been read through stdio before.
+ *
+ * @{
+ */
+Input *openInput(FILE *fp);
+Input *openMemoryInput(char *s, size_t size);
+int nextExpression(Input *in, String *s);
+void closeInput(Input *in);
+/** @} */
+
+#endif
@@ -8,16 +8,289 @@
  *
  * The program will read an expression from stdin, and then print the
  * differentiation result of the expression for each variable in the expression.
+ *
+ * All the trees are built in a node store, so identical subtrees are shared
+ * and differentiated or optimized only once.
+ *
+ * Usage: ./expr [--reverse] [--arena | --malloc | --compact] [--collect] [--stats]
+ *        ./expr [--hessian | --order N]
+ *        ./expr [--max-length N] [--let]
+ *        ./expr --batch [--threads N] [file]
+ *
+ * With --reverse, the derivatives for all the variables are computed together
+ * by reverseGrad instead of one autoGrad pass per variable. The results are
+ * printed in the same order, but may be written differently.
+ *
+ * With --arena, the trees are built in node arenas instead, without sharing:
+ * one for the expression and one for the derivatives, which is reset after
+ * each variable. With --malloc, every node is allocated on its own. With
+ * --compact, the whole job runs on one compact tree (see compact.h). These
+ * can't be used with --reverse.
+ *
+ * With --collect, the trees are optimized by the rewrite engine (see
+ * rewrite.h), which also collects like terms and powers, instead of one
+ * constantOptimizer pass. With --stats, the nodes before and after each pass
+ * and the time spent in it are printed to stderr at the end. Neither can be
+ * used with --compact.
+ *
+ * With --batch, every line of the file (stdin by default) is an expression,
+ * and the expressions are differentiated on N threads, one per CPU by
+ * default (see batch.h).
+ *
+ * With --hessian, the second derivatives are printed for every pair of
+ * variables in dictionary order, as "x,y: ...". With --order N, the N-th
+ * derivative is printed for every variable, as "x,x,x: ..." for N = 3.
+ * Both reuse the lower derivatives (see gradient.h) and need the node store.
+ *
+ * With --max-length N, each result is cut after N characters and ends with
+ * "...". With --let, the subexpressions shared in the node store are printed
+ * once, as let-bindings before the result (see renderTree). Neither can be
+ * used with --compact.
+ *
+ * Built with make metrics, the metrics of the expression are printed to
+ * stderr at the end as one JSON line (see metrics.h).
  */
 #include "expression.h"
+#include "arena.h"
+#include "batch.h"
+#include "compact.h"
+#include "dag.h"
+#include "gradient.h"
+#include "metrics.h"
+#include "rewrite.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Differentiate the expression on a compact tree
+ *
+ * Same steps and output as main.
+ *
+ * @param s expression
+ * @param v variable list
+ */
+static void compactMain(String *s, VariableList *v)
+{
+    int num;
+    METRICS_PHASE(PHASE_PARSE);
+    Token *tokens = tokenize(s, v, &num);
+    CompactTree *t = createCompactTree(num * 4);
+    /* analyze expression */
+    unsigned tree = compactParser(t, tokens, num);
+    free(tokens);
+    /* optimize expression */
+    METRICS_PHASE(PHASE_OPTIMIZE);
+    unsigned optTree = compactOptimizer(t, tree);
+#ifdef DEBUG
+    puts("optimized expresion: ");
+    printCompact(t, optTree, v);
+    putchar('\n');
+#endif
+    /* diff for each variable and print result */
+    for (int i = 0; i <= v->top; i++)
+    {
+        METRICS_PHASE(PHASE_GRAD);
+        unsigned diffTree = compactGrad(t, optTree, v->dictOrder[i]);
+        METRICS_PHASE(PHASE_OPTIMIZE);
+        unsigned optDiffTree = compactOptimizer(t, diffTree);
+        METRICS_PHASE(PHASE_PRINT);
+        printf("%s: ", v->s[v->dictOrder[i]]);
+        printCompact(t, optDiffTree, v);
+        putchar('\n');
+    }
+    /* warning if no variable in expression */
+    if (v->top == -1)
+    {
+        printf("[warning] No variable in original expression: ");
+        printCompact(t, optTree, v);
+        putchar('\n');
+    }
+#ifdef DEBUG
+    printf("compact nodes: %u\n", t->num);
+#endif
+    METRICS_PHASE(PHASE_FREE);
+    freeCompactTree(t);
+}
+
+/**
+ * @brief Options of printResult
+ */
+typedef struct print_options PrintOptions;
+struct print_options
+{
+    size_t maxLength; /* 0 for no limit */
+    int let;
+};
+
+/**
+ * @brief Print a result with the printing options
+ *
+ * @param n root of the tree
+ * @param v variable list
+ * @param o printing options
+ */
+static void printResult(const Node *n, const VariableList *v, const PrintOptions *o)
+{
+    char s[4096];
+    PrintBuffer b;
+    initPrintBuffer(&b, s, sizeof(s), stdout, o->maxLength);
+    renderTree(&b, n, v, o->let);
+    flushPrintBuffer(&b);
+}
 
-int main(void)
+/**
+ * @brief Print the second or N-th derivatives
+ *
+ * @param optTree optimized expression, in the node store
+ * @param v variable list
+ * @param hessian 1 for all the second derivatives
+ * @param order order of the derivatives of each variable, if not hessian
+ * @param o printing options
+ */
+static void printHigher(Node *optTree, const VariableList *v, int hessian, int order,
+                        const PrintOptions *o)
 {
+    int numVars = v->top + 1;
+    if (hessian)
+    {
+        METRICS_PHASE(PHASE_GRAD);
+        Node **h = hessianGrad(optTree, numVars);
+        METRICS_PHASE(PHASE_PRINT);
+        for (int i = 0; i < numVars; i++)
+            for (int j = 0; j < numVars; j++)
+            {
+                int a = v->dictOrder[i], b = v->dictOrder[j];
+                printf("%s,%s: ", v->s[a], v->s[b]);
+                printResult(h[a * numVars + b], v, o);
+                putchar('\n');
+            }
+        free(h);
+        return;
+    }
+    for (int i = 0; i < numVars; i++)
+    {
+        int a = v->dictOrder[i];
+        METRICS_PHASE(PHASE_GRAD);
+        Node *grad = nthGrad(optTree, a, order);
+        METRICS_PHASE(PHASE_PRINT);
+        for (int k = 0; k < order; k++)
+            printf(k ? ",%s" : "%s", v->s[a]);
+        printf(": ");
+        printResult(grad, v, o);
+        putchar('\n');
+    }
+}
+
+/**
+ * @brief Optimize a tree with the rewrite engine if there is one
+ *
+ * @param r rewrite engine, NULL for constantOptimizer alone
+ * @param n root of the tree
+ * @return Node* optimized tree
+ */
+static Node *optimize(Rewriter *r, const Node *n)
+{
+    return r ? rewriteTree(r, n) : constantOptimizer(n);
+}
+
+int main(int argc, char *argv[])
+{
+    /* parse options */
+    int reverse = 0, arena = 0, store = 1, compact = 0, collect = 0, stats = 0, bad = 0;
+    int batch = 0, threads = 0, hessian = 0, order = 0;
+    PrintOptions print = {0, 0};
+    const char *file = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--reverse"))
+            reverse = 1;
+        else if (!strcmp(argv[i], "--arena"))
+            arena = 1, store = 0;
+        else if (!strcmp(argv[i], "--malloc"))
+            arena = 0, store = 0;
+        else if (!strcmp(argv[i], "--compact"))
+            compact = 1;
+        else if (!strcmp(argv[i], "--collect"))
+            collect = 1;
+        else if (!strcmp(argv[i], "--stats"))
+            stats = 1;
+        else if (!strcmp(argv[i], "--batch"))
+            batch = 1;
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--hessian"))
+            hessian = 1;
+        else if (!strcmp(argv[i], "--order") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            order = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--max-length") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            print.maxLength = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--let"))
+            print.let = 1;
+        else if (argv[i][0] != '-' && !file)
+            file = argv[i];
+        else
+            bad = 1;
+    }
+    if (batch && (reverse || !store || compact || collect || stats))
+        bad = 1;
+    if ((threads || file) && !batch)
+        bad = 1;
+    if ((hessian || order) && ((hessian && order) || reverse || !store || compact || collect ||
+                               stats || batch))
+        bad = 1;
+    if ((print.maxLength || print.let) && (compact || batch))
+        bad = 1;
+    if (bad || (reverse && (!store || compact)) || (compact && (collect || stats)))
+    {
+        fprintf(stderr, "Usage: %s [--reverse] [--arena | --malloc | --compact] [--collect] [--stats]\n"
+                        "       %s [--hessian | --order N] [--max-length N] [--let]\n"
+                        "       %s --batch [--threads N] [file]\n",
+                argv[0], argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (batch)
+    {
+        FILE *in = file ? fopen(file, "r") : stdin;
+        if (!in)
+        {
+            fprintf(stderr, "[main] can't open %s.\n", file);
+            return EXIT_FAILURE;
+        }
+        runBatch(in, stdout, threads);
+        if (file)
+            fclose(in);
+        return 0;
+    }
+
     /* read expression */
+    METRICS_START();
+    METRICS_PHASE(PHASE_READ);
     String *s = getString();
     VariableList *v = createVariableList();
+    if (compact)
+    {
+        compactMain(s, v);
+        freeString(s);
+        freeVariableList(v);
+        METRICS_PRINT(stderr, 0);
+        return 0;
+    }
+    NodeStore *nodeStore = store ? createNodeStore() : NULL;
+    NodeArena *treeArena = arena ? createNodeArena() : NULL;
+    NodeArena *diffArena = arena ? createNodeArena() : NULL;
+    /* without --collect, the counters are kept for the single constant pass */
+    Rewriter *rewriter = collect ? createRewriter(rewriteRules, NUM_REWRITE_RULES, 16)
+                         : stats ? createRewriter(rewriteRules, 1, 1)
+                                 : NULL;
+    /* the census costs a full walk per pass, so count only when printed */
+    if (rewriter)
+        rewriter->counting = stats;
+    useNodeStore(nodeStore);
+    useNodeArena(treeArena);
     /* analyze expression */
+    METRICS_PHASE(PHASE_PARSE);
     Node *tree = parser(s, v);
     freeString(s);
 #ifdef DEBUG
@@ -26,7 +299,9 @@ int main(void)
     putchar('\n');
 #endif
     /* optimize expression */
-    Node *optTree = constantOptimizer(tree);
+    METRICS_PHASE(PHASE_OPTIMIZE);
+    Node *optTree = optimize(rewriter, tree);
+    METRICS_PHASE(PHASE_FREE);
     freeTree(tree);
 #ifdef DEBUG
     puts("optimized expresion: ");
@@ -34,34 +309,70 @@ int main(void)
     putchar('\n');
 #endif
     /* diff for each variable and print result */
-    for (int i = 0; i <= v->top; i++)
+    if (hessian || order)
+        printHigher(optTree, v, hessian, order, &print);
+    METRICS_PHASE(PHASE_GRAD);
+    Node **grads = reverse ? reverseGrad(optTree, v->top + 1) : NULL;
+    useNodeArena(diffArena);
+    for (int i = 0; i <= v->top && !hessian && !order; i++)
     {
-        Node *diffTree = autoGrad(optTree, v->dictOrder[i]);
+        METRICS_PHASE(PHASE_GRAD);
+        Node *diffTree = reverse ? grads[v->dictOrder[i]] : autoGrad(optTree, v->dictOrder[i]);
 #ifdef DEBUG
         printf("origin %s: ", v->s[v->dictOrder[i]]);
         printTree(diffTree, v);
         putchar('\n');
 #endif
         /* optimize diffTree */
-        Node *optDiffTree = constantOptimizer(diffTree);
+        METRICS_PHASE(PHASE_OPTIMIZE);
+        Node *optDiffTree = optimize(rewriter, diffTree);
+        METRICS_PHASE(PHASE_FREE);
         freeTree(diffTree);
+        METRICS_PHASE(PHASE_PRINT);
 #ifdef DEBUG
         printf("optimized %s: ", v->s[v->dictOrder[i]]);
 #else
         printf("%s: ", v->s[v->dictOrder[i]]);
 #endif
-        printTree(optDiffTree, v);
-        freeTree(optDiffTree);
+        printResult(optDiffTree, v, &print);
         putchar('\n');
+        METRICS_PHASE(PHASE_FREE);
+        freeTree(optDiffTree);
+        if (diffArena)
+            resetNodeArena(diffArena);
     }
+    useNodeArena(treeArena);
+    free(grads);
     /* warning if no variable in expression */
+    METRICS_PHASE(PHASE_PRINT);
     if (v->top == -1)
     {
         printf("[warning] No variable in original expression: ");
-        printTree(optTree, v);
+        printResult(optTree, v, &print);
         putchar('\n');
     }
+    METRICS_PHASE(PHASE_FREE);
     freeVariableList(v);
     freeTree(optTree);
+#ifdef DEBUG
+    if (nodeStore)
+        printf("distinct nodes: %d\n", countNodes(nodeStore));
+    if (treeArena)
+        printf("arena nodes: %ld\n", treeArena->numNodes);
+#endif
+    if (rewriter)
+    {
+        if (stats)
+            printRewriter(rewriter, stderr);
+        freeRewriter(rewriter);
+    }
+    if (nodeStore)
+        freeNodeStore(nodeStore);
+    if (treeArena)
+    {
+        freeNodeArena(treeArena);
+        freeNodeArena(diffArena);
+    }
+    METRICS_PRINT(stderr, 0);
     return 0;
 }
@@ -0,0 +1,76 @@
+#include "metrics.h"
+#include <time.h>
+
+_Thread_local Metrics threadMetrics = {{0}, -1, 0, 0, 0, 0, 0, 0, 0, 0};
+
+static const char *phaseNames[NUM_PHASES] = {"read", "parse", "optimize", "grad", "print", "free"};
+
+static double seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Reset the metrics of the thread for a new expression
+ *
+ * The nodes still alive stay counted, so a node store or an arena shared by
+ * several expressions is not counted as freed.
+ */
+void startMetrics(void)
+{
+    Metrics *m = &threadMetrics;
+    for (int i = 0; i < NUM_PHASES; i++)
+        m->seconds[i] = 0;
+    m->phase = -1;
+    m->created = m->freed = 0;
+    m->peakLive = m->live;
+    m->peakBytes = m->bytes;
+    m->depth = 0;
+}
+
+/**
+ * @brief Charge the time since the last call to the current phase and
+ * switch to another one
+ *
+ * A phase may be entered many times, such as once per variable.
+ *
+ * @param phase new phase
+ */
+void enterPhase(MetricsPhase phase)
+{
+    Metrics *m = &threadMetrics;
+    double now = seconds();
+    if (m->phase >= 0)
+        m->seconds[m->phase] += now - m->start;
+    m->phase = phase;
+    m->start = now;
+}
+
+/**
+ * @brief Print the metrics of the expression as one JSON line
+ *
+ * The current phase ends.
+ *
+ * @param fp output file
+ * @param index number of the expression
+ */
+void printMetrics(FILE *fp, long index)
+{
+    Metrics *m = &threadMetrics;
+    if (m->phase >= 0)
+        m->seconds[m->phase] += seconds() - m->start;
+    m->phase = -1;
+    char line[512];
+    int length = snprintf(line, sizeof(line), "{\"expression\":%ld,\"seconds\":{", index);
+    for (int i = 0; i < NUM_PHASES; i++)
+        length += snprintf(line + length, sizeof(line) - length, "%s\"%s\":%.9f", i ? "," : "",
+                           phaseNames[i], m->seconds[i]);
+    snprintf(line + length, sizeof(line) - length,
+             "},\"nodes\":{\"created\":%ld,\"freed\":%ld,\"live\":%ld,\"peak\":%ld},"
+             "\"bytes\":{\"live\":%ld,\"peak\":%ld},\"depth\":%d}\n",
+             m->created, m->freed, m->live, m->peakLive, m->bytes, m->peakBytes, m->depth);
+    /* one write, so the lines of a batch don't mix */
+    fputs(line, fp);
+}
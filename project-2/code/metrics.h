@@ -0,0 +1,106 @@
+/**
+ * @file metrics.h
+ * @brief Per-phase metrics of the expression pipeline.
+ *
+ * Built with -DMETRICS (make metrics), the program counts for each
+ * expression the time spent in each phase, the nodes created and freed, the
+ * most nodes and node bytes alive at once and the deepest tree walk, and
+ * prints them to stderr as one JSON line. Without METRICS, the hooks below
+ * expand to nothing, so the other builds don't pay for them.
+ *
+ * Nodes are counted where they are allocated: by malloc in createNode, in a
+ * node arena or in a node store. Store nodes are freed with the store, arena
+ * nodes when the arena is reset or freed. The nodes of compact trees are not
+ * counted.
+ */
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+
+/**
+ * @brief Phases of the pipeline.
+ */
+enum metrics_phase
+{
+    PHASE_READ,
+    PHASE_PARSE,
+    PHASE_OPTIMIZE,
+    PHASE_GRAD,
+    PHASE_PRINT,
+    PHASE_FREE,
+    NUM_PHASES
+};
+typedef enum metrics_phase MetricsPhase;
+
+/**
+ * @brief Metrics type.
+ *
+ * The metrics are kept per thread, so the threads of a batch count their own
+ * expressions.
+ */
+typedef struct metrics Metrics;
+struct metrics
+{
+    double seconds[NUM_PHASES];
+    int phase;    /* current phase, -1 for none */
+    double start; /* of the current phase */
+    long created, freed, live, peakLive;
+    long bytes, peakBytes; /* of the live nodes */
+    int depth;             /* deepest walk, in levels */
+};
+
+#ifdef METRICS
+extern _Thread_local Metrics threadMetrics;
+
+/**
+ * @defgroup metrics Metrics functions
+ *
+ * @{
+ */
+void startMetrics(void);
+void enterPhase(MetricsPhase phase);
+void printMetrics(FILE *fp, long index);
+/** @} */
+
+static inline void countCreated(long nodes, long bytes)
+{
+    Metrics *m = &threadMetrics;
+    m->created += nodes;
+    m->live += nodes;
+    m->bytes += bytes;
+    if (m->live > m->peakLive)
+        m->peakLive = m->live;
+    if (m->bytes > m->peakBytes)
+        m->peakBytes = m->bytes;
+}
+
+static inline void countFreed(long nodes, long bytes)
+{
+    Metrics *m = &threadMetrics;
+    m->freed += nodes;
+    m->live -= nodes;
+    m->bytes -= bytes;
+}
+
+#define METRICS_START() startMetrics()
+#define METRICS_PHASE(phase) enterPhase(phase)
+#define METRICS_PRINT(fp, index) printMetrics(fp, index)
+#define METRICS_CREATED(nodes, bytes) countCreated(nodes, bytes)
+#define METRICS_FREED(nodes, bytes) countFreed(nodes, bytes)
+#define METRICS_DEPTH(levels)                    \
+    do                                           \
+    {                                            \
+        if ((levels) > threadMetrics.depth)      \
+            threadMetrics.depth = (levels);      \
+    } while (0)
+#else
+#define METRICS_START() ((void)0)
+#define METRICS_PHASE(phase) ((void)0)
+#define METRICS_PRINT(fp, index) ((void)0)
+#define METRICS_CREATED(nodes, bytes) ((void)0)
+#define METRICS_FREED(nodes, bytes) ((void)0)
+#define METRICS_DEPTH(levels) ((void)0)
+#endif
+
+#endif
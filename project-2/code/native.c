@@ -0,0 +1,365 @@
+#include "native.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * @brief Version of the emitted code, part of the hash.
+ *
+ * Must be changed whenever emitProgram changes, so stale shared objects in
+ * the cache are not used any more.
+ */
+#define NATIVE_VERSION 3
+
+/**
+ * @brief Hash the structure of a program (FNV-1a)
+ *
+ * Programs compiled from structurally equal trees have equal code, so they
+ * have the same hash.
+ *
+ * @param p program
+ * @return unsigned long long hash value
+ */
+unsigned long long hashProgram(const Program *p)
+{
+    uint64_t h = 14695981039346656037ULL;
+#define MIX(x)                                  \
+    do                                          \
+    {                                           \
+        uint64_t m = (uint64_t)(x);             \
+        for (int k = 0; k < 8; k++, m >>= 8)    \
+            h = (h ^ (m & 0xff)) * 1099511628211ULL; \
+    } while (0)
+    MIX(NATIVE_VERSION);
+    MIX(p->num);
+    MIX(p->numOutputs);
+    for (int i = 0; i < p->num; i++)
+    {
+        uint64_t bits;
+        memcpy(&bits, &p->code[i].value, sizeof(bits));
+        MIX(p->code[i].op);
+        MIX((uint64_t)(unsigned)p->code[i].a << 32 | (unsigned)p->code[i].b);
+        MIX(bits);
+    }
+    for (int i = 0; i < p->numOutputs; i++)
+        MIX(p->outputs[i]);
+#undef MIX
+    return h;
+}
+
+/**
+ * @brief Print a constant as a C expression
+ *
+ * Hexadecimal floating constants keep every bit of the value.
+ *
+ * @param value constant
+ * @param fp output file
+ */
+static void emitConstant(double value, FILE *fp)
+{
+    if (isnan(value))
+        fprintf(fp, "NAN");
+    else if (isinf(value))
+        fprintf(fp, value > 0 ? "INFINITY" : "-INFINITY");
+    else
+        fprintf(fp, "%a", value);
+}
+
+/**
+ * @brief Emit the program as a C function
+ *
+ * The function is named expr_native and has the type NativeFunction. Every
+ * register becomes a local constant, so common subexpressions are still
+ * computed once. The bytecode itself is kept in expr_code and expr_outputs,
+ * laid out like in hashProgram, so the loader can check that a cached
+ * shared object is the code of the program and not of another program with
+ * the same hash.
+ *
+ * @param p program
+ * @param fp output file
+ */
+void emitProgram(const Program *p, FILE *fp)
+{
+    static const char *funs[] = {"log", "cos", "sin", "tan", "exp"};
+    fprintf(fp, "/* generated by expr, hash %016llx */\n", hashProgram(p));
+    fprintf(fp, "#include <math.h>\n\n");
+    /* a trailing 0 keeps the arrays from being empty */
+    fprintf(fp, "const int expr_num = %d, expr_num_outputs = %d;\n", p->num, p->numOutputs);
+    fprintf(fp, "const unsigned long long expr_code[] = {\n");
+    for (int i = 0; i < p->num; i++)
+    {
+        unsigned long long bits;
+        memcpy(&bits, &p->code[i].value, sizeof(bits));
+        fprintf(fp, "    %d, 0x%016llxULL, 0x%016llxULL,\n", (int)p->code[i].op,
+                (unsigned long long)(unsigned)p->code[i].a << 32 | (unsigned)p->code[i].b, bits);
+    }
+    fprintf(fp, "    0};\nconst int expr_outputs[] = {");
+    for (int i = 0; i < p->numOutputs; i++)
+        fprintf(fp, "%d, ", p->outputs[i]);
+    fprintf(fp, "0};\n\n");
+    fprintf(fp, "void expr_native(const double *v, double *out)\n{\n");
+    for (int i = 0; i < p->num; i++)
+    {
+        const Instruction *c = &p->code[i];
+        fprintf(fp, "    const double r%d = ", i);
+        switch (c->op)
+        {
+        case op_const:
+            emitConstant(c->value, fp);
+            break;
+        case op_var:
+            fprintf(fp, "v[%d]", c->a);
+            break;
+        case op_add:
+            fprintf(fp, "r%d + r%d", c->a, c->b);
+            break;
+        case op_sub:
+            fprintf(fp, "r%d - r%d", c->a, c->b);
+            break;
+        case op_mul:
+            fprintf(fp, "r%d * r%d", c->a, c->b);
+            break;
+        case op_div:
+            fprintf(fp, "r%d / r%d", c->a, c->b);
+            break;
+        case op_pow:
+            fprintf(fp, "pow(r%d, r%d)", c->a, c->b);
+            break;
+        case op_log:
+            fprintf(fp, "log(r%d) / log(r%d)", c->b, c->a);
+            break;
+        default:
+            fprintf(fp, "%s(r%d)", funs[c->op - op_ln], c->a);
+            break;
+        }
+        fprintf(fp, ";\n");
+    }
+    for (int i = 0; i < p->numOutputs; i++)
+        fprintf(fp, "    out[%d] = r%d;\n", i, p->outputs[i]);
+    fprintf(fp, "}\n");
+}
+
+/**
+ * @brief Create a directory and its parents
+ *
+ * @param path directory
+ * @return int 0 on success, -1 on failure
+ */
+static int makeDirectory(const char *path)
+{
+    char *temp = strdup(path);
+    if (!temp)
+        return -1;
+    for (char *c = temp + 1;; c++)
+    {
+        if (*c == '/' || *c == '\0')
+        {
+            char end = *c;
+            *c = '\0';
+            if (mkdir(temp, 0700) && errno != EEXIST)
+            {
+                free(temp);
+                return -1;
+            }
+            *c = end;
+            if (!end)
+                break;
+        }
+    }
+    free(temp);
+    return 0;
+}
+
+/**
+ * @brief Check that a directory is private to the user
+ *
+ * Shared objects found in the cache are loaded and run, so the cache must
+ * not be writable by anyone else: it must be a directory, not a symbolic
+ * link, owned by the user, with mode 0700.
+ *
+ * @param path directory
+ * @return int 1 if it is private, 0 if not
+ */
+static int privateDirectory(const char *path)
+{
+    struct stat st;
+    if (lstat(path, &st))
+        return 0;
+    return S_ISDIR(st.st_mode) && st.st_uid == getuid() && (st.st_mode & 0777) == 0700;
+}
+
+/**
+ * @brief Run the C compiler
+ *
+ * @param source C file
+ * @param object shared object to be written
+ * @return int 0 on success
+ */
+static int runCompiler(const char *source, const char *object)
+{
+    const char *cc = getenv("CC");
+    if (!cc || !*cc)
+        cc = "cc";
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0)
+    {
+        /* no contraction into fused multiply-adds, to match runProgram */
+        execlp(cc, cc, "-O2", "-ffp-contract=off", "-shared", "-fPIC", "-o", object, source,
+               "-lm", (char *)NULL);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        return -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Check that a shared object holds the code of a program
+ *
+ * The hash naming the shared object may collide, so the bytecode kept in it
+ * (see emitProgram) is compared in full.
+ *
+ * @param handle loaded shared object
+ * @param p program
+ * @return int 1 if it is the code of p, 0 if not
+ */
+static int sameProgram(void *handle, const Program *p)
+{
+    const int *num = (const int *)dlsym(handle, "expr_num");
+    const int *numOutputs = (const int *)dlsym(handle, "expr_num_outputs");
+    const unsigned long long *code = (const unsigned long long *)dlsym(handle, "expr_code");
+    const int *outputs = (const int *)dlsym(handle, "expr_outputs");
+    if (!num || !numOutputs || !code || !outputs || *num != p->num ||
+        *numOutputs != p->numOutputs)
+        return 0;
+    for (int i = 0; i < p->num; i++)
+    {
+        unsigned long long bits;
+        memcpy(&bits, &p->code[i].value, sizeof(bits));
+        if (code[3 * i] != (unsigned long long)p->code[i].op ||
+            code[3 * i + 1] != ((unsigned long long)(unsigned)p->code[i].a << 32 |
+                                (unsigned)p->code[i].b) ||
+            code[3 * i + 2] != bits)
+            return 0;
+    }
+    return !memcmp(outputs, p->outputs, sizeof(int) * p->numOutputs);
+}
+
+/**
+ * @brief Get the native code of a program
+ *
+ * The shared object is loaded from the cache if it is there, and compiled
+ * into the cache otherwise. The cache directory is refused unless it is
+ * private to the user (see privateDirectory), and a shared object which
+ * doesn't hold the bytecode of the program is not used (see sameProgram).
+ *
+ * @param p program
+ * @param cacheDir cache directory, NULL for the default
+ * @return NativeCode* loaded code, to be freed by freeNativeCode, NULL if the
+ * code can't be compiled or loaded (runProgram still works then)
+ */
+NativeCode *compileNative(const Program *p, const char *cacheDir)
+{
+    char dir[4096], object[4200], source[4200], temp[4200];
+    if (cacheDir)
+        snprintf(dir, sizeof(dir), "%s", cacheDir);
+    else if (getenv("XDG_CACHE_HOME") && *getenv("XDG_CACHE_HOME"))
+        snprintf(dir, sizeof(dir), "%s/expr", getenv("XDG_CACHE_HOME"));
+    else if (getenv("HOME") && *getenv("HOME"))
+        snprintf(dir, sizeof(dir), "%s/.cache/expr", getenv("HOME"));
+    else
+        snprintf(dir, sizeof(dir), "/tmp/expr-cache-%ld", (long)getuid());
+    if (makeDirectory(dir))
+    {
+        fprintf(stderr, "[compileNative] can't create %s.\n", dir);
+        return NULL;
+    }
+    if (!privateDirectory(dir))
+    {
+        fprintf(stderr, "[compileNative] %s is not a private directory.\n", dir);
+        return NULL;
+    }
+
+    NativeCode *ret = (NativeCode *)malloc(sizeof(NativeCode));
+    if (!ret)
+    {
+        fprintf(stderr, "[compileNative] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    ret->hash = hashProgram(p);
+    ret->cached = 1;
+    snprintf(object, sizeof(object), "%s/%016llx.so", dir, ret->hash);
+
+    if (access(object, R_OK))
+    {
+        /* compile to a private name, then publish it at once */
+        ret->cached = 0;
+        snprintf(source, sizeof(source), "%s/%016llx.%ld.c", dir, ret->hash, (long)getpid());
+        snprintf(temp, sizeof(temp), "%s/%016llx.%ld.so", dir, ret->hash, (long)getpid());
+        FILE *fp = fopen(source, "w");
+        if (!fp)
+        {
+            fprintf(stderr, "[compileNative] can't write %s.\n", source);
+            free(ret);
+            return NULL;
+        }
+        emitProgram(p, fp);
+        fclose(fp);
+        int failed = runCompiler(source, temp) || rename(temp, object);
+        remove(source);
+        if (failed)
+        {
+            remove(temp);
+            fprintf(stderr, "[compileNative] can't compile %s.\n", object);
+            free(ret);
+            return NULL;
+        }
+    }
+
+    ret->handle = dlopen(object, RTLD_NOW | RTLD_LOCAL);
+    if (!ret->handle)
+    {
+        fprintf(stderr, "[compileNative] %s\n", dlerror());
+        free(ret);
+        return NULL;
+    }
+    /* the conversion from void * is how dlsym is meant to be used */
+    *(void **)&ret->function = dlsym(ret->handle, "expr_native");
+    if (!ret->function)
+    {
+        fprintf(stderr, "[compileNative] %s\n", dlerror());
+        dlclose(ret->handle);
+        free(ret);
+        return NULL;
+    }
+    /* the file name could have been reused for other code, or collide */
+    if (!sameProgram(ret->handle, p))
+    {
+        fprintf(stderr, "[compileNative] %s is not the code of the program.\n", object);
+        dlclose(ret->handle);
+        free(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+/**
+ * @brief Unload the native code
+ *
+ * @param code code to be freed
+ */
+void freeNativeCode(NativeCode *code)
+{
+    dlclose(code->handle);
+    free(code);
+}
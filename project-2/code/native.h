@@ -0,0 +1,54 @@
+/**
+ * @file native.h
+ * @brief Native code for compiled programs.
+ *
+ * A program (see vm.h) is emitted as a C function, compiled by the local C
+ * compiler into a shared object, and loaded with dlopen, so evaluating it is
+ * a direct call without any interpretation. Shared objects are cached on
+ * disk by a structural hash of the program, so a repeated expression is only
+ * compiled once; a shared object keeps the bytecode it was compiled from, so
+ * a hash collision is detected before its code is used. Nothing but the
+ * compiler and the dynamic loader is needed.
+ */
+#ifndef _NATIVE_H_
+#define _NATIVE_H_
+
+#include "vm.h"
+#include <stdio.h>
+
+/**
+ * @brief Native function computing all the outputs of a program.
+ *
+ * vars and out are indexed like for runProgram.
+ */
+typedef void (*NativeFunction)(const double *vars, double *out);
+
+/**
+ * @brief Loaded native code.
+ */
+typedef struct native_code NativeCode;
+struct native_code
+{
+    void *handle;
+    NativeFunction function;
+    unsigned long long hash;
+    int cached; /* 1 if the shared object was found in the cache */
+};
+
+/**
+ * @defgroup native Native code functions
+ *
+ * The compiler is taken from the CC environment variable, cc by default.
+ * The cache directory is created if needed; if NULL, $XDG_CACHE_HOME/expr,
+ * ~/.cache/expr or /tmp/expr-cache-UID is used. It must be owned by the user
+ * with mode 0700.
+ *
+ * @{
+ */
+unsigned long long hashProgram(const Program *p);
+void emitProgram(const Program *p, FILE *fp);
+NativeCode *compileNative(const Program *p, const char *cacheDir);
+void freeNativeCode(NativeCode *code);
+/** @} */
+
+#endif
@@ -0,0 +1,371 @@
+#include "rewrite.h"
+#include "dag.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+const RewriteRule rewriteRules[NUM_REWRITE_RULES] = {
+    {"constant", constantOptimizer},
+    {"collect", collectOptimizer},
+};
+
+/**
+ * @brief Create a rewrite engine
+ *
+ * @param rules rule table, must outlive the engine
+ * @param numRules number of rules
+ * @param maxRounds most rounds per tree, in case the rules never settle
+ * @return Rewriter* new engine, not counting; set counting to fill the
+ * counters
+ */
+Rewriter *createRewriter(const RewriteRule *rules, int numRules, int maxRounds)
+{
+    Rewriter *ret = (Rewriter *)malloc(sizeof(Rewriter));
+    RewriteCounter *counters = (RewriteCounter *)calloc(numRules, sizeof(RewriteCounter));
+    if (!ret || !counters)
+    {
+        fprintf(stderr, "[createRewriter] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    *ret = (Rewriter){rules, numRules, maxRounds, 0, counters, 0, 0, 0, 0};
+    return ret;
+}
+
+static double seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Node census for countTreeNodes
+ *
+ * nodes maps each visited node to its value number; values maps (token,
+ * value number of a, value number of b) to a value number. Both are open
+ * addressing tables, at most half full.
+ */
+typedef struct census Census;
+struct census
+{
+    const Node **nodes;
+    int *nodeValues;
+    int numNodes, nodeBuckets; /* power of 2 */
+    Token *valueTokens;
+    int *valueA, *valueB; /* -2 in valueA marks an empty bucket */
+    int *valueIds;
+    int numValues, valueBuckets; /* power of 2 */
+};
+
+static unsigned mixHash(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (unsigned)x;
+}
+
+/**
+ * @brief Allocate zeroed memory or exit
+ *
+ * @param num number of elements
+ * @param width size of an element
+ * @return void* memory
+ */
+static void *zeroed(size_t num, size_t width)
+{
+    void *ret = calloc(num, width);
+    if (!ret)
+    {
+        fprintf(stderr, "[countTreeNodes] calloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+static int findNode(const Census *c, const Node *n)
+{
+    unsigned mask = c->nodeBuckets - 1;
+    unsigned i = mixHash((uintptr_t)n) & mask;
+    while (c->nodes[i] && c->nodes[i] != n)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static int findValue(const Census *c, Token t, int a, int b)
+{
+    unsigned mask = c->valueBuckets - 1;
+    uint64_t key = (uint64_t)t.type << 56 ^ (uint64_t)(unsigned)t.value << 32 ^
+                   (uint64_t)(unsigned)a << 16 ^ (unsigned)b;
+    unsigned i = mixHash(key) & mask;
+    while (c->valueA[i] != -2 &&
+           (c->valueTokens[i].type != t.type || c->valueTokens[i].value != t.value ||
+            c->valueA[i] != a || c->valueB[i] != b))
+        i = (i + 1) & mask;
+    return i;
+}
+
+/**
+ * @brief Double both tables of the census when one is half full
+ *
+ * @param c census
+ */
+static void growCensus(Census *c)
+{
+    if (c->numNodes * 2 >= c->nodeBuckets)
+    {
+        Census old = *c;
+        c->nodeBuckets *= 2;
+        c->nodes = (const Node **)zeroed(c->nodeBuckets, sizeof(Node *));
+        c->nodeValues = (int *)zeroed(c->nodeBuckets, sizeof(int));
+        for (int i = 0; i < old.nodeBuckets; i++)
+            if (old.nodes[i])
+            {
+                int j = findNode(c, old.nodes[i]);
+                c->nodes[j] = old.nodes[i];
+                c->nodeValues[j] = old.nodeValues[i];
+            }
+        free(old.nodes);
+        free(old.nodeValues);
+    }
+    if (c->numValues * 2 >= c->valueBuckets)
+    {
+        Census old = *c;
+        c->valueBuckets *= 2;
+        c->valueTokens = (Token *)zeroed(c->valueBuckets, sizeof(Token));
+        c->valueA = (int *)zeroed(c->valueBuckets, sizeof(int));
+        c->valueB = (int *)zeroed(c->valueBuckets, sizeof(int));
+        c->valueIds = (int *)zeroed(c->valueBuckets, sizeof(int));
+        for (int i = 0; i < c->valueBuckets; i++)
+            c->valueA[i] = -2;
+        for (int i = 0; i < old.valueBuckets; i++)
+            if (old.valueA[i] != -2)
+            {
+                int j = findValue(c, old.valueTokens[i], old.valueA[i], old.valueB[i]);
+                c->valueTokens[j] = old.valueTokens[i];
+                c->valueA[j] = old.valueA[i];
+                c->valueB[j] = old.valueB[i];
+                c->valueIds[j] = old.valueIds[i];
+            }
+        free(old.valueTokens);
+        free(old.valueA);
+        free(old.valueB);
+        free(old.valueIds);
+    }
+}
+
+/**
+ * @brief Value number of a node already in the census
+ *
+ * @param c census
+ * @param n node, may be NULL
+ * @return int value number, -1 for NULL
+ */
+static int nodeValue(const Census *c, const Node *n)
+{
+    return n ? c->nodeValues[findNode(c, n)] : -1;
+}
+
+static int numbered(const Census *c, const Node *n)
+{
+    return !n || c->nodes[findNode(c, n)];
+}
+
+/**
+ * @brief Number the values of a tree
+ *
+ * The nodes are numbered in post-order on an explicit stack, so deep trees
+ * do not overflow the call stack. Each node is visited once, so a DAG takes
+ * time linear in its nodes.
+ *
+ * @param c census
+ * @param n root, may be NULL
+ */
+static void numberTree(Census *c, const Node *n)
+{
+    if (numbered(c, n))
+        return;
+    int size = 64, num = 0;
+    const Node **stack = (const Node **)malloc(size * sizeof(Node *));
+    if (!stack)
+    {
+        fprintf(stderr, "[countTreeNodes] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    stack[num++] = n;
+    while (num)
+    {
+        const Node *top = stack[num - 1];
+        /* a node on the stack is not numbered yet, so it is never pushed twice */
+        const Node *child = !numbered(c, top->a) ? top->a
+                            : !numbered(c, top->b) ? top->b
+                                                   : NULL;
+        if (child)
+        {
+            if (num == size)
+            {
+                size *= 2;
+                stack = (const Node **)realloc(stack, size * sizeof(Node *));
+                if (!stack)
+                {
+                    fprintf(stderr, "[countTreeNodes] realloc failed.\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            stack[num++] = child;
+            continue;
+        }
+        num--;
+        int a = nodeValue(c, top->a);
+        int b = nodeValue(c, top->b);
+        int v = findValue(c, top->token, a, b);
+        if (c->valueA[v] == -2)
+        {
+            c->valueTokens[v] = top->token;
+            c->valueA[v] = a;
+            c->valueB[v] = b;
+            c->valueIds[v] = c->numValues++;
+        }
+        int slot = findNode(c, top);
+        c->nodes[slot] = top;
+        c->nodeValues[slot] = c->valueIds[v];
+        c->numNodes++;
+        growCensus(c);
+    }
+    free(stack);
+}
+
+/**
+ * @brief Count the nodes of a tree
+ *
+ * @param n root of the tree
+ * @param nodes number of distinct nodes reachable from n
+ * @param distinct number of distinct subtrees, after merging common
+ * subexpressions
+ */
+void countTreeNodes(const Node *n, long *nodes, long *distinct)
+{
+    Census c = {0};
+    c.nodeBuckets = c.valueBuckets = 64;
+    c.nodes = (const Node **)zeroed(c.nodeBuckets, sizeof(Node *));
+    c.nodeValues = (int *)zeroed(c.nodeBuckets, sizeof(int));
+    c.valueIds = (int *)zeroed(c.valueBuckets, sizeof(int));
+    c.valueTokens = (Token *)zeroed(c.valueBuckets, sizeof(Token));
+    c.valueA = (int *)zeroed(c.valueBuckets, sizeof(int));
+    c.valueB = (int *)zeroed(c.valueBuckets, sizeof(int));
+    for (int i = 0; i < c.valueBuckets; i++)
+        c.valueA[i] = -2;
+    numberTree(&c, n);
+    *nodes = c.numNodes;
+    *distinct = c.numValues;
+    free(c.nodes);
+    free(c.nodeValues);
+    free(c.valueIds);
+    free(c.valueTokens);
+    free(c.valueA);
+    free(c.valueB);
+}
+
+/**
+ * @brief Check whether a pass changed the tree
+ *
+ * Nodes of a node store are unique, so comparing pointers is enough there.
+ *
+ * @param before tree given to the pass
+ * @param after tree returned by the pass
+ * @return int 1 if changed
+ */
+static int changed(const Node *before, const Node *after)
+{
+    if (before == after)
+        return 0;
+    NodeStore *store = currentNodeStore();
+    if (store && isInterned(store, before) && isInterned(store, after))
+        return 1;
+    return !compareTree(before, after);
+}
+
+/**
+ * @brief Rewrite a tree to a fixpoint
+ *
+ * The rules run in table order, round after round, until a round changes
+ * nothing or maxRounds rounds have run. The passes memoize per node when a
+ * node store is in use, so a later round mostly finds its results there.
+ *
+ * @param r rewrite engine
+ * @param n root of the tree
+ * @return Node* rewritten tree
+ */
+Node *rewriteTree(Rewriter *r, const Node *n)
+{
+    if (r->maxRounds <= 0)
+        return copyTree(n);
+    const Node *cur = n;
+    long nodes = 0, distinct = 0;
+    if (r->counting)
+        countTreeNodes(cur, &nodes, &distinct);
+    for (int round = 0; round < r->maxRounds; round++)
+    {
+        int any = 0;
+        r->rounds++;
+        for (int i = 0; i < r->numRules; i++)
+        {
+            RewriteCounter *counter = &r->counters[i];
+            double start = r->counting ? seconds() : 0;
+            Node *next = r->rules[i].pass(cur);
+            if (r->counting)
+            {
+                counter->seconds += seconds() - start;
+                counter->before += nodes;
+                countTreeNodes(next, &nodes, &distinct);
+                counter->after += nodes;
+            }
+            counter->runs++;
+            if (changed(cur, next))
+            {
+                counter->changes++;
+                any = 1;
+            }
+            if (cur != n && cur != next)
+                freeTree((Node *)cur);
+            cur = next;
+        }
+        if (!any)
+            break;
+    }
+    r->trees++;
+    r->nodes += nodes;
+    r->distinct += distinct;
+    return (Node *)cur;
+}
+
+/**
+ * @brief Print the counters of the engine
+ *
+ * @param r rewrite engine
+ * @param fp output file
+ */
+void printRewriter(const Rewriter *r, FILE *fp)
+{
+    fprintf(fp, "%-10s %8s %8s %12s %12s %10s\n", "pass", "runs", "changes",
+            "nodes before", "nodes after", "seconds");
+    for (int i = 0; i < r->numRules; i++)
+    {
+        const RewriteCounter *c = &r->counters[i];
+        fprintf(fp, "%-10s %8ld %8ld %12ld %12ld %10.6f\n", r->rules[i].name, c->runs,
+                c->changes, c->before, c->after, c->seconds);
+    }
+    fprintf(fp, "%ld trees, %ld rounds, %ld nodes, %ld after merging common subexpressions\n",
+            r->trees, r->rounds, r->nodes, r->distinct);
+}
+
+/**
+ * @brief Free the rewrite engine
+ *
+ * @param r engine to be freed
+ */
+void freeRewriter(Rewriter *r)
+{
+    free(r->counters);
+    free(r);
+}
@@ -0,0 +1,84 @@
+/**
+ * @file rewrite.h
+ * @brief Fixpoint rewrite engine for the optimizers.
+ *
+ * One pass of constantOptimizer or collectOptimizer may leave work for the
+ * other: collecting x*2+x*3 gives 5*x only after constantOptimizer has
+ * removed the zeros and ones of a derivative, and collecting may produce new
+ * constants. The engine runs a table of passes in order until a whole round
+ * leaves the tree unchanged, and counts the nodes before and after each pass
+ * and the time spent in it.
+ */
+#ifndef _REWRITE_H_
+#define _REWRITE_H_
+
+#include "expression.h"
+#include <stdio.h>
+
+/**
+ * @brief Pass of the rewrite engine.
+ *
+ * A pass returns a new tree and leaves its argument alone, like
+ * constantOptimizer.
+ */
+typedef Node *(*RewritePass)(const Node *n);
+
+/**
+ * @brief Entry of the rule table.
+ */
+typedef struct rewrite_rule RewriteRule;
+struct rewrite_rule
+{
+    const char *name;
+    RewritePass pass;
+};
+
+/**
+ * @brief Counters of one rule, summed over all the rewritten trees.
+ */
+typedef struct rewrite_counter RewriteCounter;
+struct rewrite_counter
+{
+    long runs, changes;
+    long before, after; /* nodes */
+    double seconds;
+};
+
+/**
+ * @brief Rewrite engine type.
+ *
+ * Nodes are counted once per distinct node, so the shared subtrees of a DAG
+ * built in a node store are counted once. distinct counts the results after
+ * common subexpressions are merged: two subtrees with the same token and the
+ * same children count once, even when they are separate nodes.
+ */
+typedef struct rewriter Rewriter;
+struct rewriter
+{
+    const RewriteRule *rules;
+    int numRules, maxRounds;
+    int counting; /* 0, the default, to skip the counters */
+    RewriteCounter *counters; /* one per rule */
+    long trees, rounds;
+    long nodes, distinct; /* of the results */
+};
+
+/**
+ * @brief Rule table of rewriteTree: constantOptimizer, then collectOptimizer.
+ */
+#define NUM_REWRITE_RULES 2
+extern const RewriteRule rewriteRules[NUM_REWRITE_RULES];
+
+/**
+ * @defgroup rewrite Rewrite engine functions
+ *
+ * @{
+ */
+Rewriter *createRewriter(const RewriteRule *rules, int numRules, int maxRounds);
+Node *rewriteTree(Rewriter *r, const Node *n);
+void countTreeNodes(const Node *n, long *nodes, long *distinct);
+void printRewriter(const Rewriter *r, FILE *fp);
+void freeRewriter(Rewriter *r);
+/** @} */
+
+#endif
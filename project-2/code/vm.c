@@ -0,0 +1,642 @@
+#include "vm.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @brief Create a Program object
+ *
+ * The program will be dynamically allocated, so it must be freed by
+ * freeProgram after use.
+ *
+ * @param numVars number of variables in the variable list
+ * @return Program* created empty program
+ */
+Program *createProgram(int numVars)
+{
+    Program *ret = (Program *)malloc(sizeof(Program));
+    if (!ret)
+    {
+        fprintf(stderr, "[createProgram] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    ret->num = 0;
+    ret->size = 64;
+    ret->code = (Instruction *)malloc(sizeof(Instruction) * ret->size);
+    ret->numOutputs = 0;
+    ret->outputSize = 8;
+    ret->outputs = (int *)malloc(sizeof(int) * ret->outputSize);
+    ret->numVars = numVars;
+    ret->valueBuckets = 128;
+    ret->values = (int *)malloc(sizeof(int) * ret->valueBuckets);
+    ret->numNodes = 0;
+    ret->nodeBuckets = 128;
+    ret->nodes = (const Node **)calloc(ret->nodeBuckets, sizeof(Node *));
+    ret->nodeRegs = (int *)malloc(sizeof(int) * ret->nodeBuckets);
+    if (!ret->code || !ret->outputs || !ret->values || !ret->nodes || !ret->nodeRegs)
+    {
+        fprintf(stderr, "[createProgram] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ret->valueBuckets; i++)
+        ret->values[i] = -1;
+    return ret;
+}
+
+/**
+ * @brief Apply an operation
+ *
+ * Used by the interpreter and for constant folding by the compiler.
+ *
+ * @param op operation, neither op_const nor op_var
+ * @param x value of the first operand
+ * @param y value of the second operand
+ * @return double result
+ */
+static inline double apply(Opcode op, double x, double y)
+{
+    switch (op)
+    {
+    case op_add:
+        return x + y;
+    case op_sub:
+        return x - y;
+    case op_mul:
+        return x * y;
+    case op_div:
+        return x / y;
+    case op_pow:
+        return pow(x, y);
+    case op_ln:
+        return log(x);
+    case op_cos:
+        return cos(x);
+    case op_sin:
+        return sin(x);
+    case op_tan:
+        return tan(x);
+    case op_exp:
+        return exp(x);
+    case op_log:
+        return log(y) / log(x);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Hash an instruction by value
+ *
+ * @param i instruction
+ * @return unsigned hash value
+ */
+static unsigned hashInstruction(const Instruction *i)
+{
+    uint64_t bits;
+    memcpy(&bits, &i->value, sizeof(bits));
+    uint64_t h = (uint64_t)i->op * 0x9e3779b97f4a7c15ULL;
+    h ^= ((uint64_t)(unsigned)i->a << 32 | (unsigned)i->b) + 0x632be59bd9b4e019ULL + (h << 6) + (h >> 2);
+    h ^= bits + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (unsigned)h;
+}
+
+static int sameInstruction(const Instruction *x, const Instruction *y)
+{
+    return x->op == y->op && x->a == y->a && x->b == y->b &&
+           !memcmp(&x->value, &y->value, sizeof(double));
+}
+
+/**
+ * @brief Get the register computing the instruction
+ *
+ * The instruction is appended if no register computes it yet. Operations on
+ * constants are folded.
+ *
+ * @param p program
+ * @param i instruction
+ * @return int register
+ */
+static int emit(Program *p, Instruction i)
+{
+    if (i.op != op_const && i.op != op_var && p->code[i.a].op == op_const &&
+        (i.b == -1 || p->code[i.b].op == op_const))
+    {
+        double value = apply(i.op, p->code[i.a].value, i.b == -1 ? 0 : p->code[i.b].value);
+        i = (Instruction){op_const, -1, -1, value};
+    }
+
+    int slot = hashInstruction(&i) & (p->valueBuckets - 1);
+    while (p->values[slot] != -1)
+    {
+        if (sameInstruction(&p->code[p->values[slot]], &i))
+            return p->values[slot];
+        slot = (slot + 1) & (p->valueBuckets - 1);
+    }
+
+    if (p->num == p->size)
+    {
+        p->size *= 2;
+        p->code = realloc(p->code, sizeof(Instruction) * p->size);
+        if (!p->code)
+        {
+            fprintf(stderr, "[emit] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    p->code[p->num] = i;
+    p->values[slot] = p->num;
+
+    /* keep the load factor of the table under 1/2 */
+    if (2 * (p->num + 1) > p->valueBuckets)
+    {
+        p->valueBuckets *= 2;
+        free(p->values);
+        p->values = (int *)malloc(sizeof(int) * p->valueBuckets);
+        if (!p->values)
+        {
+            fprintf(stderr, "[emit] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int j = 0; j < p->valueBuckets; j++)
+            p->values[j] = -1;
+        for (int j = 0; j <= p->num; j++)
+        {
+            int s = hashInstruction(&p->code[j]) & (p->valueBuckets - 1);
+            while (p->values[s] != -1)
+                s = (s + 1) & (p->valueBuckets - 1);
+            p->values[s] = j;
+        }
+    }
+    return p->num++;
+}
+
+/**
+ * @brief Find the slot of a node in the table of compiled nodes
+ *
+ * @param p program
+ * @param n node
+ * @return int slot of n, or of the empty slot where n belongs
+ */
+static int nodeSlot(const Program *p, const Node *n)
+{
+    uint64_t h = (uint64_t)(uintptr_t)n;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    int slot = (int)(h & (uint64_t)(p->nodeBuckets - 1));
+    while (p->nodes[slot] && p->nodes[slot] != n)
+        slot = (slot + 1) & (p->nodeBuckets - 1);
+    return slot;
+}
+
+/**
+ * @brief Remember the register of a compiled node
+ *
+ * @param p program
+ * @param n node
+ * @param reg register computing n
+ */
+static void rememberNode(Program *p, const Node *n, int reg)
+{
+    if (2 * (p->numNodes + 1) > p->nodeBuckets)
+    {
+        const Node **nodes = p->nodes;
+        int *regs = p->nodeRegs;
+        int buckets = p->nodeBuckets;
+        p->nodeBuckets *= 2;
+        p->nodes = (const Node **)calloc(p->nodeBuckets, sizeof(Node *));
+        p->nodeRegs = (int *)malloc(sizeof(int) * p->nodeBuckets);
+        if (!p->nodes || !p->nodeRegs)
+        {
+            fprintf(stderr, "[rememberNode] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < buckets; i++)
+        {
+            if (nodes[i])
+            {
+                int slot = nodeSlot(p, nodes[i]);
+                p->nodes[slot] = nodes[i];
+                p->nodeRegs[slot] = regs[i];
+            }
+        }
+        free(nodes);
+        free(regs);
+    }
+    int slot = nodeSlot(p, n);
+    p->nodes[slot] = n;
+    p->nodeRegs[slot] = reg;
+    p->numNodes++;
+}
+
+/**
+ * @brief Register of a node compiled before
+ *
+ * @param p program
+ * @param n node, may be NULL
+ * @return int register computing n, -1 if n is NULL or not compiled
+ */
+static int nodeRegister(const Program *p, const Node *n)
+{
+    if (!n)
+        return -1;
+    int slot = nodeSlot(p, n);
+    return p->nodes[slot] ? p->nodeRegs[slot] : -1;
+}
+
+/**
+ * @brief Compile a node whose children are compiled
+ *
+ * @param p program
+ * @param n node
+ * @return int register computing n
+ */
+static int compileInstruction(Program *p, const Node *n)
+{
+    Instruction i = {op_const, -1, -1, 0};
+    switch (n->token.type)
+    {
+    case digit:
+        i.value = n->token.value;
+        break;
+    case variable:
+        i.op = op_var;
+        i.a = n->token.value;
+        break;
+    case operator:
+        i.a = nodeRegister(p, n->a);
+        i.b = nodeRegister(p, n->b);
+        switch (n->token.value)
+        {
+        case '+':
+            i.op = op_add;
+            break;
+        case '-':
+            i.op = op_sub;
+            break;
+        case '*':
+            i.op = op_mul;
+            break;
+        case '/':
+            i.op = op_div;
+            break;
+        case '^':
+            i.op = op_pow;
+            break;
+        }
+        break;
+    case fun1:
+        i.a = nodeRegister(p, n->a);
+        i.op = (Opcode)(op_ln + n->token.value);
+        break;
+    case fun2:
+        i.a = nodeRegister(p, n->a);
+        i.b = nodeRegister(p, n->b);
+        i.op = n->token.value == 0 ? op_log : op_pow;
+        break;
+    default:
+        fprintf(stderr, "[compileTree] Invalid node.\n");
+        exit(EXIT_FAILURE);
+    }
+    int reg = emit(p, i);
+    rememberNode(p, n, reg);
+    return reg;
+}
+
+/**
+ * @brief Compile a subtree
+ *
+ * The nodes are compiled children first, left to right, on an explicit
+ * stack, so deep trees don't overflow the call stack. A node on the stack is
+ * not compiled yet, so it is never pushed twice.
+ *
+ * @param p program
+ * @param n root of the subtree
+ * @return int register computing n
+ */
+static int compileNode(Program *p, const Node *n)
+{
+    int reg = nodeRegister(p, n);
+    if (reg != -1)
+        return reg;
+    int size = 64, num = 0;
+    const Node **stack = (const Node **)malloc(sizeof(Node *) * size);
+    if (!stack)
+    {
+        fprintf(stderr, "[compileTree] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    stack[num++] = n;
+    while (num)
+    {
+        const Node *top = stack[num - 1];
+        const Node *child = top->a && nodeRegister(p, top->a) == -1   ? top->a
+                            : top->b && nodeRegister(p, top->b) == -1 ? top->b
+                                                                      : NULL;
+        if (!child)
+        {
+            reg = compileInstruction(p, top);
+            num--;
+            continue;
+        }
+        if (num == size)
+        {
+            size *= 2;
+            stack = (const Node **)realloc(stack, sizeof(Node *) * size);
+            if (!stack)
+            {
+                fprintf(stderr, "[compileTree] malloc failed.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        stack[num++] = child;
+    }
+    free(stack);
+    return reg;
+}
+
+/**
+ * @brief Compile a tree into the program
+ *
+ * The tree becomes the next output of the program. Subexpressions already
+ * computed by the program, for this or an earlier tree, are reused. The tree
+ * may be freed afterwards.
+ *
+ * @param p program
+ * @param n root of the tree
+ * @return int index of the output
+ */
+int compileTree(Program *p, const Node *n)
+{
+    if (p->numOutputs == p->outputSize)
+    {
+        p->outputSize *= 2;
+        p->outputs = realloc(p->outputs, sizeof(int) * p->outputSize);
+        if (!p->outputs)
+        {
+            fprintf(stderr, "[compileTree] malloc failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    p->outputs[p->numOutputs] = compileNode(p, n);
+    /* the nodes may be freed, so they must not be looked up again */
+    memset(p->nodes, 0, sizeof(Node *) * p->nodeBuckets);
+    p->numNodes = 0;
+    return p->numOutputs++;
+}
+
+/**
+ * @brief Compile an expression and its derivatives
+ *
+ * Output 0 is the expression, output 1 + i its derivative with respect to
+ * variable i (an index of the variable list, not of dictOrder). The
+ * derivatives are computed by autoGrad and constantOptimizer, so they follow
+ * the node store or arena in use.
+ *
+ * @param n root of the expression
+ * @param numVars number of variables in the variable list
+ * @return Program* compiled program
+ */
+Program *compileGradient(Node *n, int numVars)
+{
+    Program *p = createProgram(numVars);
+    compileTree(p, n);
+    for (int i = 0; i < numVars; i++)
+    {
+        Node *diffTree = autoGrad(n, i);
+        Node *optDiffTree = constantOptimizer(diffTree);
+        freeTree(diffTree);
+        compileTree(p, optDiffTree);
+        freeTree(optDiffTree);
+    }
+    return p;
+}
+
+/**
+ * @brief Run the program
+ *
+ * @param p program
+ * @param vars value of each variable
+ * @param regs scratch space for p->num registers
+ * @param out value of each output
+ */
+void runProgram(const Program *p, const double *vars, double *regs, double *out)
+{
+    const Instruction *code = p->code;
+    for (int i = 0; i < p->num; i++)
+    {
+        switch (code[i].op)
+        {
+        case op_const:
+            regs[i] = code[i].value;
+            break;
+        case op_var:
+            regs[i] = vars[code[i].a];
+            break;
+        case op_add:
+            regs[i] = regs[code[i].a] + regs[code[i].b];
+            break;
+        case op_sub:
+            regs[i] = regs[code[i].a] - regs[code[i].b];
+            break;
+        case op_mul:
+            regs[i] = regs[code[i].a] * regs[code[i].b];
+            break;
+        case op_div:
+            regs[i] = regs[code[i].a] / regs[code[i].b];
+            break;
+        default:
+            regs[i] = apply(code[i].op, regs[code[i].a], code[i].b == -1 ? 0 : regs[code[i].b]);
+            break;
+        }
+    }
+    for (int i = 0; i < p->numOutputs; i++)
+        out[i] = regs[p->outputs[i]];
+}
+
+/**
+ * @brief Four doubles processed by one vector instruction.
+ *
+ * This is a GCC vector extension: with AVX it is one register, without it
+ * the compiler splits it into two SSE2 registers.
+ */
+typedef double Lanes __attribute__((vector_size(4 * sizeof(double))));
+#define VM_LANES 4
+
+/* r = x OP y for the whole block, VM_LANES points at a time */
+#define LANE_LOOP(OP)                                   \
+    for (int l = 0; l < VM_BLOCK; l += VM_LANES)        \
+    {                                                   \
+        Lanes u, v, w;                                  \
+        memcpy(&u, x + l, sizeof(Lanes));               \
+        memcpy(&v, y + l, sizeof(Lanes));               \
+        w = u OP v;                                     \
+        memcpy(r + l, &w, sizeof(Lanes));               \
+    }
+
+/**
+ * @brief Run the program on one block of points
+ *
+ * Each instruction is applied to the whole block before the next one, so
+ * the dispatch costs once per block, and + - * / work on VM_LANES points per
+ * vector instruction. The functions are applied point by point.
+ *
+ * @param p program
+ * @param columns value of each variable at each point
+ * @param outputs value of each output at each point
+ * @param start first point of the block
+ * @param n number of points in the block, at most VM_BLOCK
+ * @param regs scratch space for p->num * VM_BLOCK registers
+ */
+static void runBlock(const Program *p, const double *const *columns,
+                     double *const *outputs, long start, int n, double *regs)
+{
+    const Instruction *code = p->code;
+    for (int i = 0; i < p->num; i++)
+    {
+        double *r = regs + (long)i * VM_BLOCK;
+        const double *x = code[i].a >= 0 ? regs + (long)code[i].a * VM_BLOCK : NULL;
+        const double *y = code[i].b >= 0 ? regs + (long)code[i].b * VM_BLOCK : NULL;
+        switch (code[i].op)
+        {
+        case op_const:
+            for (int l = 0; l < VM_BLOCK; l++)
+                r[l] = code[i].value;
+            break;
+        case op_var:
+            memcpy(r, columns[code[i].a] + start, sizeof(double) * n);
+            /* keep the unused lanes harmless */
+            for (int l = n; l < VM_BLOCK; l++)
+                r[l] = 1;
+            break;
+        case op_add:
+            LANE_LOOP(+);
+            break;
+        case op_sub:
+            LANE_LOOP(-);
+            break;
+        case op_mul:
+            LANE_LOOP(*);
+            break;
+        case op_div:
+            LANE_LOOP(/);
+            break;
+        default:
+            for (int l = 0; l < n; l++)
+                r[l] = apply(code[i].op, x[l], y ? y[l] : 0);
+            for (int l = n; l < VM_BLOCK; l++)
+                r[l] = 1;
+            break;
+        }
+    }
+    for (int i = 0; i < p->numOutputs; i++)
+        memcpy(outputs[i] + start, regs + (long)p->outputs[i] * VM_BLOCK, sizeof(double) * n);
+}
+
+/**
+ * @brief Range of points for one thread of runProgramBatch.
+ */
+typedef struct batch_job BatchJob;
+struct batch_job
+{
+    const Program *p;
+    const double *const *columns;
+    double *const *outputs;
+    long start, end;
+};
+
+/**
+ * @brief Run the program on a range of points, block by block
+ *
+ * @param arg BatchJob
+ * @return void* NULL
+ */
+static void *runJob(void *arg)
+{
+    const BatchJob *job = (const BatchJob *)arg;
+    double *regs = (double *)malloc(sizeof(double) * VM_BLOCK * (job->p->num ? job->p->num : 1));
+    if (!regs)
+    {
+        fprintf(stderr, "[runProgramBatch] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (long k = job->start; k < job->end; k += VM_BLOCK)
+    {
+        int n = job->end - k < VM_BLOCK ? (int)(job->end - k) : VM_BLOCK;
+        runBlock(job->p, job->columns, job->outputs, k, n, regs);
+    }
+    free(regs);
+    return NULL;
+}
+
+/**
+ * @brief Run the program on many points
+ *
+ * The points are split into chunks of whole blocks, one per thread.
+ *
+ * @param p program
+ * @param columns columns[v][k] is the value of variable v at point k
+ * @param outputs outputs[o][k] is set to the value of output o at point k
+ * @param count number of points
+ * @param threads number of threads, 0 for one per online CPU
+ */
+void runProgramBatch(const Program *p, const double *const *columns,
+                     double *const *outputs, long count, int threads)
+{
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long blocks = (count + VM_BLOCK - 1) / VM_BLOCK;
+    if (threads > blocks)
+        threads = (int)blocks;
+    if (threads <= 1)
+    {
+        BatchJob job = {p, columns, outputs, 0, count};
+        runJob(&job);
+        return;
+    }
+
+    pthread_t *tids = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    BatchJob *jobs = (BatchJob *)malloc(sizeof(BatchJob) * threads);
+    if (!tids || !jobs)
+    {
+        fprintf(stderr, "[runProgramBatch] malloc failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        long start = blocks * t / threads * VM_BLOCK;
+        long end = blocks * (t + 1) / threads * VM_BLOCK;
+        jobs[t] = (BatchJob){p, columns, outputs, start, end < count ? end : count};
+        if (pthread_create(&tids[t], NULL, runJob, &jobs[t]))
+        {
+            fprintf(stderr, "[runProgramBatch] pthread_create failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int t = 0; t < threads; t++)
+        pthread_join(tids[t], NULL);
+    free(tids);
+    free(jobs);
+}
+
+/**
+ * @brief Free the program
+ *
+ * @param p program to be freed
+ */
+void freeProgram(Program *p)
+{
+    free(p->code);
+    free(p->outputs);
+    free(p->values);
+    free(p->nodes);
+    free(p->nodeRegs);
+    free(p);
+}
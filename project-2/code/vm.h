@@ -0,0 +1,92 @@
+/**
+ * @file vm.h
+ * @brief Bytecode compiler and interpreter for numeric evaluation.
+ *
+ * Trees are compiled to register bytecode: instruction i computes register i
+ * from registers before it, so a program runs in one pass over an array of
+ * doubles. Instructions are numbered by value, so a subexpression appearing
+ * several times, in one tree or across the trees of a program (an expression
+ * and its derivatives), is computed once.
+ */
+#ifndef _VM_H_
+#define _VM_H_
+
+#include "expression.h"
+
+/**
+ * @brief Operation of an instruction.
+ */
+enum opcode
+{
+    op_const, /* value */
+    op_var,   /* variable a */
+    op_add,
+    op_sub,
+    op_mul,
+    op_div,
+    op_pow,
+    op_ln,
+    op_cos,
+    op_sin,
+    op_tan,
+    op_exp,
+    op_log /* log(a, b) = ln(b) / ln(a) */
+};
+typedef enum opcode Opcode;
+
+/**
+ * @brief Instruction type.
+ *
+ * a and b are the registers of the operands.
+ */
+typedef struct instruction Instruction;
+struct instruction
+{
+    Opcode op;
+    int a, b;
+    double value;
+};
+
+/**
+ * @brief Number of points runProgramBatch evaluates per instruction.
+ */
+#define VM_BLOCK 64
+
+/**
+ * @brief Program type.
+ *
+ * outputs holds the register of the root of each compiled tree. The two hash
+ * tables are only used by the compiler: one numbers the instructions by
+ * value, the other remembers the register of each node of the tree being
+ * compiled, so the nodes shared in a DAG are visited once.
+ */
+typedef struct program Program;
+struct program
+{
+    Instruction *code;
+    int num, size;
+    int *outputs;
+    int numOutputs, outputSize;
+    int numVars;
+    int *values;
+    int valueBuckets; /* power of 2 */
+    const Node **nodes;
+    int *nodeRegs;
+    int numNodes, nodeBuckets; /* power of 2 */
+};
+
+/**
+ * @defgroup vm Bytecode functions
+ *
+ * @{
+ */
+Program *createProgram(int numVars);
+int compileTree(Program *p, const Node *n);
+Program *compileGradient(Node *n, int numVars);
+void runProgram(const Program *p, const double *vars, double *regs, double *out);
+void runProgramBatch(const Program *p, const double *const *columns,
+                     double *const *outputs, long count, int threads);
+void freeProgram(Program *p);
+/** @} */
+
+#endif